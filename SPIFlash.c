@@ -35,7 +35,12 @@
 
 #include "SPIFlash.h"
 #include <string.h>
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+#include <sched.h>
+#include "SPIFlashSim.h"
+#else
 #include "spi.h"
+#endif
 
 /* Macros ---------------------------------------------------------------------*/
 
@@ -48,8 +53,9 @@ extern int _write(int file, char* ptr, int len);
 #endif
 
 #define SPIFLASH_PAGE_SIZE   (1 << 8)
-#define SPIFLASH_SECTOR_SIZE (1 << 12)
-#define SPIFLASH_BLOCK_SIZE  (1 << 16)
+#define SPIFLASH_SECTOR_SIZE    (1 << 12)
+#define SPIFLASH_HALFBLOCK_SIZE (1 << 15)
+#define SPIFLASH_BLOCK_SIZE     (1 << 16)
 
 #define SPIFLASH_PAGE2SECTOR(pageNumber)                                                                               \
     (pageNumber >> 4) /* ((pageNumber * SPIFLASH_PAGE_SIZE) / SPIFLASH_SECTOR_SIZE) */
@@ -69,7 +75,33 @@ extern int _write(int file, char* ptr, int len);
 #define SPIFLASH_ADDRESS2SECTOR(address)      (address >> 12)      /* (address / SPIFLASH_SECTOR_SIZE) */
 #define SPIFLASH_ADDRESS2BLOCK(address)       (address >> 16)      /* (address / SPIFLASH_BLOCK_SIZE) */
 
+#define SPIFLASH_ADDR4(SPIFlash)              ((SPIFlash)->chip.addrBytes == 4)
+
+#define SPIFLASH_ASYNC_IDLE                   0
+#define SPIFLASH_ASYNC_ERASE                  1
+#define SPIFLASH_ASYNC_WRITE                  2
+#define SPIFLASH_ASYNC_STREAM                 3
+
 #define SPIFLASH_DUMMY_BYTE                   0xA5
+#define SPIFLASH_MODE_BYTE                    0xFF /* M5-4 != 10b: no continuous read mode */
+#define SPIFLASH_READ_HEADER                  8    /* opcode, 4 address bytes and up to 3 mode/dummy bytes */
+#define SPIFLASH_RELEASE_TIME                 30   /* tRES1 in us without SFDP, W25Q-class chips need 3 */
+#define SPIFLASH_IDLE_MAX                     3600000000UL /* 1 h, the us tick wraps after about 71 min */
+
+#define SPIFLASH_SFDP_SIGNATURE               0x50444653 /* "SFDP" */
+#define SPIFLASH_SFDP_BFPT                    0xFF00     /* Basic Flash Parameter Table */
+#define SPIFLASH_SFDP_4BAIT                   0xFF84     /* 4-byte Address Instruction Table */
+#define SPIFLASH_SFDP_HEADERS                 8          /* parameter headers looked at */
+#define SPIFLASH_SFDP_DWORDS                  16         /* BFPT length up to JESD216B */
+
+#define SPIFLASH_QER_NONE                     0    /* no QE bit */
+#define SPIFLASH_QER_SR2_BIT1_01              1    /* QE is SR2 bit 1, written with 0x01 and 2 data bytes */
+#define SPIFLASH_QER_SR1_BIT6                 2    /* QE is SR1 bit 6 */
+#define SPIFLASH_QER_SR2_BIT7                 3    /* QE is SR2 bit 7, accessed with 0x3E/0x3F */
+#define SPIFLASH_QER_SR2_BIT1_01_KEEP         4    /* as SPIFLASH_QER_SR2_BIT1_01 */
+#define SPIFLASH_QER_SR2_BIT1_35              5    /* as SPIFLASH_QER_SR2_BIT1_01, SR2 read with 0x35 */
+#define SPIFLASH_QER_SR2_BIT1_31              6    /* QE is SR2 bit 1, read with 0x35 and written with 0x31 */
+#define SPIFLASH_QER_UNKNOWN                  0xFF /* quad mode not used */
 
 #define SPIFLASH_CMD_READSFDP                 0x5A
 #define SPIFLASH_CMD_ID                       0x90
@@ -92,8 +124,20 @@ extern int _write(int file, char* ptr, int len);
 #define SPIFLASH_CMD_READDATA4ADD             0x13
 #define SPIFLASH_CMD_FASTREAD3ADD             0x0B
 #define SPIFLASH_CMD_FASTREAD4ADD             0x0C
+#define SPIFLASH_CMD_DUALOUTREAD3ADD          0x3B
+#define SPIFLASH_CMD_DUALOUTREAD4ADD          0x3C
+#define SPIFLASH_CMD_DUALIOREAD3ADD           0xBB
+#define SPIFLASH_CMD_DUALIOREAD4ADD           0xBC
+#define SPIFLASH_CMD_QUADOUTREAD3ADD          0x6B
+#define SPIFLASH_CMD_QUADOUTREAD4ADD          0x6C
+#define SPIFLASH_CMD_QUADIOREAD3ADD           0xEB
+#define SPIFLASH_CMD_QUADIOREAD4ADD           0xEC
+#define SPIFLASH_CMD_QUADPAGEPROG3ADD         0x32
+#define SPIFLASH_CMD_QUADPAGEPROG4ADD         0x34
 #define SPIFLASH_CMD_SECTORERASE3ADD          0x20
 #define SPIFLASH_CMD_SECTORERASE4ADD          0x21
+#define SPIFLASH_CMD_HALFBLOCKERASE3ADD       0x52
+#define SPIFLASH_CMD_HALFBLOCKERASE4ADD       0x5C
 #define SPIFLASH_CMD_BLOCKERASE3ADD           0xD8
 #define SPIFLASH_CMD_BLOCKERASE4ADD           0xDC
 #define SPIFLASH_CMD_CHIPERASE1               0x60
@@ -112,6 +156,7 @@ extern int _write(int file, char* ptr, int len);
 #define SPIFlashSTATUS1_TP                    (1 << 5)
 #define SPIFlashSTATUS1_SEC                   (1 << 6)
 #define SPIFlashSTATUS1_SRP0                  (1 << 7)
+#define SPIFlashSTATUS1_QE_MXIC               (1 << 6) /* QE location on Macronix/ISSI parts */
 
 #define SPIFlashSTATUS2_SRP1                  (1 << 0)
 #define SPIFlashSTATUS2_QE                    (1 << 1)
@@ -133,168 +178,473 @@ extern int _write(int file, char* ptr, int len);
 
 /* HW Interface  functions ----------------------------------------------------*/
 
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+
+#define SPIFlashDelay(x)                      SPIFlashSimDelay(x)
+
+#define SPIFlashGetTick()                     SPIFlashSimGetTick()
+
+#define SPIFlashGetTickUs()                   ((uint32_t)(SPIFlashSimGetTimeNs() / 1000))
+
+#define SPIFlashDelayUs(x)                    SPIFlashSimAdvanceNs(1000ULL * (x))
+
+#define SPIFlash_WRITE_PIN(port, pin, status) SPIFlashSimWritePin(port, status)
+
+#define SPIFlash_PIN_SET                      1
+#define SPIFlash_PIN_RESET                    0
+
+#define SPIFlashBusClock(SPIFlash)            (((SPIFlashSim_t*)(SPIFlash)->hSPI)->config.clock)
+
+#define SPIFlashBusLines(SPIFlash)            (((SPIFlashSim_t*)(SPIFlash)->hSPI)->config.lines)
+
+#else
+
 #define SPIFlashDelay(x)                      HAL_Delay(x)
 
 #define SPIFlashGetTick()                     HAL_GetTick()
 
+#ifdef SPIFLASH_TICK_US
+#define SPIFlashGetTickUs() SPIFLASH_TICK_US()
+#else
+#define SPIFlashGetTickUs() SPIFlashSysTickUs()
+
+/* Assumes the default 1 kHz SysTick time base */
+static uint32_t SPIFlashSysTickUs(void) {
+    uint32_t ms, val;
+    do {
+        ms = HAL_GetTick();
+        val = SysTick->VAL;
+    } while (ms != HAL_GetTick());
+    return ms * 1000 + ((SysTick->LOAD - val) * 1000) / (SysTick->LOAD + 1);
+}
+#endif
+
+static void SPIFlashDelayUs(uint32_t us) {
+    uint32_t start = SPIFlashGetTickUs();
+    if (us >= 2000) {
+        /* HAL_Delay() adds one tick */
+        SPIFlashDelay(us / 1000 - 1);
+    }
+    while (SPIFlashGetTickUs() - start < us) {}
+}
+
 #define SPIFlash_WRITE_PIN(port, pin, status) HAL_GPIO_WritePin(port, pin, status)
 
 #define SPIFlash_PIN_SET                      GPIO_PIN_SET
 #define SPIFlash_PIN_RESET                    GPIO_PIN_RESET
 
+#define SPIFlashBusClock(SPIFlash)            SPIFLASH_SPI_CLOCK
+
+#define SPIFlashBusLines(SPIFlash)            SPIFLASH_LINES
+
+#if (SPIFLASH_LINES != 1)
+#error "HAL SPI transfers are single-line, SPIFLASH_LINES must be 1"
+#endif
+
+#endif
+
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_IRQ) && (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+#error "SPIFLASH_LOCK_IRQ masks Cortex-M interrupts and cannot guard host threads"
+#endif
+
+#ifndef SPIFLASH_LOCK_YIELD
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+#define SPIFLASH_LOCK_YIELD() sched_yield()
+#else
+#define SPIFLASH_LOCK_YIELD() SPIFlashDelay(1)
+#endif
+#endif
+
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
+static SPIFlashStatus_t SPIFlashWaitDMA(SPIFlash_t* SPIFlash, uint32_t Timeout) {
+    uint32_t startTime = SPIFlashGetTick();
+    while (HAL_SPI_GetState(SPIFlash->hSPI) != HAL_SPI_STATE_READY) {
+        if (SPIFlashGetTick() - startTime >= Timeout) {
+            HAL_SPI_DMAStop(SPIFlash->hSPI);
+            return SPIFLASH_TIMEOUT;
+        }
+    }
+    return SPIFLASH_SUCCESS;
+}
+#endif
+
 static SPIFlashStatus_t SPIFlashTransmitReceive(SPIFlash_t* SPIFlash, uint8_t* Tx, uint8_t* Rx, size_t size,
                                                 uint32_t Timeout) {
-#if (SPIFlashPLATFORM == SPIFlashPLATFORM_HAL)
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL)
     if (HAL_SPI_TransmitReceive(SPIFlash->hSPI, Tx, Rx, size, Timeout) == HAL_OK) {
         return SPIFLASH_SUCCESS;
     } else {
         return SPIFLASH_TIMEOUT;
     }
 
-#elif (SPIFlashPLATFORM == SPIFlashPLATFORM_HAL_DMA)
-    uint32_t startTime = SPIFlashGetTick();
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
     if (HAL_SPI_TransmitReceive_DMA(SPIFlash->hSPI, Tx, Rx, size) != HAL_OK) {
         return SPIFLASH_ERROR;
-    } else {
-        while (1) {
-            SPIFlashDelay(1);
-            if (SPIFlashGetTick() - startTime >= Timeout) {
-                HAL_SPI_DMAStop(SPIFlash->hSPI);
-                return SPIFLASH_TIMEOUT;
-            }
-            if (HAL_SPI_GetState(SPIFlash->hSPI) == HAL_SPI_STATE_READY) {
-                retVal = SPIFLASH_SUCCESS;
-                return SPIFLASH_SUCCESS;
-            }
-        }
     }
+    return SPIFlashWaitDMA(SPIFlash, Timeout);
+
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+    (void)Timeout;
+    return SPIFlashSimTransmitReceive(SPIFlash->hSPI, Tx, Rx, size);
+#endif
+}
+
+/* Transmit-only burst: MISO is ignored and the source buffer is left untouched */
+static SPIFlashStatus_t SPIFlashTransmit(SPIFlash_t* SPIFlash, const uint8_t* Tx, size_t size, uint8_t lines,
+                                         uint32_t Timeout) {
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL)
+    (void)lines;
+    return (HAL_SPI_Transmit(SPIFlash->hSPI, (uint8_t*)Tx, size, Timeout) == HAL_OK) ? SPIFLASH_SUCCESS
+                                                                                     : SPIFLASH_ERROR;
+
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
+    (void)lines;
+    if (HAL_SPI_Transmit_DMA(SPIFlash->hSPI, (uint8_t*)Tx, size) != HAL_OK) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashWaitDMA(SPIFlash, Timeout);
+
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+    (void)Timeout;
+    return SPIFlashSimTransfer(SPIFlash->hSPI, Tx, NULL, size, lines);
+#endif
+}
+
+/* Receive-only burst: MOSI content is don't-care */
+static SPIFlashStatus_t SPIFlashReceive(SPIFlash_t* SPIFlash, uint8_t* Rx, size_t size, uint8_t lines,
+                                        uint32_t Timeout) {
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL)
+    (void)lines;
+    return (HAL_SPI_Receive(SPIFlash->hSPI, Rx, size, Timeout) == HAL_OK) ? SPIFLASH_SUCCESS : SPIFLASH_ERROR;
+
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
+    (void)lines;
+    if (HAL_SPI_Receive_DMA(SPIFlash->hSPI, Rx, size) != HAL_OK) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashWaitDMA(SPIFlash, Timeout);
+
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+    (void)Timeout;
+    return SPIFlashSimTransfer(SPIFlash->hSPI, NULL, Rx, size, lines);
 #endif
 }
 
+#if SPIFLASH_SCRATCH_STATIC
+static uint8_t SPIFlashScratch[SPIFLASH_SECTOR_SIZE];
+#endif
+
 /* Static  functions ----------------------------------------------------------*/
 
-static void SPIFlashLock(SPIFlash_t* SPIFlash) {
-    while (SPIFlash->lock) {
-        SPIFlashDelay(1);
+static void SPIFlashLock(SPIFlash_t* SPIFlash) { SPIFlashLockAcquire(&SPIFlash->lock); }
+
+#if SPIFLASH_POWERDOWN
+static void SPIFlashUnLock(SPIFlash_t* SPIFlash) {
+    SPIFlash->power.lastActivity = SPIFlashGetTickUs();
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+#else
+static void SPIFlashUnLock(SPIFlash_t* SPIFlash) { SPIFlashLockRelease(&SPIFlash->lock); }
+#endif
+
+#if SPIFLASH_STATS
+static void SPIFlashStatsAdd(SPIFlashOpStats_t* stats, uint32_t bytes, uint32_t us) {
+    uint8_t bucket = (us == 0) ? 0 : (31 - __builtin_clz(us));
+    if ((stats->count == 0) || (us < stats->min)) {
+        stats->min = us;
+    }
+    if (us > stats->max) {
+        stats->max = us;
     }
-    SPIFlash->lock = 1;
+    stats->count++;
+    stats->bytes += bytes;
+    stats->total += us;
+    stats->histogram[(bucket < SPIFLASH_STATS_BUCKETS) ? bucket : (SPIFLASH_STATS_BUCKETS - 1)]++;
 }
+#else
+#define SPIFlashStatsAdd(stats, bytes, us)
+#endif
 
-static void SPIFlashUnLock(SPIFlash_t* SPIFlash) { SPIFlash->lock = 0; }
+#if SPIFLASH_TRACE
+static void SPIFlashTraceAdd(SPIFlash_t* SPIFlash, uint8_t event, uint8_t opcode, uint32_t address, uint32_t length,
+                             uint32_t startTime, SPIFlashStatus_t status) {
+    SPIFlashTrace_t* trace = SPIFlash->trace;
+    SPIFlashTraceEntry_t* entry;
+    if (trace == NULL) {
+        return;
+    }
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_ATOMIC)
+    entry = &trace->entry[__atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED) & (SPIFLASH_TRACE - 1)];
+#else
+    entry = &trace->entry[trace->head++ & (SPIFLASH_TRACE - 1)];
+#endif
+    entry->start = startTime;
+    entry->end = SPIFlashGetTickUs();
+    entry->address = address;
+    entry->length = length;
+    entry->event = event;
+    entry->opcode = opcode;
+    entry->status = status;
+    entry->id = SPIFlash->traceId;
+}
+#else
+#define SPIFlashTraceAdd(SPIFlash, event, opcode, address, length, startTime, status)
+#endif
 
 static SPIFlashStatus_t SPIFlashSendCmd(SPIFlash_t* SPIFlash, uint8_t cmd) {
     SPIFlashStatus_t retVal = SPIFLASH_SUCCESS;
-    uint8_t tx[1] = {cmd};
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-    if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 1, 100) == SPIFLASH_ERROR) {
+    if (SPIFlashTransmit(SPIFlash, &cmd, 1, 1, 100) != SPIFLASH_SUCCESS) {
         retVal = SPIFLASH_ERROR;
     }
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
     return retVal;
 }
 
+#if SPIFLASH_POWERDOWN
+/* Called locked, with no asynchronous operation pending */
+static SPIFlashStatus_t SPIFlashEnterPowerDown(SPIFlash_t* SPIFlash) {
+    if (SPIFlash->power.down) {
+        return SPIFLASH_SUCCESS;
+    }
+    if ((SPIFlash->chip.powerDownCmd == 0)
+        || (SPIFlashSendCmd(SPIFlash, SPIFlash->chip.powerDownCmd) == SPIFLASH_ERROR)) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash->power.down = 1;
+    SPIFlash->power.downTick = SPIFlashGetTick();
+    SPIFlash->power.stats.entries++;
+    return SPIFLASH_SUCCESS;
+}
+
+/* Called locked. A powered-down chip ignores everything but RELEASE, and then everything until tRES1 has elapsed */
+static SPIFlashStatus_t SPIFlashWake(SPIFlash_t* SPIFlash) {
+    uint32_t startTime, elapsed;
+    if (!SPIFlash->power.down) {
+        return SPIFLASH_SUCCESS;
+    }
+    startTime = SPIFlashGetTickUs();
+    if (SPIFlashSendCmd(SPIFlash, SPIFlash->chip.releaseCmd) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashDelayUs(SPIFlash->timing.release);
+    elapsed = SPIFlashGetTickUs() - startTime;
+    SPIFlash->power.down = 0;
+    SPIFlash->power.stats.wakes++;
+    SPIFlash->power.stats.timeDown += SPIFlashGetTick() - SPIFlash->power.downTick;
+    SPIFlash->power.stats.wakeTime += elapsed;
+    if (elapsed > SPIFlash->power.stats.wakeMax) {
+        SPIFlash->power.stats.wakeMax = elapsed;
+    }
+    return SPIFLASH_SUCCESS;
+}
+#else
+#define SPIFlashWake(SPIFlash) SPIFLASH_SUCCESS
+#endif
+
+/* Lock for a command, SPIFLASH_BUSY while an asynchronous operation is pending. Wakes the chip up if needed */
+static SPIFlashStatus_t SPIFlashLockIdle(SPIFlash_t* SPIFlash) {
+    SPIFlashLock(SPIFlash);
+    if (SPIFlash->async.op != SPIFLASH_ASYNC_IDLE) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_BUSY;
+    }
+    if (SPIFlashWake(SPIFlash) != SPIFLASH_SUCCESS) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_ERROR;
+    }
+    return SPIFLASH_SUCCESS;
+}
+
 static uint8_t SPIFlashReadReg(SPIFlash_t* SPIFlash, uint8_t SPIFlashReg) {
     uint8_t retVal = 0;
     uint8_t tx[2] = {SPIFlashReg, SPIFLASH_DUMMY_BYTE};
     uint8_t rx[2];
+#if SPIFLASH_STATS
+    uint32_t startTime = SPIFlashGetTickUs();
+#endif
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
     if (SPIFlashTransmitReceive(SPIFlash, tx, rx, 2, 100) == SPIFLASH_SUCCESS) {
         retVal = rx[1];
     }
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    SPIFlashStatsAdd(&SPIFlash->stats.poll, 1, SPIFlashGetTickUs() - startTime);
     return retVal;
 }
 
-/*
-static SPIFlashStatus_t SPIFlashWriteReg1(SPIFlash_t *SPIFlash, uint8_t data)
-{
-	uint8_t tx[2] = {SPIFLASH_CMD_WRITESTATUS1, data};
-	uint8_t cmd = SPIFLASH_CMD_WRITESTATUSEN;
-
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, &cmd, &cmd, 1, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 2, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-
-	return SPIFLASH_SUCCESS;
-}
-
-static SPIFlashStatus_t SPIFlashWriteReg2(SPIFlash_t *SPIFlash, uint8_t data)
-{
-	uint8_t tx[2] = {SPIFLASH_CMD_WRITESTATUS2, data};
-	uint8_t cmd = SPIFLASH_CMD_WRITESTATUSEN;
-
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, &cmd, &cmd, 1, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 2, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-
-	return SPIFLASH_SUCCESS;
-}
-
-static SPIFlashStatus_t SPIFlashWriteReg3(SPIFlash_t *SPIFlash, uint8_t data)
-{
-	uint8_t tx[2] = {SPIFLASH_CMD_WRITESTATUS3, data};
-	uint8_t cmd = SPIFLASH_CMD_WRITESTATUSEN;
-
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, &cmd, &cmd, 1, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-	if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 2, 100) == SPIFLASH_ERROR)
-	{
-		SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-		return SPIFLASH_ERROR;
-	}
-	SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-
-	return SPIFLASH_SUCCESS;
-}
-*/
-
-static SPIFlashStatus_t SPIFlashWaitForWriting(SPIFlash_t* SPIFlash, uint32_t Timeout) {
-    uint32_t startTime = SPIFlashGetTick();
+#if (SPIFLASH_POLL == SPIFLASH_POLL_CONTINUOUS)
+static SPIFlashStatus_t SPIFlashPollStatus(SPIFlash_t* SPIFlash, uint32_t startTime, uint32_t timeout) {
+    SPIFlashStatus_t retVal = SPIFLASH_TIMEOUT;
+    uint8_t tx = SPIFLASH_CMD_READSTATUS1, rx;
+#if SPIFLASH_STATS
+    uint32_t pollTime = SPIFlashGetTickUs(), polls = 0;
+#endif
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if (SPIFlashTransmitReceive(SPIFlash, &tx, &rx, 1, 100) == SPIFLASH_SUCCESS) {
+        tx = SPIFLASH_DUMMY_BYTE;
+        do {
+            if (SPIFlashTransmitReceive(SPIFlash, &tx, &rx, 1, 100) != SPIFLASH_SUCCESS) {
+                retVal = SPIFLASH_ERROR;
+                break;
+            }
+#if SPIFLASH_STATS
+            polls++;
+#endif
+            if ((rx & SPIFlashSTATUS1_BUSY) == 0) {
+                retVal = SPIFLASH_SUCCESS;
+                break;
+            }
+        } while (SPIFlashGetTickUs() - startTime < timeout);
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    /* One sample per continuous read, counting the status bytes clocked out */
+    SPIFlashStatsAdd(&SPIFlash->stats.poll, polls, SPIFlashGetTickUs() - pollTime);
+    return retVal;
+}
+#else
+static SPIFlashStatus_t SPIFlashPollStatus(SPIFlash_t* SPIFlash, uint32_t startTime, uint32_t timeout, uint32_t step) {
     while (1) {
-        if (SPIFlashGetTick() - startTime >= Timeout) {
-            return SPIFLASH_TIMEOUT;
-        }
         if ((SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1) & SPIFlashSTATUS1_BUSY) == 0) {
             return SPIFLASH_SUCCESS;
         }
-        SPIFlashDelay(1);
+        if (SPIFlashGetTickUs() - startTime >= timeout) {
+            return SPIFLASH_TIMEOUT;
+        }
+        SPIFlashDelayUs(step);
     }
 }
+#endif
+
+static SPIFlashStatus_t SPIFlashWaitForWriting(SPIFlash_t* SPIFlash, SPIFlashOp_t op, uint32_t bytes) {
+    SPIFlashStatus_t retVal;
+    uint32_t startTime = SPIFlashGetTickUs(), elapsed;
+    uint32_t expected = SPIFlash->expected[op];
+    (void)bytes; /* only used by SPIFLASH_STATS */
+
+    /* Sleep through most of the expected duration before the first poll */
+    SPIFlashDelayUs(expected - expected / 8);
+    if ((SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1) & SPIFlashSTATUS1_BUSY) == 0) {
+        /* Already done: chip is faster than expected */
+        SPIFlash->expected[op] = expected - expected / 4;
+        SPIFlashStatsAdd(&SPIFlash->stats.op[op], bytes, SPIFlashGetTickUs() - startTime);
+        return SPIFLASH_SUCCESS;
+    }
+#if (SPIFLASH_POLL == SPIFLASH_POLL_CONTINUOUS)
+    retVal = SPIFlashPollStatus(SPIFlash, startTime, SPIFlash->timing.max[op]);
+#else
+    retVal = SPIFlashPollStatus(SPIFlash, startTime, SPIFlash->timing.max[op], (expected / 32) + 1);
+#endif
+    if (retVal == SPIFLASH_SUCCESS) {
+        elapsed = SPIFlashGetTickUs() - startTime;
+        SPIFlash->expected[op] = (3 * expected + elapsed) / 4;
+        SPIFlashStatsAdd(&SPIFlash->stats.op[op], bytes, elapsed);
+    }
+    return retVal;
+}
+
+#if SPIFLASH_SUSPEND
+/* Lock for a read. An asynchronous erase/program in progress is suspended, unless it targets the range being read */
+static SPIFlashStatus_t SPIFlashLockRead(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size) {
+    uint32_t startTime, elapsed;
+    SPIFlashLock(SPIFlash);
+    if (SPIFlash->async.op == SPIFLASH_ASYNC_STREAM) {
+        /* CS is held low by the streaming read */
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_BUSY;
+    }
+    if (SPIFlashWake(SPIFlash) != SPIFLASH_SUCCESS) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_ERROR;
+    }
+    if ((SPIFlash->async.op == SPIFLASH_ASYNC_IDLE)
+        || !(SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1) & SPIFlashSTATUS1_BUSY)) {
+        return SPIFLASH_SUCCESS;
+    }
+    if ((SPIFlash->chip.suspendCmd == 0) || (address - SPIFlash->async.busyAddress < SPIFlash->async.busyLength)
+        || (SPIFlash->async.busyAddress - address < size)) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_BUSY;
+    }
+
+    /* The operation must be given tRS to progress after a resume, or back-to-back reads could starve it */
+    elapsed = SPIFlashGetTickUs() - SPIFlash->async.resumeTime;
+    if (elapsed < SPIFlash->timing.resume) {
+        SPIFlashDelayUs(SPIFlash->timing.resume - elapsed);
+    }
+    if (SPIFlashSendCmd(SPIFlash, SPIFlash->chip.suspendCmd) == SPIFLASH_ERROR) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_ERROR;
+    }
+    startTime = SPIFlashGetTickUs();
+    SPIFlashDelayUs(SPIFlash->timing.suspend);
+    while (SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1) & SPIFlashSTATUS1_BUSY) {
+        if (SPIFlashGetTickUs() - startTime >= 10 * SPIFlash->timing.suspend) {
+            SPIFlashSendCmd(SPIFlash, SPIFlash->chip.resumeCmd);
+            SPIFlashUnLock(SPIFlash);
+            return SPIFLASH_TIMEOUT;
+        }
+    }
+    SPIFlash->async.suspendTime = startTime;
+    SPIFlash->async.suspended = 1;
+    switch (SPIFlash->manufacturer) {
+        case SPIFLASH_MANUFACTURER_WINBOND:
+        case SPIFLASH_MANUFACTURER_GIGADEVICE:
+        case SPIFLASH_MANUFACTURER_PUYA:
+            /* SUS cleared: the operation completed before it could be suspended, nothing to resume */
+            SPIFlash->async.suspended =
+                (SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS2) & SPIFlashSTATUS2_SUS) ? 1 : 0;
+            break;
+        default: break;
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+static void SPIFlashUnLockRead(SPIFlash_t* SPIFlash) {
+    if (SPIFlash->async.suspended) {
+        SPIFlashSendCmd(SPIFlash, SPIFlash->chip.resumeCmd);
+        SPIFlash->async.suspended = 0;
+        SPIFlash->async.resumeTime = SPIFlashGetTickUs();
+        /* Time spent suspended does not count against the operation timeout */
+        SPIFlash->async.startTime += SPIFlash->async.resumeTime - SPIFlash->async.suspendTime;
+        SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_SUSPEND, SPIFlash->chip.suspendCmd, SPIFlash->async.busyAddress,
+                         SPIFlash->async.busyLength, SPIFlash->async.suspendTime, SPIFLASH_SUCCESS);
+    }
+    SPIFlashUnLock(SPIFlash);
+}
+#else
+#define SPIFlashLockRead(SPIFlash, address, size) SPIFlashLockIdle(SPIFlash)
+#define SPIFlashUnLockRead(SPIFlash)              SPIFlashUnLock(SPIFlash)
+#endif
+
+/* Write one status register, or status registers 1 and 2 together with SPIFLASH_CMD_WRITESTATUS1 and size 2 */
+static SPIFlashStatus_t SPIFlashWriteReg(SPIFlash_t* SPIFlash, uint8_t SPIFlashReg, const uint8_t* data, uint8_t size) {
+    uint8_t tx[3] = {SPIFlashReg, data[0], (size > 1) ? data[1] : 0};
+    SPIFlashStatus_t retVal;
+#if SPIFLASH_TRACE
+    uint32_t startTime = SPIFlashGetTickUs();
+#endif
+
+    if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if (SPIFlashTransmit(SPIFlash, tx, 1 + size, 1, 100) != SPIFLASH_SUCCESS) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+
+    retVal = SPIFlashWaitForWriting(SPIFlash, SPIFLASH_OP_WRITESTATUS, size);
+    SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_WRITESTATUS, SPIFlashReg, 0, size, startTime, retVal);
+    return retVal;
+}
 
 static SPIFlashStatus_t SPIFlashFindChip(SPIFlash_t* SPIFlash) {
     uint8_t tx[4] = {SPIFLASH_CMD_JEDECID, 0xFF, 0xFF, 0xFF};
     uint8_t rx[4];
 
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-    if (SPIFlashTransmitReceive(SPIFlash, tx, rx, 4, 100) == SPIFLASH_ERROR) {
+    if (SPIFlashTransmitReceive(SPIFlash, tx, rx, 4, 100) != SPIFLASH_SUCCESS) {
         SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
         return SPIFLASH_ERROR;
     }
@@ -388,134 +738,808 @@ static SPIFlashStatus_t SPIFlashFindChip(SPIFlash_t* SPIFlash) {
     return SPIFLASH_SUCCESS;
 }
 
-static SPIFlashStatus_t SPIFlashWriteFn(SPIFlash_t* SPIFlash, uint32_t pageNumber, uint8_t* data, uint32_t size,
-                                        uint32_t offset) {
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint32_t address = 0, maximum = SPIFLASH_PAGE_SIZE - offset;
-    uint8_t tx[5];
-    do {
-#if SPIFLASH_DEBUG != SPIFLASH_DEBUG_DISABLE
-        uint32_t dbgTime = SPIFlashGetTick();
-#endif
-        dprintf("SPIFlashWritePage() START PAGE %ld\r\n", pageNumber);
-        if (pageNumber >= SPIFlash->pageNum) {
-            break;
-        }
-        if (offset >= SPIFLASH_PAGE_SIZE) {
-            break;
+static void SPIFlashDefaultTiming(SPIFlashTiming_t* timing, uint32_t blockNum) {
+    /* W25Q-class typical values, maximums are the previous fixed timeouts */
+    static const uint32_t typ[SPIFLASH_OP_NUM] = {400, 45000, 120000, 150000, 0, 10000};
+    static const uint32_t max[SPIFLASH_OP_NUM] = {5000, 1000000, 1600000, 3000000, 0, 100000};
+    for (uint8_t op = 0; op < SPIFLASH_OP_NUM; op++) {
+        timing->typ[op] = typ[op];
+        timing->max[op] = max[op];
+    }
+    timing->typ[SPIFLASH_OP_CHIPERASE] = blockNum * 160000;
+    timing->max[SPIFLASH_OP_CHIPERASE] = blockNum * 1000000;
+    timing->suspend = 20;
+    timing->resume = 100;
+    timing->release = SPIFLASH_RELEASE_TIME;
+}
+
+/* W25Q-class commands, used when the chip has no SFDP tables */
+static void SPIFlashDefaultChip(SPIFlash_t* SPIFlash) {
+    SPIFlashChip_t* chip = &SPIFlash->chip;
+    uint8_t addr4 = (SPIFlash->blockNum >= 512);
+
+    memset(chip, 0, sizeof(SPIFlashChip_t));
+    chip->addrBytes = addr4 ? 4 : 3;
+    chip->pageSize = SPIFLASH_PAGE_SIZE;
+    chip->readCmd[SPIFLASH_READ_1_1_1] = addr4 ? SPIFLASH_CMD_READDATA4ADD : SPIFLASH_CMD_READDATA3ADD;
+    chip->readCmd[SPIFLASH_READ_FAST] = addr4 ? SPIFLASH_CMD_FASTREAD4ADD : SPIFLASH_CMD_FASTREAD3ADD;
+    chip->readClocks[SPIFLASH_READ_FAST] = 8;
+    chip->readCmd[SPIFLASH_READ_1_2_2] = addr4 ? SPIFLASH_CMD_DUALIOREAD4ADD : SPIFLASH_CMD_DUALIOREAD3ADD;
+    chip->readClocks[SPIFLASH_READ_1_2_2] = 4;
+    chip->readCmd[SPIFLASH_READ_1_4_4] = addr4 ? SPIFLASH_CMD_QUADIOREAD4ADD : SPIFLASH_CMD_QUADIOREAD3ADD;
+    chip->readClocks[SPIFLASH_READ_1_4_4] = 6;
+    chip->progCmd = addr4 ? SPIFLASH_CMD_PAGEPROG4ADD : SPIFLASH_CMD_PAGEPROG3ADD;
+    chip->quadProgCmd = addr4 ? SPIFLASH_CMD_QUADPAGEPROG4ADD : SPIFLASH_CMD_QUADPAGEPROG3ADD;
+    chip->eraseCmd[SPIFLASH_OP_SECTORERASE] = addr4 ? SPIFLASH_CMD_SECTORERASE4ADD : SPIFLASH_CMD_SECTORERASE3ADD;
+    chip->eraseCmd[SPIFLASH_OP_HALFBLOCKERASE] =
+        addr4 ? SPIFLASH_CMD_HALFBLOCKERASE4ADD : SPIFLASH_CMD_HALFBLOCKERASE3ADD;
+    chip->eraseCmd[SPIFLASH_OP_BLOCKERASE] = addr4 ? SPIFLASH_CMD_BLOCKERASE4ADD : SPIFLASH_CMD_BLOCKERASE3ADD;
+    chip->eraseCmd[SPIFLASH_OP_CHIPERASE] = SPIFLASH_CMD_CHIPERASE1;
+    chip->suspendCmd = SPIFLASH_CMD_SUSPEND;
+    chip->resumeCmd = SPIFLASH_CMD_RESUME;
+    chip->powerDownCmd = SPIFLASH_CMD_POWERDOWN;
+    chip->releaseCmd = SPIFLASH_CMD_RELEASE;
+    switch (SPIFlash->manufacturer) {
+        case SPIFLASH_MANUFACTURER_WINBOND:
+        case SPIFLASH_MANUFACTURER_GIGADEVICE:
+        case SPIFLASH_MANUFACTURER_PUYA: chip->quadEnable = SPIFLASH_QER_SR2_BIT1_31; break;
+        case SPIFLASH_MANUFACTURER_MACRONIX:
+        case SPIFLASH_MANUFACTURER_ISSI: chip->quadEnable = SPIFLASH_QER_SR1_BIT6; break;
+        default: chip->quadEnable = SPIFLASH_QER_UNKNOWN; break;
+    }
+}
+
+/* Read count little-endian DWORDs of the SFDP area, with 3-byte address and 8 dummy clocks */
+static SPIFlashStatus_t SPIFlashReadSFDP(SPIFlash_t* SPIFlash, uint32_t address, uint32_t* dwords, uint8_t count) {
+    uint8_t tx[5] = {SPIFLASH_CMD_READSFDP, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF,
+                     SPIFLASH_DUMMY_BYTE};
+    uint8_t rx[4 * SPIFLASH_SFDP_DWORDS];
+
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if ((SPIFlashTransmit(SPIFlash, tx, 5, 1, 100) != SPIFLASH_SUCCESS)
+        || (SPIFlashReceive(SPIFlash, rx, 4 * count, 1, 100) != SPIFLASH_SUCCESS)) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    for (uint8_t i = 0; i < count; i++) {
+        dwords[i] = rx[4 * i] | (rx[4 * i + 1] << 8) | (rx[4 * i + 2] << 16) | ((uint32_t)rx[4 * i + 3] << 24);
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+/* SFDP time field: (count + 1) units */
+static uint32_t SPIFlashSFDPTime(uint32_t dword, uint8_t countShift, uint8_t countBits, uint8_t unitShift,
+                                 uint8_t unitBits, const uint32_t* units) {
+    uint32_t count = ((dword >> countShift) & ((1UL << countBits) - 1)) + 1;
+    return count * units[(dword >> unitShift) & ((1UL << unitBits) - 1)];
+}
+
+/* SFDP maximum time: 2 * (multiplier + 1) times the typical one */
+static uint32_t SPIFlashSFDPMax(uint32_t typ, uint32_t multiplier) {
+    uint64_t max = 2ULL * (multiplier + 1) * typ;
+    return (max > UINT32_MAX) ? UINT32_MAX : (uint32_t)max;
+}
+
+/* Fill chip parameters, geometry and timings from the Basic Flash Parameter Table and, above 16 MiB, from the 4-byte
+ * Address Instruction Table. Returns 0 without touching anything if the chip has no usable SFDP tables */
+static uint8_t SPIFlashParseSFDP(SPIFlash_t* SPIFlash) {
+    static const uint32_t eraseUnit[4] = {1000, 16000, 128000, 1000000};
+    static const uint32_t chipUnit[4] = {16000, 256000, 4000000, 64000000};
+    static const uint32_t progUnit[2] = {8, 64};
+    static const uint32_t latencyUnit[4] = {128, 1000, 8000, 64000}; /* ns */
+    static const uint8_t read4[SPIFLASH_READ_NUM] = {SPIFLASH_CMD_READDATA4ADD,   SPIFLASH_CMD_FASTREAD4ADD,
+                                                     SPIFLASH_CMD_DUALOUTREAD4ADD, SPIFLASH_CMD_DUALIOREAD4ADD,
+                                                     SPIFLASH_CMD_QUADOUTREAD4ADD, SPIFLASH_CMD_QUADIOREAD4ADD};
+    /* BFPT DWORD 1 support bit, DWORD index and shift of each multi-line read */
+    static const uint8_t support[SPIFLASH_READ_NUM] = {0, 0, 16, 20, 22, 21};
+    static const uint8_t dword[SPIFLASH_READ_NUM] = {0, 0, 3, 3, 2, 2};
+    static const uint8_t shift[SPIFLASH_READ_NUM] = {0, 0, 0, 16, 16, 0};
+    SPIFlashChip_t parsed, *chip = &parsed;
+    SPIFlashTiming_t timing;
+    uint32_t header[2], bfpt[SPIFLASH_SFDP_DWORDS], bait[2] = {0, 0};
+    uint32_t bfptPtr = 0, baitPtr = 0, length, field;
+    uint64_t bytes;
+    uint32_t blockNum;
+    uint8_t bfptLen = 0, baitLen = 0, headers, op;
+    SPIFlashOp_t eraseOp[4];
+
+    if ((SPIFlashReadSFDP(SPIFlash, 0, header, 2) == SPIFLASH_ERROR) || (header[0] != SPIFLASH_SFDP_SIGNATURE)
+        || (((header[1] >> 8) & 0xFF) != 1)) {
+        return 0;
+    }
+    headers = ((header[1] >> 16) & 0xFF) + 1;
+    for (uint8_t i = 0; (i < headers) && (i < SPIFLASH_SFDP_HEADERS); i++) {
+        if ((SPIFlashReadSFDP(SPIFlash, 8 + 8 * i, header, 2) == SPIFLASH_ERROR) || (((header[0] >> 16) & 0xFF) != 1)) {
+            continue;
         }
-        if (size > maximum) {
-            size = maximum;
+        length = header[0] >> 24;
+        field = ((header[1] >> 16) & 0xFF00) | (header[0] & 0xFF);
+        if ((field == SPIFLASH_SFDP_BFPT) && (length >= 9) && (length >= bfptLen)) {
+            /* Later BFPT revisions supersede earlier ones */
+            bfptPtr = header[1] & 0xFFFFFF;
+            bfptLen = (length > SPIFLASH_SFDP_DWORDS) ? SPIFLASH_SFDP_DWORDS : length;
+        } else if ((field == SPIFLASH_SFDP_4BAIT) && (length >= 2)) {
+            baitPtr = header[1] & 0xFFFFFF;
+            baitLen = 2;
         }
-        address = SPIFLASH_PAGE2ADDRESS(pageNumber) + offset;
+    }
+    if ((bfptLen == 0) || (SPIFlashReadSFDP(SPIFlash, bfptPtr, bfpt, bfptLen) == SPIFLASH_ERROR)) {
+        return 0;
+    }
+    if ((baitLen > 0) && (SPIFlashReadSFDP(SPIFlash, baitPtr, bait, 2) == SPIFLASH_ERROR)) {
+        baitLen = 0;
+    }
 
-#if SPIFLASH_DEBUG == SPIFLASH_DEBUG_FULL
-        dprintf("SPI FLASH WRITING {\r\n0x%02X", data[0]);
-        for (int i = 1; i < size; i++) {
-            if (i % 8 == 0) {
-                dprintf("\r\n");
-            }
-            dprintf(", 0x%02X", data[i]);
+    /* Density in bits */
+    bytes = (bfpt[1] & 0x80000000) ? ((1ULL << (bfpt[1] & 0x3F)) >> 3) : ((bfpt[1] + 1ULL) >> 3);
+    if ((bytes < SPIFLASH_BLOCK_SIZE) || (bytes > (1ULL << 32))) {
+        return 0;
+    }
+    blockNum = (uint32_t)(bytes / SPIFLASH_BLOCK_SIZE);
+    SPIFlashDefaultTiming(&timing, blockNum);
+
+    memset(chip, 0, sizeof(SPIFlashChip_t));
+    chip->sfdp = 1;
+    chip->addrBytes = (bytes > (1UL << 24)) ? 4 : 3;
+    chip->pageSize = (bfptLen >= 11) ? (1UL << ((bfpt[10] >> 4) & 0x0F)) : SPIFLASH_PAGE_SIZE;
+    chip->quadEnable = (bfptLen >= 15) ? ((bfpt[14] >> 20) & 0x07) : SPIFLASH_QER_UNKNOWN;
+
+    /* Read commands: DWORD 3 holds 1-4-4 and 1-1-4, DWORD 4 1-1-2 and 1-2-2, each as opcode, mode and dummy clocks */
+    chip->readCmd[SPIFLASH_READ_1_1_1] = SPIFLASH_CMD_READDATA3ADD;
+    chip->readCmd[SPIFLASH_READ_FAST] = SPIFLASH_CMD_FASTREAD3ADD;
+    chip->readClocks[SPIFLASH_READ_FAST] = 8;
+    for (uint8_t mode = SPIFLASH_READ_1_1_2; mode < SPIFLASH_READ_NUM; mode++) {
+        if (bfpt[0] & (1UL << support[mode])) {
+            field = bfpt[dword[mode]] >> shift[mode];
+            chip->readCmd[mode] = (field >> 8) & 0xFF;
+            chip->readClocks[mode] = (field & 0x1F) + ((field >> 5) & 0x07);
         }
-        dprintf("\r\n}\r\n");
-#endif
+    }
+    chip->progCmd = SPIFLASH_CMD_PAGEPROG3ADD;
+    chip->quadProgCmd = SPIFLASH_CMD_QUADPAGEPROG3ADD;
+
+    /* Erase types, with typical times in DWORD 10 (JESD216B) */
+    for (uint8_t type = 0; type < 4; type++) {
+        field = bfpt[7 + type / 2] >> (16 * (type % 2));
+        eraseOp[type] = SPIFLASH_OP_NUM;
+        switch (field & 0xFF) {
+            case 12: eraseOp[type] = SPIFLASH_OP_SECTORERASE; break;
+            case 15: eraseOp[type] = SPIFLASH_OP_HALFBLOCKERASE; break;
+            case 16: eraseOp[type] = SPIFLASH_OP_BLOCKERASE; break;
+            default: continue;
+        }
+        op = eraseOp[type];
+        chip->eraseCmd[op] = (field >> 8) & 0xFF;
+        if (bfptLen >= 10) {
+            timing.typ[op] = SPIFlashSFDPTime(bfpt[9], 4 + 7 * type, 5, 9 + 7 * type, 2, eraseUnit);
+            timing.max[op] = SPIFlashSFDPMax(timing.typ[op], bfpt[9] & 0x0F);
+        }
+    }
+    chip->eraseCmd[SPIFLASH_OP_CHIPERASE] = SPIFLASH_CMD_CHIPERASE1;
+    if (bfptLen >= 11) {
+        timing.typ[SPIFLASH_OP_PAGEPROG] = SPIFlashSFDPTime(bfpt[10], 8, 5, 13, 1, progUnit);
+        timing.max[SPIFLASH_OP_PAGEPROG] =
+            SPIFlashSFDPMax(timing.typ[SPIFLASH_OP_PAGEPROG], bfpt[10] & 0x0F);
+        timing.typ[SPIFLASH_OP_CHIPERASE] = SPIFlashSFDPTime(bfpt[10], 24, 5, 29, 2, chipUnit);
+        timing.max[SPIFLASH_OP_CHIPERASE] =
+            SPIFlashSFDPMax(timing.typ[SPIFLASH_OP_CHIPERASE], bfpt[9] & 0x0F);
+    }
 
-        if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
-            break;
+    /* Suspend: DWORD 12 holds latencies and resume-to-suspend intervals, DWORD 13 the opcodes */
+    chip->suspendCmd = SPIFLASH_CMD_SUSPEND;
+    chip->resumeCmd = SPIFLASH_CMD_RESUME;
+    if (bfptLen >= 13) {
+        if (bfpt[11] & 0x80000000) {
+            chip->suspendCmd = 0;
+            chip->resumeCmd = 0;
+        } else {
+            uint32_t erase = SPIFlashSFDPTime(bfpt[11], 24, 5, 29, 2, latencyUnit);
+            uint32_t program = SPIFlashSFDPTime(bfpt[11], 13, 5, 18, 2, latencyUnit);
+            timing.suspend = ((erase > program ? erase : program) + 999) / 1000;
+            erase = 64 * (((bfpt[11] >> 20) & 0x0F) + 1);
+            program = 64 * (((bfpt[11] >> 9) & 0x0F) + 1);
+            timing.resume = (erase > program) ? erase : program;
+            chip->suspendCmd = bfpt[12] >> 24;
+            chip->resumeCmd = (bfpt[12] >> 16) & 0xFF;
         }
+    }
 
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-        if (SPIFlash->blockNum >= 512) {
-            tx[0] = SPIFLASH_CMD_PAGEPROG4ADD;
-            tx[1] = (address & 0xFF000000) >> 24;
-            tx[2] = (address & 0x00FF0000) >> 16;
-            tx[3] = (address & 0x0000FF00) >> 8;
-            tx[4] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 5, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
-            }
+    /* Deep power-down: DWORD 14 holds the opcodes and the exit delay */
+    chip->powerDownCmd = SPIFLASH_CMD_POWERDOWN;
+    chip->releaseCmd = SPIFLASH_CMD_RELEASE;
+    if (bfptLen >= 14) {
+        if (bfpt[13] & 0x80000000) {
+            chip->powerDownCmd = 0;
+            chip->releaseCmd = 0;
         } else {
-            tx[0] = SPIFLASH_CMD_PAGEPROG3ADD;
-            tx[1] = (address & 0x00FF0000) >> 16;
-            tx[2] = (address & 0x0000FF00) >> 8;
-            tx[3] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 4, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
-            }
+            chip->powerDownCmd = (bfpt[13] >> 23) & 0xFF;
+            chip->releaseCmd = (bfpt[13] >> 15) & 0xFF;
+            timing.release = (SPIFlashSFDPTime(bfpt[13], 8, 5, 13, 2, latencyUnit) + 999) / 1000;
         }
-        if (SPIFlashTransmitReceive(SPIFlash, data, data, size, 1000) == SPIFLASH_ERROR) {
-            SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-            break;
+    }
+
+    /* Above 16 MiB: stateless 4-byte opcodes if the chip has them all, 4-byte address mode otherwise */
+    if (chip->addrBytes == 4) {
+        uint8_t sector = 4;
+        for (uint8_t type = 0; type < 4; type++) {
+            if (eraseOp[type] == SPIFLASH_OP_SECTORERASE) {
+                sector = type;
+            }
         }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-        if (SPIFlashWaitForWriting(SPIFlash, 100)) {
-            dprintf("SPIFlashWritePage() %d BYTES WRITTEN IN %ld ms\r\n", (uint16_t)size, SPIFlashGetTick() - dbgTime);
-            retVal = SPIFLASH_SUCCESS;
+        if ((baitLen > 0) && (bait[0] & (1UL << 6)) && (sector < 4) && (bait[0] & (1UL << (9 + sector)))) {
+            for (uint8_t mode = SPIFLASH_READ_1_1_1; mode < SPIFLASH_READ_NUM; mode++) {
+                chip->readCmd[mode] = (chip->readCmd[mode] && (bait[0] & (1UL << mode))) ? read4[mode] : 0;
+            }
+            chip->progCmd = SPIFLASH_CMD_PAGEPROG4ADD;
+            chip->quadProgCmd = (bait[0] & (1UL << 7)) ? SPIFLASH_CMD_QUADPAGEPROG4ADD : 0;
+            for (uint8_t type = 0; type < 4; type++) {
+                if (eraseOp[type] < SPIFLASH_OP_NUM) {
+                    chip->eraseCmd[eraseOp[type]] =
+                        (bait[0] & (1UL << (9 + type))) ? (bait[1] >> (8 * type)) & 0xFF : 0;
+                }
+            }
+        } else if ((bfptLen >= 16) && (bfpt[15] & (0x03UL << 24))) {
+            chip->enter4 = (bfpt[15] & (0x01UL << 24)) ? 1 : 2;
+        } else if (((bfpt[0] >> 17) & 0x03) != 0x02) {
+            /* Neither 4-byte opcodes nor a known way to enter 4-byte mode, and 3-byte addressing is not enough */
+            return 0;
         }
+    }
 
-    } while (0);
-
-    SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
-    return retVal;
+    SPIFlash->blockNum = blockNum;
+    SPIFlash->sectorNum = SPIFLASH_BLOCK2SECTOR(blockNum);
+    SPIFlash->pageNum = SPIFLASH_SECTOR2PAGE(SPIFlash->sectorNum);
+    SPIFlash->chip = parsed;
+    SPIFlash->timing = timing;
+    return 1;
 }
 
-static SPIFlashStatus_t SPIFlashReadFn(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint8_t tx[5];
-    do {
-
-#if SPIFLASH_DEBUG != SPIFLASH_DEBUG_DISABLE
-        uint32_t dbgTime = SPIFlashGetTick();
-#endif
-        dprintf("SPIFlashReadAddress() START ADDRESS %ld\r\n", address);
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-        if (SPIFlash->blockNum >= 512) {
-            tx[0] = SPIFLASH_CMD_READDATA4ADD;
-            tx[1] = (address & 0xFF000000) >> 24;
-            tx[2] = (address & 0x00FF0000) >> 16;
-            tx[3] = (address & 0x0000FF00) >> 8;
-            tx[4] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 5, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
+/* Set the quad enable bit where the chip's QER code places it */
+static uint8_t SPIFlashEnableQuad(SPIFlash_t* SPIFlash) {
+    uint8_t reg[2];
+    switch (SPIFlash->chip.quadEnable) {
+        case SPIFLASH_QER_NONE: return 1;
+        case SPIFLASH_QER_SR1_BIT6:
+            reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1);
+            if ((reg[0] & SPIFlashSTATUS1_QE_MXIC) == 0) {
+                reg[0] |= SPIFlashSTATUS1_QE_MXIC;
+                SPIFlashWriteReg(SPIFlash, SPIFLASH_CMD_WRITESTATUS1, reg, 1);
+                reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1);
             }
-        } else {
-            tx[0] = SPIFLASH_CMD_READDATA3ADD;
-            tx[1] = (address & 0x00FF0000) >> 16;
-            tx[2] = (address & 0x0000FF00) >> 8;
-            tx[3] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 4, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
+            return (reg[0] & SPIFlashSTATUS1_QE_MXIC) != 0;
+        case SPIFLASH_QER_SR2_BIT1_31:
+            reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS2);
+            if ((reg[0] & SPIFlashSTATUS2_QE) == 0) {
+                reg[0] |= SPIFlashSTATUS2_QE;
+                SPIFlashWriteReg(SPIFlash, SPIFLASH_CMD_WRITESTATUS2, reg, 1);
+                reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS2);
             }
-        }
-        if (SPIFlashTransmitReceive(SPIFlash, data, data, size, 2000) == SPIFLASH_ERROR) {
-            SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-            break;
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-        dprintf("SPIFlashReadAddress() %d BYTES READ IN %ld ms\r\n", (uint16_t)size, SPIFlashGetTick() - dbgTime);
-
-#if SPIFLASH_DEBUG == SPIFLASH_DEBUG_FULL
-        dprintf("{\r\n0x%02X", data[0]);
-        for (int i = 1; i < size; i++) {
-            if (i % 8 == 0) {
-                dprintf("\r\n");
+            return (reg[0] & SPIFlashSTATUS2_QE) != 0;
+        case SPIFLASH_QER_SR2_BIT1_35:
+            reg[1] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS2);
+            if ((reg[1] & SPIFlashSTATUS2_QE) == 0) {
+                reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1);
+                reg[1] |= SPIFlashSTATUS2_QE;
+                SPIFlashWriteReg(SPIFlash, SPIFLASH_CMD_WRITESTATUS1, reg, 2);
+                reg[1] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS2);
             }
-            dprintf(", 0x%02X", data[i]);
+            return (reg[1] & SPIFlashSTATUS2_QE) != 0;
+        case SPIFLASH_QER_SR2_BIT1_01:
+        case SPIFLASH_QER_SR2_BIT1_01_KEEP:
+            /* Status register 2 cannot be read back: write it whole */
+            reg[0] = SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1);
+            reg[1] = SPIFlashSTATUS2_QE;
+            return SPIFlashWriteReg(SPIFlash, SPIFLASH_CMD_WRITESTATUS1, reg, 2) == SPIFLASH_SUCCESS;
+        default: return 0;
+    }
+}
+
+static void SPIFlashSelectEngines(SPIFlash_t* SPIFlash) {
+    SPIFlashChip_t* chip = &SPIFlash->chip;
+    uint8_t lines = SPIFlashBusLines(SPIFlash), quad = 0, addrLines = 1, dataLines = 1;
+    SPIFlashReadMode_t mode;
+
+    if ((lines >= 4) && (chip->readCmd[SPIFLASH_READ_1_4_4] || chip->readCmd[SPIFLASH_READ_1_1_4])) {
+        quad = SPIFlashEnableQuad(SPIFlash);
+    }
+    /* Fastest multi-line read the chip supports on the wired lines, with mode and dummy clocks filling whole bytes of
+     * the read header */
+    for (mode = SPIFLASH_READ_1_4_4; mode > SPIFLASH_READ_FAST; mode--) {
+        addrLines = (mode == SPIFLASH_READ_1_4_4) ? 4 : (mode == SPIFLASH_READ_1_2_2) ? 2 : 1;
+        dataLines = (mode >= SPIFLASH_READ_1_1_4) ? 4 : 2;
+        if (chip->readCmd[mode] && (dataLines <= lines) && ((dataLines < 4) || quad)
+            && (((chip->readClocks[mode] * addrLines) % 8) == 0)
+            && (1 + chip->addrBytes + (chip->readClocks[mode] * addrLines) / 8 <= SPIFLASH_READ_HEADER)) {
+            break;
+        }
+    }
+    if (mode == SPIFLASH_READ_FAST) {
+        addrLines = 1;
+        dataLines = 1;
+        if (chip->readCmd[SPIFLASH_READ_1_1_1]
+            && ((SPIFlashBusClock(SPIFlash) <= SPIFLASH_READ_MAX_CLOCK) || !chip->readCmd[SPIFLASH_READ_FAST])) {
+            mode = SPIFLASH_READ_1_1_1;
         }
-        dprintf("\r\n}\r\n");
+    }
+    SPIFlash->readCmd = chip->readCmd[mode];
+    SPIFlash->readDummy = (chip->readClocks[mode] * addrLines) / 8;
+    SPIFlash->readAddrLines = addrLines;
+    SPIFlash->readDataLines = dataLines;
+    SPIFlash->progCmd = chip->progCmd;
+    SPIFlash->progDataLines = 1;
+    if (quad && chip->quadProgCmd) {
+        SPIFlash->progCmd = chip->quadProgCmd;
+        SPIFlash->progDataLines = 4;
+    }
+    dprintf("SPI FLASH READ CMD: 0x%02X - PROGRAM CMD: 0x%02X\r\n", SPIFlash->readCmd, SPIFlash->progCmd);
+}
+
+static uint8_t SPIFlashAddressHeader(SPIFlash_t* SPIFlash, uint8_t* tx, uint8_t cmd, uint32_t address) {
+    tx[0] = cmd;
+    if (SPIFLASH_ADDR4(SPIFlash)) {
+        tx[1] = (address & 0xFF000000) >> 24;
+        tx[2] = (address & 0x00FF0000) >> 16;
+        tx[3] = (address & 0x0000FF00) >> 8;
+        tx[4] = (address & 0x000000FF);
+        return 5;
+    }
+    tx[1] = (address & 0x00FF0000) >> 16;
+    tx[2] = (address & 0x0000FF00) >> 8;
+    tx[3] = (address & 0x000000FF);
+    return 4;
+}
+
+#if SPIFLASH_CACHE_LINES > 0
+static void SPIFlashCacheInvalidate(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size) {
+    uint32_t first = address & ~(SPIFLASH_CACHE_LINE_SIZE - 1);
+    for (uint32_t i = 0; i < SPIFLASH_CACHE_LINES; i++) {
+        if ((SPIFlash->cache.tag[i] >= first) && (SPIFlash->cache.tag[i] - first < address - first + size)) {
+            SPIFlash->cache.stamp[i] = 0;
+        }
+    }
+}
+#else
+#define SPIFlashCacheInvalidate(SPIFlash, address, size) ((void)(address), (void)(size))
 #endif
 
+static SPIFlashStatus_t SPIFlashStartProgram(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data,
+                                             uint32_t size) {
+    uint8_t tx[5], len;
+    SPIFlashCacheInvalidate(SPIFlash, address, size);
+    if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    /* Header and payload are chained under the same CS assertion, straight from the caller's buffer */
+    len = SPIFlashAddressHeader(SPIFlash, tx, SPIFlash->progCmd, address);
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if (SPIFlashTransmit(SPIFlash, tx, len, 1, 100) != SPIFLASH_SUCCESS) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    if (SPIFlashTransmit(SPIFlash, data, size, SPIFlash->progDataLines, 1000) != SPIFLASH_SUCCESS) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    return SPIFLASH_SUCCESS;
+}
+
+static SPIFlashStatus_t SPIFlashStartErase(SPIFlash_t* SPIFlash, uint8_t cmd, uint32_t address, uint32_t size) {
+    uint8_t tx[5], len = 1;
+    if (cmd == 0) {
+        /* Erase size not supported by the chip */
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashCacheInvalidate(SPIFlash, address, size);
+    if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    if (cmd == SPIFLASH_CMD_CHIPERASE1) {
+        tx[0] = cmd;
+    } else {
+        len = SPIFlashAddressHeader(SPIFlash, tx, cmd, address);
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if (SPIFlashTransmit(SPIFlash, tx, len, 1, 100) != SPIFLASH_SUCCESS) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    return SPIFLASH_SUCCESS;
+}
+
+/* Select the chip and clock out the read header; on success CS is left low for the data phase */
+static SPIFlashStatus_t SPIFlashStartRead(SPIFlash_t* SPIFlash, uint32_t address) {
+    uint8_t tx[SPIFLASH_READ_HEADER], len, cmdLen;
+    len = SPIFlashAddressHeader(SPIFlash, tx, SPIFlash->readCmd, address);
+    for (uint8_t i = 0; i < SPIFlash->readDummy; i++) {
+        tx[len++] = (SPIFlash->readDataLines > 1) ? SPIFLASH_MODE_BYTE : SPIFLASH_DUMMY_BYTE;
+    }
+    /* Opcode always goes on a single line, address and dummy bytes on readAddrLines */
+    cmdLen = (SPIFlash->readAddrLines == 1) ? len : 1;
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
+    if ((SPIFlashTransmit(SPIFlash, tx, cmdLen, 1, 100) != SPIFLASH_SUCCESS)
+        || ((cmdLen < len)
+            && (SPIFlashTransmit(SPIFlash, &tx[1], len - 1, SPIFlash->readAddrLines, 100) != SPIFLASH_SUCCESS))) {
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        return SPIFLASH_ERROR;
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+static SPIFlashStatus_t SPIFlashReadFn(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
+    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+#if SPIFLASH_STATS || SPIFLASH_TRACE
+    uint32_t startTime = SPIFlashGetTickUs();
+#endif
+    do {
+        if (SPIFlashStartRead(SPIFlash, address) == SPIFLASH_ERROR) {
+            break;
+        }
+        if (SPIFlashReceive(SPIFlash, data, size, SPIFlash->readDataLines, 2000) != SPIFLASH_SUCCESS) {
+            SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+            break;
+        }
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        SPIFlashStatsAdd(&SPIFlash->stats.read, size, SPIFlashGetTickUs() - startTime);
         retVal = SPIFLASH_SUCCESS;
 
     } while (0);
 
+    SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_READ, SPIFlash->readCmd, address, size, startTime, retVal);
+    return retVal;
+}
+
+/* One read command for segments contiguous in the flash, each one received straight into its own buffer */
+static SPIFlashStatus_t SPIFlashReadRun(SPIFlash_t* SPIFlash, const SPIFlashSegment_t* segments, uint32_t count) {
+    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    uint32_t size = 0;
+#if SPIFLASH_STATS || SPIFLASH_TRACE
+    uint32_t startTime = SPIFlashGetTickUs();
+#endif
+    if (SPIFlashStartRead(SPIFlash, segments[0].address) == SPIFLASH_SUCCESS) {
+        retVal = SPIFLASH_SUCCESS;
+        for (uint32_t i = 0; i < count; i++) {
+            if ((segments[i].length > 0)
+                && (SPIFlashReceive(SPIFlash, segments[i].data, segments[i].length, SPIFlash->readDataLines, 2000)
+                    != SPIFLASH_SUCCESS)) {
+                retVal = SPIFLASH_ERROR;
+                break;
+            }
+            size += segments[i].length;
+        }
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    }
+    if (retVal == SPIFLASH_SUCCESS) {
+        SPIFlashStatsAdd(&SPIFlash->stats.read, size, SPIFlashGetTickUs() - startTime);
+    }
+    SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_READ, SPIFlash->readCmd, segments[0].address, size, startTime, retVal);
+    return retVal;
+}
+
+#if SPIFLASH_CACHE_LINES > 0
+static SPIFlashStatus_t SPIFlashCacheRead(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
+    SPIFlashCache_t* cache = &SPIFlash->cache;
+    uint32_t base, offset, length, line, victim;
+
+    /* Streaming reads larger than the whole cache would only evict useful lines */
+    if (size > SPIFLASH_CACHE_LINES * SPIFLASH_CACHE_LINE_SIZE) {
+        return SPIFlashReadFn(SPIFlash, address, data, size);
+    }
+    while (size > 0) {
+        base = address & ~(SPIFLASH_CACHE_LINE_SIZE - 1);
+        offset = address - base;
+        length = SPIFLASH_CACHE_LINE_SIZE - offset;
+        if (length > size) {
+            length = size;
+        }
+        victim = 0;
+        for (line = 0; line < SPIFLASH_CACHE_LINES; line++) {
+            if (cache->stamp[line] && (cache->tag[line] == base)) {
+                break;
+            }
+            if (cache->stamp[line] < cache->stamp[victim]) {
+                victim = line;
+            }
+        }
+        if (line < SPIFLASH_CACHE_LINES) {
+            cache->hits++;
+        } else {
+            cache->misses++;
+            line = victim;
+            cache->stamp[line] = 0;
+            if (SPIFlashReadFn(SPIFlash, base, cache->line[line], SPIFLASH_CACHE_LINE_SIZE) == SPIFLASH_ERROR) {
+                return SPIFLASH_ERROR;
+            }
+            cache->tag[line] = base;
+        }
+        if (++cache->tick == 0) {
+            /* Stamp wrap-around: restart LRU history from scratch */
+            memset(cache->stamp, 0, sizeof(cache->stamp));
+            cache->tick = 1;
+        }
+        cache->stamp[line] = cache->tick;
+        memcpy(data, &cache->line[line][offset], length);
+        address += length;
+        data += length;
+        size -= length;
+    }
+    return SPIFLASH_SUCCESS;
+}
+#else
+#define SPIFlashCacheRead SPIFlashReadFn
+#endif
+
+/* Stream the region in a single read transaction, stopping at the first programmed byte */
+static uint8_t SPIFlashIsBlank(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size) {
+    uint8_t buf[SPIFLASH_PAGE_SIZE], blank = 1;
+    uint32_t length;
+    if (SPIFlashStartRead(SPIFlash, address) == SPIFLASH_ERROR) {
+        return 0;
+    }
+    while (blank && (size > 0)) {
+        length = (size > sizeof(buf)) ? sizeof(buf) : size;
+        if (SPIFlashReceive(SPIFlash, buf, length, SPIFlash->readDataLines, 100) != SPIFLASH_SUCCESS) {
+            blank = 0;
+            break;
+        }
+        for (uint32_t i = 0; i < length; i++) {
+            if (buf[i] != 0xFF) {
+                blank = 0;
+                break;
+            }
+        }
+        size -= length;
+    }
+    SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+    return blank;
+}
+
+static SPIFlashStatus_t SPIFlashEraseFn(SPIFlash_t* SPIFlash, uint8_t cmd, uint32_t address, uint32_t size,
+                                        SPIFlashOp_t op) {
+    if ((SPIFlash->options & SPIFLASH_OPT_BLANKCHECK) && SPIFlashIsBlank(SPIFlash, address, size)) {
+        SPIFlash->skipped.erases++;
+        return SPIFLASH_SUCCESS;
+    }
+#if SPIFLASH_TRACE
+    uint32_t startTime = SPIFlashGetTickUs();
+#endif
+    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    if (SPIFlashStartErase(SPIFlash, cmd, address, size) == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashWaitForWriting(SPIFlash, op, size);
+    }
+    SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_ERASE, cmd, address, size, startTime, retVal);
+    return retVal;
+}
+
+/* Cheapest way of clearing a whole 32 KiB block: one half-block erase or 8 sector erases */
+static uint32_t SPIFlashHalfBlockCost(SPIFlash_t* SPIFlash) {
+    uint32_t sectors = (SPIFLASH_HALFBLOCK_SIZE / SPIFLASH_SECTOR_SIZE) * SPIFlash->expected[SPIFLASH_OP_SECTORERASE];
+    return (SPIFlash->chip.eraseCmd[SPIFLASH_OP_HALFBLOCKERASE]
+            && (SPIFlash->expected[SPIFLASH_OP_HALFBLOCKERASE] < sectors))
+               ? SPIFlash->expected[SPIFLASH_OP_HALFBLOCKERASE]
+               : sectors;
+}
+
+/* Erase granularities are nested and aligned, so picking the cheapest option for each aligned unit independently
+ * yields the minimal-time sequence for the whole range */
+static SPIFlashOp_t SPIFlashPlanErase(SPIFlash_t* SPIFlash, uint32_t address, uint32_t end) {
+    uint32_t halves = 2 * SPIFlashHalfBlockCost(SPIFlash);
+    uint8_t blockErase = (SPIFlash->chip.eraseCmd[SPIFLASH_OP_BLOCKERASE] != 0);
+    uint32_t block = (blockErase && (SPIFlash->expected[SPIFLASH_OP_BLOCKERASE] < halves))
+                         ? SPIFlash->expected[SPIFLASH_OP_BLOCKERASE]
+                         : halves;
+    if ((address == 0) && (end == SPIFLASH_BLOCK2ADDRESS(SPIFlash->blockNum))
+        && (SPIFlash->expected[SPIFLASH_OP_CHIPERASE] < (uint64_t)SPIFlash->blockNum * block)) {
+        return SPIFLASH_OP_CHIPERASE;
+    }
+    if (blockErase && ((address % SPIFLASH_BLOCK_SIZE) == 0) && ((end - address) >= SPIFLASH_BLOCK_SIZE)
+        && (SPIFlash->expected[SPIFLASH_OP_BLOCKERASE] <= halves)) {
+        return SPIFLASH_OP_BLOCKERASE;
+    }
+    if (SPIFlash->chip.eraseCmd[SPIFLASH_OP_HALFBLOCKERASE] && ((address % SPIFLASH_HALFBLOCK_SIZE) == 0)
+        && ((end - address) >= SPIFLASH_HALFBLOCK_SIZE)
+        && (SPIFlash->expected[SPIFLASH_OP_HALFBLOCKERASE] <= SPIFlashHalfBlockCost(SPIFlash))) {
+        return SPIFLASH_OP_HALFBLOCKERASE;
+    }
+    return SPIFLASH_OP_SECTORERASE;
+}
+
+static SPIFlashStatus_t SPIFlashWriteFn(SPIFlash_t* SPIFlash, uint32_t pageNumber, const uint8_t* data,
+                                        uint32_t size, uint32_t offset) {
+    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    uint32_t address = 0, maximum = SPIFLASH_PAGE_SIZE - offset;
+    do {
+        if (pageNumber >= SPIFlash->pageNum) {
+            break;
+        }
+        if (offset >= SPIFLASH_PAGE_SIZE) {
+            break;
+        }
+        if (size > maximum) {
+            size = maximum;
+        }
+        address = SPIFLASH_PAGE2ADDRESS(pageNumber) + offset;
+
+        if (SPIFlash->options & SPIFLASH_OPT_SKIPUNCHANGED) {
+            uint8_t current[SPIFLASH_PAGE_SIZE], changed = 0, programmable = 1;
+            if (SPIFlashReadFn(SPIFlash, address, current, size) == SPIFLASH_ERROR) {
+                break;
+            }
+            for (uint32_t i = 0; i < size; i++) {
+                changed |= current[i] ^ data[i];
+                /* Programming can only clear bits */
+                programmable &= ((current[i] & data[i]) == data[i]);
+            }
+            if (!programmable) {
+                dprintf("SPIFlashWritePage() ERROR PAGE NEEDS ERASE\r\n");
+                break;
+            }
+            if (!changed) {
+                SPIFlash->skipped.programs++;
+                retVal = SPIFLASH_SUCCESS;
+                break;
+            }
+        }
+
+#if SPIFLASH_TRACE
+        uint32_t startTime = SPIFlashGetTickUs();
+#endif
+        SPIFlashStatus_t status = SPIFLASH_ERROR;
+        if (SPIFlashStartProgram(SPIFlash, address, data, size) == SPIFLASH_SUCCESS) {
+            status = SPIFlashWaitForWriting(SPIFlash, SPIFLASH_OP_PAGEPROG, size);
+        }
+        SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_PROGRAM, SPIFlash->progCmd, address, size, startTime, status);
+        if ((status == SPIFLASH_SUCCESS) && (SPIFlash->options & SPIFLASH_OPT_VERIFY)) {
+            uint8_t written[SPIFLASH_PAGE_SIZE];
+            if ((SPIFlashReadFn(SPIFlash, address, written, size) == SPIFLASH_ERROR)
+                || (memcmp(written, data, size) != 0)) {
+                dprintf("SPIFlashWritePage() ERROR VERIFY\r\n");
+                status = SPIFLASH_ERROR;
+            }
+        }
+        if (status == SPIFLASH_SUCCESS) {
+            retVal = SPIFLASH_SUCCESS;
+        }
+
+    } while (0);
+
+    /* WEL self-clears once the operation completes: only drop it explicitly if something went wrong */
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
     return retVal;
 }
 
+#if SPIFLASH_WRITE_COMBINE
+static SPIFlashStatus_t SPIFlashCombineFlush(SPIFlash_t* SPIFlash) {
+    uint32_t length = SPIFlash->combine.length;
+    if (length == 0) {
+        return SPIFLASH_SUCCESS;
+    }
+    SPIFlash->combine.length = 0;
+    return SPIFlashWriteFn(SPIFlash, SPIFLASH_ADDRESS2PAGE(SPIFlash->combine.address), SPIFlash->combine.data, length,
+                           SPIFlash->combine.address % SPIFLASH_PAGE_SIZE);
+}
+
+/* Same contract as SPIFlashWriteFn, but the page is only programmed once it is filled up to its end */
+static SPIFlashStatus_t SPIFlashCombine(SPIFlash_t* SPIFlash, uint32_t pageNumber, const uint8_t* data, uint32_t size,
+                                        uint32_t offset) {
+    SPIFlashCombine_t* combine = &SPIFlash->combine;
+    uint32_t address = SPIFLASH_PAGE2ADDRESS(pageNumber) + offset;
+    if ((combine->length == 0) || (address != combine->address + combine->length)) {
+        if (SPIFlashCombineFlush(SPIFlash) == SPIFLASH_ERROR) {
+            return SPIFLASH_ERROR;
+        }
+        if ((offset + size) == SPIFLASH_PAGE_SIZE) {
+            /* Nothing to combine with, program straight from the caller's buffer */
+            return SPIFlashWriteFn(SPIFlash, pageNumber, data, size, offset);
+        }
+        if ((pageNumber >= SPIFlash->pageNum) || (offset + size > SPIFLASH_PAGE_SIZE)) {
+            return SPIFLASH_ERROR;
+        }
+        combine->address = address;
+        combine->startTime = SPIFlashGetTick();
+    }
+    memcpy(&combine->data[combine->length], data, size);
+    combine->length += size;
+    if (((combine->address + combine->length) % SPIFLASH_PAGE_SIZE) == 0) {
+        return SPIFlashCombineFlush(SPIFlash);
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+/* Pending bytes are not in the flash yet: apply them the way a page program would */
+static void SPIFlashCombineOverlay(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
+    SPIFlashCombine_t* combine = &SPIFlash->combine;
+    for (uint32_t i = 0; i < combine->length; i++) {
+        if (combine->address + i - address < size) {
+            data[combine->address + i - address] &= combine->data[i];
+        }
+    }
+}
+#else
+#define SPIFlashCombineFlush(SPIFlash)                       SPIFLASH_SUCCESS
+#define SPIFlashCombineOverlay(SPIFlash, address, data, size)
+#endif
+
+/* Lock for a program or erase: pending combined bytes go to the flash first, so that operations stay in order */
+static SPIFlashStatus_t SPIFlashLockModify(SPIFlash_t* SPIFlash) {
+    if (SPIFlashLockIdle(SPIFlash) != SPIFLASH_SUCCESS) {
+        return SPIFLASH_BUSY;
+    }
+    if (SPIFlashCombineFlush(SPIFlash) == SPIFLASH_ERROR) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_ERROR;
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+/* Apply size bytes at offset of a sector, erasing it only if some bit has to go from 0 to 1 */
+static SPIFlashStatus_t SPIFlashUpdateSector(SPIFlash_t* SPIFlash, uint32_t sector, uint32_t offset,
+                                             const uint8_t* data, uint32_t size) {
+    uint8_t* scratch = SPIFlash->scratch;
+    uint32_t address = SPIFLASH_SECTOR2ADDRESS(sector), page, first, length, i;
+    uint8_t changed = 0, programmable = 1;
+
+    if (SPIFlashReadFn(SPIFlash, address + offset, &scratch[offset], size) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    for (i = 0; i < size; i++) {
+        changed |= scratch[offset + i] ^ data[i];
+        programmable &= ((scratch[offset + i] & data[i]) == data[i]);
+    }
+    if (!changed) {
+        return SPIFLASH_SUCCESS;
+    }
+
+    if (programmable) {
+        /* 1->0 transitions only: program the changed pages in place */
+        for (first = offset; first < offset + size; first += length) {
+            length = SPIFLASH_PAGE_SIZE - (first % SPIFLASH_PAGE_SIZE);
+            if (length > offset + size - first) {
+                length = offset + size - first;
+            }
+            if (memcmp(&scratch[first], &data[first - offset], length) == 0) {
+                continue;
+            }
+            page = SPIFLASH_SECTOR2PAGE(sector) + first / SPIFLASH_PAGE_SIZE;
+            if (SPIFlashWriteFn(SPIFlash, page, &data[first - offset], length, first % SPIFLASH_PAGE_SIZE)
+                == SPIFLASH_ERROR) {
+                return SPIFLASH_ERROR;
+            }
+        }
+        return SPIFLASH_SUCCESS;
+    }
+
+    /* Preserve the rest of the sector, erase it and program back only its non-blank pages */
+    if (((offset > 0) && (SPIFlashReadFn(SPIFlash, address, scratch, offset) == SPIFLASH_ERROR))
+        || ((offset + size < SPIFLASH_SECTOR_SIZE)
+            && (SPIFlashReadFn(SPIFlash, address + offset + size, &scratch[offset + size],
+                               SPIFLASH_SECTOR_SIZE - offset - size)
+                == SPIFLASH_ERROR))) {
+        return SPIFLASH_ERROR;
+    }
+    memcpy(&scratch[offset], data, size);
+    if (SPIFlashEraseFn(SPIFlash,
+                        SPIFlash->chip.eraseCmd[SPIFLASH_OP_SECTORERASE],
+                        address, SPIFLASH_SECTOR_SIZE, SPIFLASH_OP_SECTORERASE)
+        != SPIFLASH_SUCCESS) {
+        return SPIFLASH_ERROR;
+    }
+    for (page = 0; page < SPIFLASH_SECTOR_SIZE; page += SPIFLASH_PAGE_SIZE) {
+        for (i = 0; (i < SPIFLASH_PAGE_SIZE) && (scratch[page + i] == 0xFF); i++) {}
+        if ((i < SPIFLASH_PAGE_SIZE)
+            && (SPIFlashWriteFn(SPIFlash, SPIFLASH_SECTOR2PAGE(sector) + page / SPIFLASH_PAGE_SIZE, &scratch[page],
+                                SPIFLASH_PAGE_SIZE, 0)
+                == SPIFLASH_ERROR)) {
+            return SPIFLASH_ERROR;
+        }
+    }
+    return SPIFLASH_SUCCESS;
+}
+
 /* Private  functions ---------------------------------------------------------*/
 
 SPIFlashStatus_t SPIFlashInit(SPIFlash_t* SPIFlash, void* hSPI, void* GPIO, uint16_t pin) {
@@ -525,10 +1549,14 @@ SPIFlashStatus_t SPIFlashInit(SPIFlash_t* SPIFlash, void* hSPI, void* GPIO, uint
     }
 
     memset(SPIFlash, 0, sizeof(SPIFlash_t));
+    SPIFlashLockInit(&SPIFlash->lock);
     SPIFlash->hSPI = hSPI;
     SPIFlash->GPIO = GPIO;
     SPIFlash->pin = pin;
     SPIFlash->size = SPIFLASH_SIZE_ERROR;
+#if SPIFLASH_SCRATCH_STATIC
+    SPIFlash->scratch = SPIFlashScratch;
+#endif
     SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
 
     /* Wait for stable VCC */
@@ -536,6 +1564,15 @@ SPIFlashStatus_t SPIFlashInit(SPIFlash_t* SPIFlash, void* hSPI, void* GPIO, uint
         SPIFlashDelay(1);
     }
 
+#if SPIFLASH_POWERDOWN
+    /* The chip may have been left in deep power-down, e.g. across an MCU reset */
+    if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_RELEASE) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashDelayUs(SPIFLASH_RELEASE_TIME);
+    SPIFlash->power.lastActivity = SPIFlashGetTickUs();
+#endif
+
     if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE) == SPIFLASH_ERROR) {
         return SPIFLASH_ERROR;
     }
@@ -544,143 +1581,171 @@ SPIFlashStatus_t SPIFlashInit(SPIFlash_t* SPIFlash, void* hSPI, void* GPIO, uint
         return SPIFLASH_ERROR;
     }
 
+    SPIFlashDefaultChip(SPIFlash);
+    SPIFlashDefaultTiming(&SPIFlash->timing, SPIFlash->blockNum);
+    if (SPIFlashParseSFDP(SPIFlash)) {
+        dprintf("SPI FLASH SFDP: %lu BLOCKS - PAGE %lu - %d-BYTE ADDRESS\r\n", (unsigned long)SPIFlash->blockNum,
+                (unsigned long)SPIFlash->chip.pageSize, SPIFlash->chip.addrBytes);
+    }
+    if ((SPIFlash->chip.pageSize < SPIFLASH_PAGE_SIZE) || (SPIFlash->chip.eraseCmd[SPIFLASH_OP_SECTORERASE] == 0)) {
+        /* Programs are split at 256 B boundaries and sectors are 4 KiB */
+        dprintf("SPI FLASH UNSUPPORTED GEOMETRY\r\n");
+        return SPIFLASH_ERROR;
+    }
+    if (SPIFlash->chip.enter4 != 0) {
+        if (((SPIFlash->chip.enter4 == 2) && (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR))
+            || (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_ADDR4BYTE_EN) == SPIFLASH_ERROR)) {
+            return SPIFLASH_ERROR;
+        }
+    }
+    memcpy(SPIFlash->expected, SPIFlash->timing.typ, sizeof(SPIFlash->expected));
+
+    SPIFlashSelectEngines(SPIFlash);
+
     return SPIFLASH_SUCCESS;
 }
 
-SPIFlashStatus_t SPIFlashEraseChip(SPIFlash_t* SPIFlash) {
+void SPIFlashSetOptions(SPIFlash_t* SPIFlash, uint8_t options) {
     SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint8_t tx[1] = {SPIFLASH_CMD_CHIPERASE1};
+    SPIFlash->options = options;
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+
+SPIFlashStatus_t SPIFlashEraseChip(SPIFlash_t* SPIFlash) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
     do {
-#if SPIFLASH_DEBUG != SPIFLASH_DEBUG_DISABLE
-        uint32_t dbgTime = SPIFlashGetTick();
-#endif
-        dprintf("SPIFlashEraseChip() START\r\n");
-        if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
-            break;
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-        if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 1, 100) == SPIFLASH_ERROR) {
-            SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-            break;
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-        if (SPIFlashWaitForWriting(SPIFlash, SPIFlash->blockNum * 1000)) {
-            dprintf("SPIFlashEraseChip() DONE IN %ld ms\r\n", SPIFlashGetTick() - dbgTime);
+        if (SPIFlashEraseFn(SPIFlash, SPIFLASH_CMD_CHIPERASE1, 0, SPIFLASH_BLOCK2ADDRESS(SPIFlash->blockNum),
+                            SPIFLASH_OP_CHIPERASE)
+            == SPIFLASH_SUCCESS) {
             retVal = SPIFLASH_SUCCESS;
         }
 
     } while (0);
 
-    SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
     SPIFlashUnLock(SPIFlash);
     return retVal;
 }
 
 SPIFlashStatus_t SPIFlashEraseSector(SPIFlash_t* SPIFlash, uint32_t sector) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
     uint32_t address = sector * SPIFLASH_SECTOR_SIZE;
-    uint8_t tx[5];
     do {
-#if SPIFLASH_DEBUG != SPIFLASH_DEBUG_DISABLE
-        uint32_t dbgTime = SPIFlashGetTick();
-#endif
-        dprintf("SPIFlashEraseSector() START SECTOR %ld\r\n", sector);
         if (sector >= SPIFlash->sectorNum) {
             dprintf("SPIFlashEraseSector() ERROR SECTOR NUMBER\r\n");
             break;
         }
-        if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
-            break;
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-        if (SPIFlash->blockNum >= 512) {
-            tx[0] = SPIFLASH_CMD_SECTORERASE4ADD;
-            tx[1] = (address & 0xFF000000) >> 24;
-            tx[2] = (address & 0x00FF0000) >> 16;
-            tx[3] = (address & 0x0000FF00) >> 8;
-            tx[4] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 5, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
-            }
-        } else {
-            tx[0] = SPIFLASH_CMD_SECTORERASE3ADD;
-            tx[1] = (address & 0x00FF0000) >> 16;
-            tx[2] = (address & 0x0000FF00) >> 8;
-            tx[3] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 4, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
-            }
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-        if (SPIFlashWaitForWriting(SPIFlash, 1000)) {
-            dprintf("SPIFlashEraseSector() DONE AFTER %ld ms\r\n", SPIFlashGetTick() - dbgTime);
+        if (SPIFlashEraseFn(SPIFlash,
+                            SPIFlash->chip.eraseCmd[SPIFLASH_OP_SECTORERASE],
+                            address, SPIFLASH_SECTOR_SIZE, SPIFLASH_OP_SECTORERASE)
+            == SPIFLASH_SUCCESS) {
             retVal = SPIFLASH_SUCCESS;
         }
 
     } while (0);
 
-    SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
     SPIFlashUnLock(SPIFlash);
     return retVal;
 }
 
 SPIFlashStatus_t SPIFlashEraseBlock(SPIFlash_t* SPIFlash, uint32_t block) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
     uint32_t address = block * SPIFLASH_BLOCK_SIZE;
-    uint8_t tx[5];
     do {
-#if SPIFLASH_DEBUG != SPIFLASH_DEBUG_DISABLE
-        uint32_t dbgTime = SPIFlashGetTick();
-#endif
-        dprintf("SPIFlashEraseBlock() START PAGE %ld\r\n", block);
         if (block >= SPIFlash->blockNum) {
             dprintf("SPIFlashEraseBlock() ERROR BLOCK NUMBER\r\n");
             break;
         }
-        if (SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEENABLE) == SPIFLASH_ERROR) {
+        if (SPIFlashEraseFn(SPIFlash,
+                            SPIFlash->chip.eraseCmd[SPIFLASH_OP_BLOCKERASE],
+                            address, SPIFLASH_BLOCK_SIZE, SPIFLASH_OP_BLOCKERASE)
+            == SPIFLASH_SUCCESS) {
+            retVal = SPIFLASH_SUCCESS;
+        }
+
+    } while (0);
+
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
+    SPIFlashUnLock(SPIFlash);
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashEraseRange(SPIFlash_t* SPIFlash, uint32_t address, uint32_t length) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    uint32_t end = address + length, size;
+    uint8_t cmd;
+    SPIFlashOp_t op;
+    do {
+        if ((address % SPIFLASH_SECTOR_SIZE) || (length % SPIFLASH_SECTOR_SIZE)
+            || (address > SPIFLASH_BLOCK2ADDRESS(SPIFlash->blockNum))
+            || (length > SPIFLASH_BLOCK2ADDRESS(SPIFlash->blockNum) - address)) {
+            dprintf("SPIFlashEraseRange() ERROR RANGE\r\n");
+            retVal = SPIFLASH_ERROR;
             break;
         }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_RESET);
-        if (SPIFlash->blockNum >= 512) {
-            tx[0] = SPIFLASH_CMD_BLOCKERASE4ADD;
-            tx[1] = (address & 0xFF000000) >> 24;
-            tx[2] = (address & 0x00FF0000) >> 16;
-            tx[3] = (address & 0x0000FF00) >> 8;
-            tx[4] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 5, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
-            }
-        } else {
-            tx[0] = SPIFLASH_CMD_BLOCKERASE3ADD;
-            tx[1] = (address & 0x00FF0000) >> 16;
-            tx[2] = (address & 0x0000FF00) >> 8;
-            tx[3] = (address & 0x000000FF);
-            if (SPIFlashTransmitReceive(SPIFlash, tx, tx, 4, 100) == SPIFLASH_ERROR) {
-                SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-                break;
+        while (address < end) {
+            op = SPIFlashPlanErase(SPIFlash, address, end);
+            switch (op) {
+                case SPIFLASH_OP_CHIPERASE:
+                    cmd = SPIFLASH_CMD_CHIPERASE1;
+                    size = end - address;
+                    break;
+                case SPIFLASH_OP_BLOCKERASE:
+                    cmd = SPIFlash->chip.eraseCmd[op];
+                    size = SPIFLASH_BLOCK_SIZE;
+                    break;
+                case SPIFLASH_OP_HALFBLOCKERASE:
+                    cmd = SPIFlash->chip.eraseCmd[op];
+                    size = SPIFLASH_HALFBLOCK_SIZE;
+                    break;
+                default:
+                    cmd = SPIFlash->chip.eraseCmd[op];
+                    size = SPIFLASH_SECTOR_SIZE;
+                    break;
             }
-        }
-        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
-        if (SPIFlashWaitForWriting(SPIFlash, 3000)) {
-            dprintf("SPIFlashEraseBlock() DONE AFTER %ld ms\r\n", SPIFlashGetTick() - dbgTime);
-            retVal = SPIFLASH_SUCCESS;
+            if (SPIFlashEraseFn(SPIFlash, cmd, address, size, op) != SPIFLASH_SUCCESS) {
+                retVal = SPIFLASH_ERROR;
+                break;
+            }
+            address += size;
         }
 
     } while (0);
 
-    SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
     SPIFlashUnLock(SPIFlash);
     return retVal;
 }
 
-SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
-    SPIFlashLock(SPIFlash);
+SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data,
+                                      uint32_t size) {
+    if (SPIFlashLockIdle(SPIFlash) != SPIFLASH_SUCCESS) {
+        return SPIFLASH_BUSY;
+    }
     SPIFlashStatus_t retVal = SPIFLASH_ERROR;
     uint32_t page, add, offset, remaining, length, index = 0;
     add = address;
@@ -688,14 +1753,19 @@ SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, ui
     do {
         page = SPIFLASH_ADDRESS2PAGE(add);
         offset = add % SPIFLASH_PAGE_SIZE;
-        if (remaining <= SPIFLASH_PAGE_SIZE) {
+        length = SPIFLASH_PAGE_SIZE - offset;
+        if (length > remaining) {
             length = remaining;
-        } else {
-            length = SPIFLASH_PAGE_SIZE - offset;
         }
+#if SPIFLASH_WRITE_COMBINE
+        if (SPIFlashCombine(SPIFlash, page, &data[index], length, offset) == SPIFLASH_ERROR) {
+            break;
+        }
+#else
         if (SPIFlashWriteFn(SPIFlash, page, &data[index], length, offset) == SPIFLASH_ERROR) {
             break;
         }
+#endif
         add += length;
         index += length;
         remaining -= length;
@@ -710,19 +1780,24 @@ SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, ui
     return retVal;
 }
 
-SPIFlashStatus_t SPIFlashWritePage(SPIFlash_t* SPIFlash, uint32_t pageNumber, uint8_t* data, uint32_t size,
+SPIFlashStatus_t SPIFlashWritePage(SPIFlash_t* SPIFlash, uint32_t pageNumber, const uint8_t* data, uint32_t size,
                                    uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
     retVal = SPIFlashWriteFn(SPIFlash, pageNumber, data, size, offset);
     SPIFlashUnLock(SPIFlash);
     return retVal;
 }
 
-SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber, uint8_t* data, uint32_t size,
-                                     uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_SUCCESS;
+SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber, const uint8_t* data,
+                                     uint32_t size, uint32_t offset) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
     do {
         if (offset >= SPIFLASH_SECTOR_SIZE) {
             retVal = SPIFLASH_ERROR;
@@ -737,7 +1812,10 @@ SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber
         uint32_t remainingBytes = size;
         uint32_t pageOffset = offset % SPIFLASH_PAGE_SIZE;
         while (remainingBytes > 0 && pageNumber < ((sectorNumber + 1) * (SPIFLASH_SECTOR_SIZE / SPIFLASH_PAGE_SIZE))) {
-            uint32_t bytesToWrite = (remainingBytes > SPIFLASH_PAGE_SIZE) ? SPIFLASH_PAGE_SIZE : remainingBytes;
+            uint32_t bytesToWrite = SPIFLASH_PAGE_SIZE - pageOffset;
+            if (bytesToWrite > remainingBytes) {
+                bytesToWrite = remainingBytes;
+            }
             if (SPIFlashWriteFn(SPIFlash, pageNumber, data + bytesWritten, bytesToWrite, pageOffset)
                 == SPIFLASH_ERROR) {
                 retVal = SPIFLASH_ERROR;
@@ -753,10 +1831,12 @@ SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber
     return retVal;
 }
 
-SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, uint8_t* data, uint32_t size,
-                                    uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_SUCCESS;
+SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, const uint8_t* data,
+                                    uint32_t size, uint32_t offset) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
     do {
         if (offset >= SPIFLASH_BLOCK_SIZE) {
             retVal = SPIFLASH_ERROR;
@@ -771,7 +1851,10 @@ SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber,
         uint32_t remainingBytes = size;
         uint32_t pageOffset = offset % SPIFLASH_PAGE_SIZE;
         while (remainingBytes > 0 && pageNumber < ((blockNumber + 1) * (SPIFLASH_BLOCK_SIZE / SPIFLASH_PAGE_SIZE))) {
-            uint32_t bytesToWrite = (remainingBytes > SPIFLASH_PAGE_SIZE) ? SPIFLASH_PAGE_SIZE : remainingBytes;
+            uint32_t bytesToWrite = SPIFLASH_PAGE_SIZE - pageOffset;
+            if (bytesToWrite > remainingBytes) {
+                bytesToWrite = remainingBytes;
+            }
             if (SPIFlashWriteFn(SPIFlash, pageNumber, data + bytesWritten, bytesToWrite, pageOffset)
                 == SPIFLASH_ERROR) {
                 retVal = SPIFLASH_ERROR;
@@ -789,52 +1872,680 @@ SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber,
     return retVal;
 }
 
-SPIFlashStatus_t SPIFlashReadAddress(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
+SPIFlashStatus_t SPIFlashWritev(SPIFlash_t* SPIFlash, const SPIFlashSegment_t* segments, uint32_t count) {
+    uint8_t buffer[SPIFLASH_PAGE_SIZE], written[SPIFLASH_PAGE_SIZE / 8];
+    const uint8_t* data = NULL;
+    uint32_t index = 0, position = 0, page, address, offset, length, end, first, last, covered, pieces;
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    while ((index < count) && (retVal == SPIFLASH_SUCCESS)) {
+        if (position == segments[index].length) {
+            index++;
+            position = 0;
+            continue;
+        }
+
+        /* Gather the consecutive pieces falling in the page of the next byte to be written */
+        address = segments[index].address + position;
+        page = SPIFLASH_ADDRESS2PAGE(address);
+        memset(buffer, 0xFF, sizeof(buffer));
+        memset(written, 0, sizeof(written));
+        first = SPIFLASH_PAGE_SIZE;
+        last = 0;
+        covered = 0;
+        pieces = 0;
+        while (index < count) {
+            address = segments[index].address + position;
+            length = segments[index].length - position;
+            if (length == 0) {
+                index++;
+                position = 0;
+                continue;
+            }
+            if (SPIFLASH_ADDRESS2PAGE(address) != page) {
+                break;
+            }
+            offset = address % SPIFLASH_PAGE_SIZE;
+            if (length > SPIFLASH_PAGE_SIZE - offset) {
+                length = SPIFLASH_PAGE_SIZE - offset;
+            }
+            data = &segments[index].data[position];
+            memcpy(&buffer[offset], data, length);
+            for (uint32_t i = offset; i < offset + length; i++) {
+                written[i / 8] |= 1 << (i % 8);
+            }
+            first = (offset < first) ? offset : first;
+            last = (offset + length > last) ? offset + length : last;
+            covered += length;
+            pieces++;
+            position += length;
+            if (position < segments[index].length) {
+                /* The segment goes on in the next page */
+                break;
+            }
+            index++;
+            position = 0;
+        }
+        if (pieces == 0) {
+            /* Only empty segments were left */
+            break;
+        }
+
+        /* A single piece is programmed straight from the caller's buffer */
+        if (pieces > 1) {
+            data = &buffer[first];
+            /* Read-back options compare the whole program: the gaps must hold the current content, not 0xFF */
+            if ((covered < last - first) && (SPIFlash->options & (SPIFLASH_OPT_SKIPUNCHANGED | SPIFLASH_OPT_VERIFY))) {
+                for (offset = first; offset < last; offset = end) {
+                    for (end = offset; (end < last) && !(written[end / 8] & (1 << (end % 8))); end++) {}
+                    if (end == offset) {
+                        end++;
+                    } else if (SPIFlashReadFn(SPIFlash, SPIFLASH_PAGE2ADDRESS(page) + offset, &buffer[offset],
+                                              end - offset)
+                               == SPIFLASH_ERROR) {
+                        retVal = SPIFLASH_ERROR;
+                        break;
+                    }
+                }
+            }
+        }
+        if ((retVal == SPIFLASH_SUCCESS)
+            && (SPIFlashWriteFn(SPIFlash, page, data, last - first, first) == SPIFLASH_ERROR)) {
+            retVal = SPIFLASH_ERROR;
+        }
+    }
+    SPIFlashUnLock(SPIFlash);
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashFlush(SPIFlash_t* SPIFlash) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal == SPIFLASH_SUCCESS) {
+        SPIFlashUnLock(SPIFlash);
+    }
+    return retVal;
+}
+
+void SPIFlashSetScratch(SPIFlash_t* SPIFlash, uint8_t* scratch) {
     SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    retVal = SPIFlashReadFn(SPIFlash, address, data, size);
+    SPIFlash->scratch = scratch;
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+
+SPIFlashStatus_t SPIFlashUpdateAddress(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data, uint32_t size) {
+    uint32_t sector, offset, length;
+    if ((address >= SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum))
+        || (size > SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum) - address)) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    /* Checked under the lock, as SPIFlashSetScratch() may run concurrently */
+    if (SPIFlash->scratch == NULL) {
+        SPIFlashUnLock(SPIFlash);
+        return SPIFLASH_ERROR;
+    }
+    while (size > 0) {
+        sector = SPIFLASH_ADDRESS2SECTOR(address);
+        offset = address % SPIFLASH_SECTOR_SIZE;
+        length = SPIFLASH_SECTOR_SIZE - offset;
+        if (length > size) {
+            length = size;
+        }
+        if (SPIFlashUpdateSector(SPIFlash, sector, offset, data, length) == SPIFLASH_ERROR) {
+            SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+            retVal = SPIFLASH_ERROR;
+            break;
+        }
+        address += length;
+        data += length;
+        size -= length;
+    }
     SPIFlashUnLock(SPIFlash);
     return retVal;
 }
 
+SPIFlashStatus_t SPIFlashReadAddress(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size) {
+    SPIFlashStatus_t retVal = SPIFlashLockRead(SPIFlash, address, size);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFlashCacheRead(SPIFlash, address, data, size);
+    SPIFlashCombineOverlay(SPIFlash, address, data, size);
+    SPIFlashUnLockRead(SPIFlash);
+    return retVal;
+}
+
 SPIFlashStatus_t SPIFlashReadPage(SPIFlash_t* SPIFlash, uint32_t pageNumber, uint8_t* data, uint32_t size,
                                   uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint32_t address = SPIFLASH_PAGE2ADDRESS(pageNumber);
+    uint32_t address = SPIFLASH_PAGE2ADDRESS(pageNumber) + offset;
     uint32_t maximum = SPIFLASH_PAGE_SIZE - offset;
     if (size > maximum) {
         size = maximum;
     }
-    retVal = SPIFlashReadFn(SPIFlash, address, data, size);
-    SPIFlashUnLock(SPIFlash);
-    return retVal;
+    return SPIFlashReadAddress(SPIFlash, address, data, size);
 }
 
 SPIFlashStatus_t SPIFlashReadSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber, uint8_t* data, uint32_t size,
                                     uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint32_t address = SPIFLASH_SECTOR2ADDRESS(sectorNumber);
+    uint32_t address = SPIFLASH_SECTOR2ADDRESS(sectorNumber) + offset;
     uint32_t maximum = SPIFLASH_SECTOR_SIZE - offset;
     if (size > maximum) {
         size = maximum;
     }
-    retVal = SPIFlashReadFn(SPIFlash, address, data, size);
-    SPIFlashUnLock(SPIFlash);
-    return retVal;
+    return SPIFlashReadAddress(SPIFlash, address, data, size);
 }
 
 SPIFlashStatus_t SPIFlashReadBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, uint8_t* data, uint32_t size,
                                    uint32_t offset) {
-    SPIFlashLock(SPIFlash);
-    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
-    uint32_t address = SPIFLASH_BLOCK2ADDRESS(blockNumber);
+    uint32_t address = SPIFLASH_BLOCK2ADDRESS(blockNumber) + offset;
     uint32_t maximum = SPIFLASH_BLOCK_SIZE - offset;
     if (size > maximum) {
         size = maximum;
     }
-    retVal = SPIFlashReadFn(SPIFlash, address, data, size);
+    return SPIFlashReadAddress(SPIFlash, address, data, size);
+}
+
+SPIFlashStatus_t SPIFlashReadv(SPIFlash_t* SPIFlash, const SPIFlashSegment_t* segments, uint32_t count) {
+    uint32_t index, next, end, low = UINT32_MAX, high = 0;
+    for (index = 0; index < count; index++) {
+        if (segments[index].length > 0) {
+            end = segments[index].address + segments[index].length;
+            low = (segments[index].address < low) ? segments[index].address : low;
+            high = (end > high) ? end : high;
+        }
+    }
+    if (high == 0) {
+        return SPIFLASH_SUCCESS;
+    }
+    SPIFlashStatus_t retVal = SPIFlashLockRead(SPIFlash, low, high - low);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    for (index = 0; (index < count) && (retVal == SPIFLASH_SUCCESS); index = next) {
+        end = segments[index].address + segments[index].length;
+        for (next = index + 1; (next < count) && ((segments[next].length == 0) || (segments[next].address == end));
+             next++) {
+            end += segments[next].length;
+        }
+        if (next - index > 1) {
+            retVal = SPIFlashReadRun(SPIFlash, &segments[index], next - index);
+        } else if (segments[index].length > 0) {
+            /* Lone segments still go through the read cache */
+            retVal = SPIFlashCacheRead(SPIFlash, segments[index].address, segments[index].data, segments[index].length);
+        }
+        for (uint32_t i = index; i < next; i++) {
+            SPIFlashCombineOverlay(SPIFlash, segments[i].address, segments[i].data, segments[i].length);
+        }
+    }
+    SPIFlashUnLockRead(SPIFlash);
+    return retVal;
+}
+
+static SPIFlashStatus_t SPIFlashAsyncStart(SPIFlash_t* SPIFlash, uint8_t op, SPIFlashOp_t timedOp,
+                                           SPIFlashCallback_t callback, void* context) {
+    SPIFlash->async.op = op;
+    SPIFlash->async.timedOp = timedOp;
+    SPIFlash->async.startTime = SPIFlashGetTickUs();
+    SPIFlash->async.callback = callback;
+    SPIFlash->async.context = context;
+    return SPIFLASH_SUCCESS;
+}
+
+#if SPIFLASH_TRACE
+/* Record the page program or erase started by the last asynchronous call */
+static void SPIFlashAsyncTrace(SPIFlash_t* SPIFlash, SPIFlashStatus_t status) {
+    if (SPIFlash->async.op == SPIFLASH_ASYNC_WRITE) {
+        SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_PROGRAM | SPIFLASH_TRACE_ASYNC, SPIFlash->progCmd,
+                         SPIFlash->async.address - SPIFlash->async.length, SPIFlash->async.length,
+                         SPIFlash->async.startTime, status);
+    } else {
+        SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_ERASE | SPIFLASH_TRACE_ASYNC,
+                         SPIFlash->chip.eraseCmd[SPIFlash->async.timedOp], SPIFlash->async.busyAddress,
+                         SPIFlash->async.length, SPIFlash->async.startTime, status);
+    }
+}
+#else
+#define SPIFlashAsyncTrace(SPIFlash, status)
+#endif
+
+static SPIFlashStatus_t SPIFlashAsyncNextPage(SPIFlash_t* SPIFlash) {
+    uint32_t length = SPIFLASH_PAGE_SIZE - (SPIFlash->async.address % SPIFLASH_PAGE_SIZE);
+    if (length > SPIFlash->async.remaining) {
+        length = SPIFlash->async.remaining;
+    }
+    if (SPIFlashStartProgram(SPIFlash, SPIFlash->async.address, SPIFlash->async.data, length) == SPIFLASH_ERROR) {
+        return SPIFLASH_ERROR;
+    }
+    /* The whole page is off limits while its program is suspended */
+    SPIFlash->async.busyAddress = SPIFlash->async.address & ~(SPIFLASH_PAGE_SIZE - 1);
+    SPIFlash->async.busyLength = SPIFLASH_PAGE_SIZE;
+    SPIFlash->async.address += length;
+    SPIFlash->async.data += length;
+    SPIFlash->async.remaining -= length;
+    SPIFlash->async.length = length;
+    SPIFlash->async.startTime = SPIFlashGetTickUs();
+    return SPIFLASH_SUCCESS;
+}
+
+static SPIFlashStatus_t SPIFlashEraseAsync(SPIFlash_t* SPIFlash, uint8_t cmd, uint32_t address, uint32_t size,
+                                           SPIFlashOp_t timedOp, SPIFlashCallback_t callback, void* context) {
+    SPIFlashStatus_t retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
+    if (SPIFlashStartErase(SPIFlash, cmd, address, size) == SPIFLASH_SUCCESS) {
+        SPIFlash->async.busyAddress = address;
+        SPIFlash->async.busyLength = size;
+        SPIFlash->async.length = size;
+        retVal = SPIFlashAsyncStart(SPIFlash, SPIFLASH_ASYNC_ERASE, timedOp, callback, context);
+    } else {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
+    SPIFlashUnLock(SPIFlash);
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashEraseChipAsync(SPIFlash_t* SPIFlash, SPIFlashCallback_t callback, void* context) {
+    return SPIFlashEraseAsync(SPIFlash, SPIFLASH_CMD_CHIPERASE1, 0, SPIFLASH_BLOCK2ADDRESS(SPIFlash->blockNum),
+                              SPIFLASH_OP_CHIPERASE, callback, context);
+}
+
+SPIFlashStatus_t SPIFlashEraseSectorAsync(SPIFlash_t* SPIFlash, uint32_t sector, SPIFlashCallback_t callback,
+                                          void* context) {
+    if (sector >= SPIFlash->sectorNum) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashEraseAsync(SPIFlash,
+                              SPIFlash->chip.eraseCmd[SPIFLASH_OP_SECTORERASE],
+                              SPIFLASH_SECTOR2ADDRESS(sector), SPIFLASH_SECTOR_SIZE, SPIFLASH_OP_SECTORERASE, callback,
+                              context);
+}
+
+SPIFlashStatus_t SPIFlashEraseBlockAsync(SPIFlash_t* SPIFlash, uint32_t block, SPIFlashCallback_t callback,
+                                         void* context) {
+    if (block >= SPIFlash->blockNum) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashEraseAsync(SPIFlash,
+                              SPIFlash->chip.eraseCmd[SPIFLASH_OP_BLOCKERASE],
+                              SPIFLASH_BLOCK2ADDRESS(block), SPIFLASH_BLOCK_SIZE, SPIFLASH_OP_BLOCKERASE, callback,
+                              context);
+}
+
+SPIFlashStatus_t SPIFlashWriteAddressAsync(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data,
+                                           uint32_t size, SPIFlashCallback_t callback, void* context) {
+    SPIFlashStatus_t retVal = SPIFLASH_ERROR;
+    if ((size == 0) || (address >= SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum))
+        || (size > SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum) - address)) {
+        return SPIFLASH_ERROR;
+    }
+    retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFLASH_ERROR;
+    SPIFlash->async.address = address;
+    SPIFlash->async.data = data;
+    SPIFlash->async.remaining = size;
+    if (SPIFlashAsyncNextPage(SPIFlash) == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashAsyncStart(SPIFlash, SPIFLASH_ASYNC_WRITE, SPIFLASH_OP_PAGEPROG, callback, context);
+    } else {
+        SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+    }
+    SPIFlashUnLock(SPIFlash);
+    return retVal;
+}
+
+/* Receive the next chunk into buffer[fill]. Called by the task when starting or restarting the stream, by
+ * SPIFlashDMAComplete() otherwise */
+static SPIFlashStatus_t SPIFlashStreamNext(SPIFlash_t* SPIFlash) {
+    SPIFlashStream_t* stream = &SPIFlash->stream;
+    uint8_t* buffer = stream->buffer[stream->fill];
+    uint32_t length = stream->size - stream->requested;
+    if (length > stream->chunk) {
+        length = stream->chunk;
+    }
+    stream->requested += length;
+    stream->startTime = SPIFlashGetTick();
+    stream->running = 1;
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
+    if (HAL_SPI_Receive_DMA(SPIFlash->hSPI, buffer, length) != HAL_OK) {
+        stream->running = 0;
+        return SPIFLASH_ERROR;
+    }
+#elif (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+    SPIFlashSimTransferDMA(SPIFlash->hSPI, buffer, length, SPIFlash->readDataLines);
+#else
+    if (SPIFlashReceive(SPIFlash, buffer, length, SPIFlash->readDataLines, 2000) != SPIFLASH_SUCCESS) {
+        stream->running = 0;
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashDMAComplete(SPIFlash);
+#endif
+    return SPIFLASH_SUCCESS;
+}
+
+static SPIFlashStatus_t SPIFlashStreamPoll(SPIFlash_t* SPIFlash) {
+    SPIFlashStream_t* stream = &SPIFlash->stream;
+    SPIFlashStatus_t retVal = SPIFLASH_BUSY;
+    uint32_t length;
+
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_SIM)
+    if (stream->running && !SPIFlashSimDMABusy(SPIFlash->hSPI)) {
+        SPIFlashDMAComplete(SPIFlash);
+    }
+#endif
+    if (stream->filled != stream->consumed) {
+        length = stream->size - stream->delivered;
+        if (length > stream->chunk) {
+            length = stream->chunk;
+        }
+        stream->callback(stream->buffer[stream->deliver], length, stream->context);
+        stream->deliver ^= 1;
+        stream->delivered += length;
+        /* Hand the buffer back before checking running: if the transfer completes in between, the interrupt sees
+         * the free buffer and restarts by itself */
+        stream->consumed++;
+        if (!stream->running && (stream->requested < stream->size) && !stream->error) {
+            stream->error = (SPIFlashStreamNext(SPIFlash) != SPIFLASH_SUCCESS);
+        }
+    }
+
+    if (stream->error && !stream->running) {
+        retVal = SPIFLASH_ERROR;
+    } else if (stream->running && (SPIFlashGetTick() - stream->startTime >= 2000)) {
+#if (SPIFLASH_PLATFORM == SPIFLASH_PLATFORM_HAL_DMA)
+        HAL_SPI_DMAStop(SPIFlash->hSPI);
+#endif
+        stream->running = 0;
+        retVal = SPIFLASH_TIMEOUT;
+    } else if (stream->delivered == stream->size) {
+        SPIFlashStatsAdd(&SPIFlash->stats.read, stream->size, SPIFlashGetTickUs() - stream->openTime);
+        retVal = SPIFLASH_SUCCESS;
+    }
+    if (retVal != SPIFLASH_BUSY) {
+        SPIFlashTraceAdd(SPIFlash, SPIFLASH_TRACE_READ | SPIFLASH_TRACE_ASYNC, SPIFlash->readCmd, stream->address,
+                         stream->delivered, stream->openTime, retVal);
+        SPIFlashLock(SPIFlash);
+        SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+        SPIFlash->async.op = SPIFLASH_ASYNC_IDLE;
+        SPIFlashUnLock(SPIFlash);
+    }
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashReadStream(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size, uint8_t* buffer0,
+                                    uint8_t* buffer1, uint32_t chunk, SPIFlashStreamCallback_t callback,
+                                    void* context) {
+    SPIFlashStream_t* stream = &SPIFlash->stream;
+    SPIFlashStatus_t retVal;
+    if ((size == 0) || (chunk == 0) || (chunk > 0xFFFF) || (buffer0 == NULL) || (buffer1 == NULL) || (callback == NULL)
+        || (address >= SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum))
+        || (size > SPIFLASH_PAGE2ADDRESS(SPIFlash->pageNum) - address)) {
+        return SPIFLASH_ERROR;
+    }
+    /* Pending write-combined bytes are programmed first, as the stream bypasses the overlay */
+    retVal = SPIFlashLockModify(SPIFlash);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    stream->buffer[0] = buffer0;
+    stream->buffer[1] = buffer1;
+    stream->address = address;
+    stream->chunk = chunk;
+    stream->size = size;
+    stream->requested = 0;
+    stream->delivered = 0;
+    stream->openTime = SPIFlashGetTickUs();
+    stream->fill = 0;
+    stream->deliver = 0;
+    stream->filled = 0;
+    stream->consumed = 0;
+    stream->error = 0;
+    stream->running = 0;
+    stream->callback = callback;
+    stream->context = context;
+    retVal = SPIFLASH_ERROR;
+    if (SPIFlashStartRead(SPIFlash, address) == SPIFLASH_SUCCESS) {
+        SPIFlash->async.op = SPIFLASH_ASYNC_STREAM;
+        if (SPIFlashStreamNext(SPIFlash) == SPIFLASH_SUCCESS) {
+            retVal = SPIFLASH_SUCCESS;
+        } else {
+            SPIFlash_WRITE_PIN(SPIFlash->GPIO, SPIFlash->pin, SPIFlash_PIN_SET);
+            SPIFlash->async.op = SPIFLASH_ASYNC_IDLE;
+        }
+    }
+    SPIFlashUnLock(SPIFlash);
+    return retVal;
+}
+
+void SPIFlashDMAComplete(SPIFlash_t* SPIFlash) {
+    SPIFlashStream_t* stream = &SPIFlash->stream;
+    if ((SPIFlash->async.op != SPIFLASH_ASYNC_STREAM) || !stream->running) {
+        return;
+    }
+    stream->running = 0;
+    stream->fill ^= 1;
+    stream->filled++;
+    /* Keep the clock running as long as the task has a free buffer, otherwise SPIFlashPoll() restarts it */
+    if ((stream->requested < stream->size) && ((uint8_t)(stream->filled - stream->consumed) < 2)) {
+        stream->error = (SPIFlashStreamNext(SPIFlash) != SPIFLASH_SUCCESS);
+    }
+}
+
+SPIFlashStatus_t SPIFlashPoll(SPIFlash_t* SPIFlash) {
+    SPIFlashStatus_t retVal = SPIFLASH_BUSY;
+    SPIFlashCallback_t callback = NULL;
+    void* context = NULL;
+
+    if (SPIFlash->async.op == SPIFLASH_ASYNC_STREAM) {
+        return SPIFlashStreamPoll(SPIFlash);
+    }
+    if (SPIFlash->async.op == SPIFLASH_ASYNC_IDLE) {
+#if SPIFLASH_WRITE_COMBINE
+        if ((SPIFlash->combine.length > 0)
+            && (SPIFlashGetTick() - SPIFlash->combine.startTime >= SPIFLASH_WRITE_COMBINE_TIMEOUT)) {
+            return SPIFlashFlush(SPIFlash);
+        }
+#endif
+#if SPIFLASH_POWERDOWN
+        if ((SPIFlash->power.idle != 0) && !SPIFlash->power.down
+            && (SPIFlashGetTickUs() - SPIFlash->power.lastActivity >= SPIFlash->power.idle)) {
+            SPIFlashLock(SPIFlash);
+            /* Checked again under the lock, another task may have used the chip in the meantime */
+            if ((SPIFlash->async.op == SPIFLASH_ASYNC_IDLE)
+#if SPIFLASH_WRITE_COMBINE
+                && (SPIFlash->combine.length == 0)
+#endif
+                && (SPIFlashGetTickUs() - SPIFlash->power.lastActivity >= SPIFlash->power.idle)) {
+                retVal = SPIFlashEnterPowerDown(SPIFlash);
+            }
+            /* Not activity: released without moving lastActivity */
+            SPIFlashLockRelease(&SPIFlash->lock);
+            return (retVal == SPIFLASH_BUSY) ? SPIFLASH_SUCCESS : retVal;
+        }
+#endif
+        return SPIFLASH_SUCCESS;
+    }
+    SPIFlashLock(SPIFlash);
+    do {
+        if (SPIFlashReadReg(SPIFlash, SPIFLASH_CMD_READSTATUS1) & SPIFlashSTATUS1_BUSY) {
+            if (SPIFlashGetTickUs() - SPIFlash->async.startTime >= SPIFlash->timing.max[SPIFlash->async.timedOp]) {
+                retVal = SPIFLASH_TIMEOUT;
+                SPIFlashAsyncTrace(SPIFlash, retVal);
+            }
+            break;
+        }
+        SPIFlashStatsAdd(&SPIFlash->stats.op[SPIFlash->async.timedOp], SPIFlash->async.length,
+                         SPIFlashGetTickUs() - SPIFlash->async.startTime);
+        SPIFlashAsyncTrace(SPIFlash, SPIFLASH_SUCCESS);
+        if ((SPIFlash->async.op == SPIFLASH_ASYNC_WRITE) && (SPIFlash->async.remaining > 0)) {
+            if (SPIFlashAsyncNextPage(SPIFlash) == SPIFLASH_ERROR) {
+                retVal = SPIFLASH_ERROR;
+            }
+            break;
+        }
+        retVal = SPIFLASH_SUCCESS;
+    } while (0);
+
+    if (retVal != SPIFLASH_BUSY) {
+        if (retVal != SPIFLASH_SUCCESS) {
+            SPIFlashSendCmd(SPIFlash, SPIFLASH_CMD_WRITEDISABLE);
+        }
+        callback = SPIFlash->async.callback;
+        context = SPIFlash->async.context;
+        SPIFlash->async.op = SPIFLASH_ASYNC_IDLE;
+    }
     SPIFlashUnLock(SPIFlash);
+
+    if (callback != NULL) {
+        callback(retVal, context);
+    }
+    return retVal;
+}
+
+#if SPIFLASH_POWERDOWN
+SPIFlashStatus_t SPIFlashSetPowerDown(SPIFlash_t* SPIFlash, uint32_t idle) {
+    if ((idle != 0) && (SPIFlash->chip.powerDownCmd == 0)) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashLock(SPIFlash);
+    SPIFlash->power.idle = (idle > SPIFLASH_IDLE_MAX) ? SPIFLASH_IDLE_MAX : idle;
+    SPIFlashLockRelease(&SPIFlash->lock);
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashPowerDown(SPIFlash_t* SPIFlash) {
+    SPIFlashStatus_t retVal;
+#if SPIFLASH_WRITE_COMBINE
+    if (SPIFlash->combine.length > 0) {
+        retVal = SPIFlashFlush(SPIFlash);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+    }
+#endif
+    SPIFlashLock(SPIFlash);
+    if (SPIFlash->async.op != SPIFLASH_ASYNC_IDLE) {
+        SPIFlashLockRelease(&SPIFlash->lock);
+        return SPIFLASH_BUSY;
+    }
+    retVal = SPIFlashEnterPowerDown(SPIFlash);
+    SPIFlashLockRelease(&SPIFlash->lock);
     return retVal;
 }
+
+void SPIFlashGetPowerStats(SPIFlash_t* SPIFlash, SPIFlashPowerStats_t* stats) {
+    SPIFlashLock(SPIFlash);
+    *stats = SPIFlash->power.stats;
+    if (SPIFlash->power.down) {
+        stats->timeDown += SPIFlashGetTick() - SPIFlash->power.downTick;
+    }
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+
+void SPIFlashResetPowerStats(SPIFlash_t* SPIFlash) {
+    SPIFlashLock(SPIFlash);
+    memset(&SPIFlash->power.stats, 0, sizeof(SPIFlash->power.stats));
+    SPIFlash->power.downTick = SPIFlashGetTick();
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+#endif
+
+#if SPIFLASH_STATS
+void SPIFlashGetStats(SPIFlash_t* SPIFlash, SPIFlashStats_t* stats) {
+    SPIFlashLock(SPIFlash);
+    *stats = SPIFlash->stats;
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+
+void SPIFlashResetStats(SPIFlash_t* SPIFlash) {
+    SPIFlashLock(SPIFlash);
+    memset(&SPIFlash->stats, 0, sizeof(SPIFlash->stats));
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+#endif
+
+#if SPIFLASH_TRACE
+void SPIFlashTraceInit(SPIFlashTrace_t* trace) {
+    memset(trace, 0, sizeof(SPIFlashTrace_t));
+    trace->magic = SPIFLASH_TRACE_MAGIC;
+    trace->entrySize = sizeof(SPIFlashTraceEntry_t);
+    trace->entries = SPIFLASH_TRACE;
+}
+
+void SPIFlashSetTrace(SPIFlash_t* SPIFlash, SPIFlashTrace_t* trace, uint8_t id) {
+    SPIFlashLock(SPIFlash);
+    SPIFlash->trace = trace;
+    SPIFlash->traceId = id;
+    SPIFlashLockRelease(&SPIFlash->lock);
+}
+#endif
+
+void SPIFlashLockInit(SPIFlashLock_t* lock) {
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_RTOS)
+    SPIFLASH_MUTEX_INIT(*lock);
+#else
+    *lock = 0;
+#endif
+}
+
+void SPIFlashLockAcquire(SPIFlashLock_t* lock) {
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_ATOMIC)
+    uint8_t expected = 0;
+    uint32_t spin = 0;
+    while (!__atomic_compare_exchange_n(lock, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        /* Wait with plain loads, so that only the release causes bus traffic */
+        do {
+            if (++spin >= SPIFLASH_LOCK_SPIN) {
+                spin = 0;
+                SPIFLASH_LOCK_YIELD();
+            }
+        } while (__atomic_load_n(lock, __ATOMIC_RELAXED));
+        expected = 0;
+    }
+#elif (SPIFLASH_LOCK == SPIFLASH_LOCK_IRQ)
+    uint32_t spin = 0, primask;
+    for (;;) {
+        /* Only the test-and-set runs with interrupts masked: the lock owner still gets SysTick and DMA interrupts */
+        primask = __get_PRIMASK();
+        __disable_irq();
+        if (*(volatile SPIFlashLock_t*)lock == 0) {
+            *(volatile SPIFlashLock_t*)lock = 1;
+            __set_PRIMASK(primask);
+            break;
+        }
+        __set_PRIMASK(primask);
+        if (++spin >= SPIFLASH_LOCK_SPIN) {
+            spin = 0;
+            SPIFLASH_LOCK_YIELD();
+        }
+    }
+#elif (SPIFLASH_LOCK == SPIFLASH_LOCK_RTOS)
+    SPIFLASH_MUTEX_LOCK(*lock);
+#else
+    (void)lock;
+#endif
+}
+
+void SPIFlashLockRelease(SPIFlashLock_t* lock) {
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_ATOMIC)
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+#elif (SPIFLASH_LOCK == SPIFLASH_LOCK_IRQ)
+    /* Keep the critical section's accesses before the release */
+    __DMB();
+    *(volatile SPIFlashLock_t*)lock = 0;
+#elif (SPIFLASH_LOCK == SPIFLASH_LOCK_RTOS)
+    SPIFLASH_MUTEX_UNLOCK(*lock);
+#else
+    (void)lock;
+#endif
+}
+
+uint32_t SPIFlashGetTimeUs(void) { return SPIFlashGetTickUs(); }
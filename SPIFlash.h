@@ -50,19 +50,244 @@ extern "C" {
 
 #define SPIFLASH_PLATFORM_HAL     0
 #define SPIFLASH_PLATFORM_HAL_DMA 1
+#define SPIFLASH_PLATFORM_SIM     2 /* Host-side simulated device, see SPIFlashSim.h */
+
+/* Runtime options, see SPIFlashSetOptions() */
+#define SPIFLASH_OPT_BLANKCHECK    (1 << 0) /* Read back before erasing, skip the erase if already all 0xFF */
+#define SPIFLASH_OPT_SKIPUNCHANGED (1 << 1) /* Read back before programming, skip identical pages */
+#define SPIFLASH_OPT_VERIFY        (1 << 2) /* Read back after programming, fail if the page does not match */
 
 /*---------- SPIFLASH_DEBUG  -----------*/
-#define SPIFLASH_DEBUG            SPIFLASH_DEBUG_FULL
+/* Chip information at init and error messages through printf(). Reads, programs and erases are not printed, as that
+ * would distort their timing: record them with SPIFLASH_TRACE instead */
+#ifndef SPIFLASH_DEBUG
+#define SPIFLASH_DEBUG SPIFLASH_DEBUG_FULL
+#endif
 
 /*---------- SPIFLASH_PLATFORM  -----------*/
-#define SPIFLASH_PLATFORM         SPIFLASH_PLATFORM_HAL
+#ifndef SPIFLASH_PLATFORM
+#define SPIFLASH_PLATFORM SPIFLASH_PLATFORM_HAL
+#endif
+
+/*---------- SPIFLASH_SPI_CLOCK  -----------*/
+/* SPI bus clock in Hz (ignored on SPIFLASH_PLATFORM_SIM, where the simulated clock is used) */
+#ifndef SPIFLASH_SPI_CLOCK
+#define SPIFLASH_SPI_CLOCK 50000000UL
+#endif
+
+/*---------- SPIFLASH_LINES  -----------*/
+/* Data lines wired between MCU and flash (1, 2 or 4). STM32 SPI peripherals only drive 1 */
+#ifndef SPIFLASH_LINES
+#define SPIFLASH_LINES 1
+#endif
+
+/*---------- SPIFLASH_POLL  -----------*/
+#define SPIFLASH_POLL_REISSUE    0 /* One READSTATUS1 transaction per poll */
+#define SPIFLASH_POLL_CONTINUOUS 1 /* Keep CS low and clock STATUS1 out continuously */
+
+#ifndef SPIFLASH_POLL
+#define SPIFLASH_POLL SPIFLASH_POLL_REISSUE
+#endif
+
+/*---------- SPIFLASH_TICK_US  -----------*/
+/* Microsecond tick used for busy polling. Define as a function-like macro returning uint32_t to override the
+ * SysTick-based default on HAL platforms, e.g. #define SPIFLASH_TICK_US() myMicros() */
+
+/*---------- SPIFLASH_READ_MAX_CLOCK  -----------*/
+/* Maximum clock for plain READ DATA (0x03/0x13). Above this, FAST READ (0x0B/0x0C) is used */
+#ifndef SPIFLASH_READ_MAX_CLOCK
+#define SPIFLASH_READ_MAX_CLOCK 50000000UL
+#endif
+
+/*---------- SPIFLASH_CACHE_LINES  -----------*/
+/* Number of read cache lines stored in SPIFlash_t, 0 disables the read cache */
+#ifndef SPIFLASH_CACHE_LINES
+#define SPIFLASH_CACHE_LINES 0
+#endif
+
+/*---------- SPIFLASH_CACHE_LINE_SIZE  -----------*/
+/* Read cache line size in bytes, power of 2 (e.g. 256 for page-sized or 4096 for sector-sized lines) */
+#ifndef SPIFLASH_CACHE_LINE_SIZE
+#define SPIFLASH_CACHE_LINE_SIZE 256
+#endif
+
+/*---------- SPIFLASH_WRITE_COMBINE  -----------*/
+/* 1 to accumulate contiguous SPIFlashWriteAddress() calls in a page buffer, programmed when the page is full, on
+ * SPIFlashFlush(), before any other program/erase, or by SPIFlashPoll() after SPIFLASH_WRITE_COMBINE_TIMEOUT ms */
+#ifndef SPIFLASH_WRITE_COMBINE
+#define SPIFLASH_WRITE_COMBINE 0
+#endif
+
+#ifndef SPIFLASH_WRITE_COMBINE_TIMEOUT
+#define SPIFLASH_WRITE_COMBINE_TIMEOUT 100
+#endif
+
+/*---------- SPIFLASH_SCRATCH_STATIC  -----------*/
+/* 1 to give every SPIFlash_t a driver-owned 4 KiB scratch buffer for SPIFlashUpdateAddress(), shared by all devices.
+ * With 0, a buffer has to be provided with SPIFlashSetScratch() */
+#ifndef SPIFLASH_SCRATCH_STATIC
+#define SPIFLASH_SCRATCH_STATIC 0
+#endif
+
+/*---------- SPIFLASH_STATS  -----------*/
+/* 1 to keep per-operation counters and latency histograms in SPIFlash_t, see SPIFlashGetStats() */
+#ifndef SPIFLASH_STATS
+#define SPIFLASH_STATS 0
+#endif
+
+/*---------- SPIFLASH_STATS_BUCKETS  -----------*/
+/* Latency histogram buckets: bucket i counts latencies from 2^i to 2^(i+1) - 1 us, the last one also longer ones */
+#ifndef SPIFLASH_STATS_BUCKETS
+#define SPIFLASH_STATS_BUCKETS 24
+#endif
+
+/*---------- SPIFLASH_TRACE  -----------*/
+/* Entries (power of 2, up to 32768) of the binary event trace, see SPIFlashSetTrace(). 0 to compile the trace out */
+#ifndef SPIFLASH_TRACE
+#define SPIFLASH_TRACE 0
+#endif
+
+/*---------- SPIFLASH_SUSPEND  -----------*/
+/* 1 to let reads suspend an asynchronous erase/program in progress (SUSPEND 0x75 / RESUME 0x7A) instead of returning
+ * SPIFLASH_BUSY. Reads overlapping the range being erased/programmed still return SPIFLASH_BUSY */
+#ifndef SPIFLASH_SUSPEND
+#define SPIFLASH_SUSPEND 1
+#endif
+
+/*---------- SPIFLASH_POWERDOWN  -----------*/
+/* 1 to let SPIFlashPoll() put an idle chip in deep power-down after the interval set with SPIFlashSetPowerDown(), the
+ * next SPIFlash* call waking it up (RELEASE, then tRES1). 0 to compile the idle manager out */
+#ifndef SPIFLASH_POWERDOWN
+#define SPIFLASH_POWERDOWN 1
+#endif
+
+/*---------- SPIFLASH_LOCK  -----------*/
+#define SPIFLASH_LOCK_NONE   0 /* Single task and no ISR access: no locking at all */
+#define SPIFLASH_LOCK_ATOMIC 1 /* Compare-and-swap spin lock, needs exclusive access instructions (Cortex-M3 and up) */
+#define SPIFLASH_LOCK_RTOS   2 /* User-provided mutex, see SPIFLASH_MUTEX_TYPE */
+#define SPIFLASH_LOCK_IRQ    3 /* Flag tested and set with interrupts masked (PRIMASK), for single-core Cortex-M0/M0+ */
+
+/* Cortex-M0/M0+ (ARMv6-M) have no exclusive access instructions, so the compare-and-swap would not link */
+#ifndef SPIFLASH_LOCK
+#if defined(__ARM_ARCH_6M__)
+#define SPIFLASH_LOCK SPIFLASH_LOCK_IRQ
+#else
+#define SPIFLASH_LOCK SPIFLASH_LOCK_ATOMIC
+#endif
+#endif
+
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_ATOMIC) && defined(__ARM_ARCH_6M__)
+#error "SPIFLASH_LOCK_ATOMIC needs exclusive access instructions, use SPIFLASH_LOCK_IRQ on Cortex-M0/M0+"
+#endif
+
+/*---------- SPIFLASH_LOCK_SPIN  -----------*/
+/* Polls of a taken SPIFLASH_LOCK_ATOMIC or SPIFLASH_LOCK_IRQ lock between calls to SPIFLASH_LOCK_YIELD() */
+#ifndef SPIFLASH_LOCK_SPIN
+#define SPIFLASH_LOCK_SPIN 100
+#endif
+
+/*---------- SPIFLASH_LOCK_YIELD  -----------*/
+/* Lets the lock owner run while waiting on a SPIFLASH_LOCK_ATOMIC or SPIFLASH_LOCK_IRQ lock. Defaults to a 1 ms delay
+ * on HAL platforms and to sched_yield() on SPIFLASH_PLATFORM_SIM, e.g. #define SPIFLASH_LOCK_YIELD() taskYIELD() */
+
+/*---------- SPIFLASH_MUTEX_TYPE  -----------*/
+/* Mutex hooks for SPIFLASH_LOCK_RTOS, SPIFLASH_LOCK_HEADER is included if defined. Use a priority-inheriting mutex,
+ * e.g. on FreeRTOS:
+ * #define SPIFLASH_LOCK_HEADER       "semphr.h"
+ * #define SPIFLASH_MUTEX_TYPE        SemaphoreHandle_t
+ * #define SPIFLASH_MUTEX_INIT(m)     ((m) = xSemaphoreCreateMutex())
+ * #define SPIFLASH_MUTEX_LOCK(m)     xSemaphoreTake((m), portMAX_DELAY)
+ * #define SPIFLASH_MUTEX_UNLOCK(m)   xSemaphoreGive(m) */
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_RTOS)
+#ifdef SPIFLASH_LOCK_HEADER
+#include SPIFLASH_LOCK_HEADER
+#endif
+#if !defined(SPIFLASH_MUTEX_TYPE) || !defined(SPIFLASH_MUTEX_INIT) || !defined(SPIFLASH_MUTEX_LOCK)                   \
+    || !defined(SPIFLASH_MUTEX_UNLOCK)
+#error "SPIFLASH_LOCK_RTOS needs SPIFLASH_MUTEX_TYPE, SPIFLASH_MUTEX_INIT, SPIFLASH_MUTEX_LOCK, SPIFLASH_MUTEX_UNLOCK"
+#endif
+#endif
 
 /* Typedefs ------------------------------------------------------------------*/
 
 /**
  * SPI flash return status
  */
-typedef enum { SPIFLASH_SUCCESS = 0, SPIFLASH_ERROR = 1, SPIFLASH_TIMEOUT = 2 } SPIFlashStatus_t;
+typedef enum { SPIFLASH_SUCCESS = 0, SPIFLASH_ERROR = 1, SPIFLASH_TIMEOUT = 2, SPIFLASH_BUSY = 3 } SPIFlashStatus_t;
+
+/**
+ * SPI flash lock, see SPIFLASH_LOCK
+ */
+#if (SPIFLASH_LOCK == SPIFLASH_LOCK_RTOS)
+typedef SPIFLASH_MUTEX_TYPE SPIFlashLock_t;
+#else
+typedef uint8_t SPIFlashLock_t;
+#endif
+
+/**
+ * SPI flash timed operations
+ */
+typedef enum {
+    SPIFLASH_OP_PAGEPROG = 0,
+    SPIFLASH_OP_SECTORERASE,
+    SPIFLASH_OP_HALFBLOCKERASE,
+    SPIFLASH_OP_BLOCKERASE,
+    SPIFLASH_OP_CHIPERASE,
+    SPIFLASH_OP_WRITESTATUS,
+    SPIFLASH_OP_NUM
+} SPIFlashOp_t;
+
+/**
+ * SPI flash chip timing profile: typical and maximum duration of each operation and suspend timings, in us
+ */
+typedef struct {
+    uint32_t typ[SPIFLASH_OP_NUM];
+    uint32_t max[SPIFLASH_OP_NUM];
+    uint32_t suspend; /* maximum suspend latency (tSUS) */
+    uint32_t resume;  /* minimum time from resume to the next suspend (tRS) */
+    uint32_t release; /* time from release to the next command (tRES1) */
+} SPIFlashTiming_t;
+
+/**
+ * SPI flash read commands, from the slowest to the fastest
+ */
+typedef enum {
+    SPIFLASH_READ_1_1_1 = 0, /* READ DATA, no dummy clocks */
+    SPIFLASH_READ_FAST,      /* FAST READ */
+    SPIFLASH_READ_1_1_2,
+    SPIFLASH_READ_1_2_2,
+    SPIFLASH_READ_1_1_4,
+    SPIFLASH_READ_1_4_4,
+    SPIFLASH_READ_NUM
+} SPIFlashReadMode_t;
+
+/**
+ * SPI flash chip parameters, from the SFDP tables (JESD216) when the chip has them and from the JEDEC ID otherwise.
+ * Opcodes already match the address mode, 0 marks a command the chip does not support
+ */
+typedef struct {
+    uint8_t sfdp;                          /* 1 if parameters come from SFDP */
+    uint8_t addrBytes;                     /* 3 or 4 */
+    uint8_t enter4;                        /* 4-byte mode entry at init: 0 none, 1 0xB7, 2 WRITEENABLE + 0xB7 */
+    uint8_t quadEnable;                    /* quad enable requirement, coded as the SFDP QER field */
+    uint32_t pageSize;                     /* program buffer size in bytes */
+    uint8_t readCmd[SPIFLASH_READ_NUM];    /* opcode of each read command */
+    uint8_t readClocks[SPIFLASH_READ_NUM]; /* mode + dummy clocks of each read command */
+    uint8_t progCmd, quadProgCmd;          /* 1-1-1 and 1-1-4 page program */
+    uint8_t eraseCmd[SPIFLASH_OP_NUM];     /* opcode of each erase */
+    uint8_t suspendCmd, resumeCmd;         /* program/erase suspend and resume */
+    uint8_t powerDownCmd, releaseCmd;      /* deep power-down enter and exit */
+} SPIFlashChip_t;
+
+/**
+ * SPI flash asynchronous operation completion callback
+ */
+typedef void (*SPIFlashCallback_t)(SPIFlashStatus_t status, void* context);
+
+/**
+ * SPI flash streaming read callback, invoked by SPIFlashPoll() with each filled buffer in order
+ */
+typedef void (*SPIFlashStreamCallback_t)(const uint8_t* data, uint32_t length, void* context);
 
 /**
  * SPI flash manufacturer
@@ -105,6 +330,154 @@ typedef enum {
     SPIFLASH_SIZE_512MBIT = 0x20,
 } SPIFlashSize_t;
 
+/**
+ * SPI flash operations skipped by SPIFLASH_OPT_BLANKCHECK and SPIFLASH_OPT_SKIPUNCHANGED
+ */
+typedef struct {
+    uint32_t erases, programs;
+} SPIFlashSkipped_t;
+
+/**
+ * SPI flash scatter-gather segment, see SPIFlashReadv() and SPIFlashWritev()
+ */
+typedef struct {
+    uint32_t address;
+    uint8_t* data; /* destination of a read, source of a write */
+    uint32_t length;
+} SPIFlashSegment_t;
+
+/**
+ * SPI flash asynchronous operation state
+ */
+typedef struct {
+    uint8_t op, timedOp, suspended;
+    const uint8_t* data;
+    uint32_t address, remaining, length, startTime;
+    uint32_t busyAddress, busyLength, suspendTime, resumeTime;
+    SPIFlashCallback_t callback;
+    void* context;
+} SPIFlashAsync_t;
+
+/**
+ * SPI flash streaming read state: buffer[fill] is being received, buffer[deliver] is the next one for the callback.
+ * filled is only written by SPIFlashDMAComplete(), consumed only by SPIFlashPoll()
+ */
+typedef struct {
+    uint8_t* buffer[2];
+    uint32_t address, chunk, size, requested, delivered, startTime, openTime;
+    uint8_t fill, deliver;
+    volatile uint8_t filled, consumed, running, error;
+    SPIFlashStreamCallback_t callback;
+    void* context;
+} SPIFlashStream_t;
+
+#if SPIFLASH_CACHE_LINES > 0
+/**
+ * SPI flash read cache: lines are tagged with their base address and replaced in LRU order (stamp 0 = empty)
+ */
+typedef struct {
+    uint32_t tag[SPIFLASH_CACHE_LINES];
+    uint32_t stamp[SPIFLASH_CACHE_LINES];
+    uint32_t tick, hits, misses;
+    uint8_t line[SPIFLASH_CACHE_LINES][SPIFLASH_CACHE_LINE_SIZE];
+} SPIFlashCache_t;
+#endif
+
+#if SPIFLASH_POWERDOWN
+/**
+ * SPI flash deep power-down statistics. A wake-up is timed from RELEASE to the end of tRES1, which is the latency
+ * added to the call that finds the chip powered down
+ */
+typedef struct {
+    uint32_t entries;  /* power-downs */
+    uint32_t wakes;    /* wake-ups */
+    uint64_t timeDown; /* time spent in deep power-down in ms, including the current power-down */
+    uint64_t wakeTime; /* total wake-up latency in us */
+    uint32_t wakeMax;  /* longest wake-up in us */
+} SPIFlashPowerStats_t;
+
+/**
+ * SPI flash idle manager state
+ */
+typedef struct {
+    uint32_t idle;         /* inactivity before power-down in us, 0 to stay in standby */
+    uint32_t lastActivity; /* SPIFlashGetTimeUs() at the end of the last locked call */
+    uint32_t downTick;     /* SPIFlashGetTick() at power-down */
+    uint8_t down;
+    SPIFlashPowerStats_t stats;
+} SPIFlashPower_t;
+#endif
+
+#if SPIFLASH_STATS
+/**
+ * SPI flash statistics of one kind of operation, with latencies in us
+ */
+typedef struct {
+    uint32_t count, min, max;
+    uint64_t bytes, total;
+    uint32_t histogram[SPIFLASH_STATS_BUCKETS]; /* bucket 0 also counts 0 us */
+} SPIFlashOpStats_t;
+
+/**
+ * SPI flash statistics. Programs and erases are timed from command to completion as seen by the driver (so to the
+ * SPIFlashPoll() call noticing it when asynchronous, net of suspensions), reads from command to last byte
+ */
+typedef struct {
+    SPIFlashOpStats_t op[SPIFLASH_OP_NUM]; /* page programs, erases and status register writes */
+    SPIFlashOpStats_t read;                /* reads, a streaming read counting as one */
+    SPIFlashOpStats_t poll;                /* status register reads */
+} SPIFlashStats_t;
+#endif
+
+#if SPIFLASH_TRACE
+#define SPIFLASH_TRACE_MAGIC 0x52544653 /* "SFTR" */
+#define SPIFLASH_TRACE_ASYNC 0x80       /* event flag: started by an asynchronous call, completed by SPIFlashPoll() */
+
+/**
+ * SPI flash trace events
+ */
+typedef enum {
+    SPIFLASH_TRACE_READ = 0,
+    SPIFLASH_TRACE_PROGRAM,
+    SPIFLASH_TRACE_ERASE,
+    SPIFLASH_TRACE_WRITESTATUS,
+    SPIFLASH_TRACE_SUSPEND /* program/erase suspended by a read: address and length of the suspended operation */
+} SPIFlashTraceEvent_t;
+
+/**
+ * SPI flash trace entry, 20 bytes
+ */
+typedef struct {
+    uint32_t start, end; /* SPIFlashGetTimeUs() at command and at completion, start moved forward by any suspension */
+    uint32_t address, length;
+    uint8_t event;  /* SPIFlashTraceEvent_t, ORed with SPIFLASH_TRACE_ASYNC */
+    uint8_t opcode; /* command sent to the chip */
+    uint8_t status; /* SPIFlashStatus_t */
+    uint8_t id;     /* as given to SPIFlashSetTrace() */
+} SPIFlashTraceEntry_t;
+
+/**
+ * SPI flash trace ring buffer. Meant to be dumped as is (e.g. with the debugger) and decoded on the host by
+ * tools/SPIFlashTrace.c
+ */
+typedef struct {
+    uint32_t magic;
+    uint16_t entrySize, entries;
+    volatile uint32_t head; /* events recorded so far, the last one being entry[(head - 1) % entries] */
+    SPIFlashTraceEntry_t entry[SPIFLASH_TRACE];
+} SPIFlashTrace_t;
+#endif
+
+#if SPIFLASH_WRITE_COMBINE
+/**
+ * SPI flash write-combining buffer: length bytes pending from address, never crossing a page boundary
+ */
+typedef struct {
+    uint32_t address, length, startTime;
+    uint8_t data[256];
+} SPIFlashCombine_t;
+#endif
+
 /**
  * SPI flash struct
  */
@@ -114,24 +487,62 @@ typedef struct {
     uint16_t pin;
     SPIFlashManufacturer_t manufacturer;
     SPIFlashSize_t size;
-    uint8_t memType, lock;
+    uint8_t memType, options;
+    SPIFlashLock_t lock;
+    SPIFlashChip_t chip;
+    uint8_t readCmd, readDummy, readAddrLines, readDataLines;
+    uint8_t progCmd, progDataLines;
     uint32_t pageNum, sectorNum, blockNum;
+    SPIFlashTiming_t timing;
+    uint32_t expected[SPIFLASH_OP_NUM];
+    SPIFlashAsync_t async;
+    SPIFlashStream_t stream;
+    SPIFlashSkipped_t skipped;
+    uint8_t* scratch;
+#if SPIFLASH_POWERDOWN
+    SPIFlashPower_t power;
+#endif
+#if SPIFLASH_STATS
+    SPIFlashStats_t stats;
+#endif
+#if SPIFLASH_TRACE
+    SPIFlashTrace_t* trace;
+    uint8_t traceId;
+#endif
+#if SPIFLASH_CACHE_LINES > 0
+    SPIFlashCache_t cache;
+#endif
+#if SPIFLASH_WRITE_COMBINE
+    SPIFlashCombine_t combine;
+#endif
 } SPIFlash_t;
 
 /* Function prototypes --------------------------------------------------------*/
 
 /**
- * \brief           Init SPI flash memory structure
+ * \brief           Init SPI flash memory structure. Capacity, commands and timings are taken from the SFDP tables
+ *                  when the chip has them, from the JEDEC ID and W25Q-class defaults otherwise
  *
  * \param[in]       SPIFlash: pointer to SPI flash object
- * \param[in]       hSPI: pointer to SPI interface handle
- * \param[in]       GPIO: Chip-Select pin GPIO port
+ * \param[in]       hSPI: pointer to SPI interface handle (pointer to SPIFlashSim_t on SPIFLASH_PLATFORM_SIM)
+ * \param[in]       GPIO: Chip-Select pin GPIO port (pointer to SPIFlashSim_t on SPIFLASH_PLATFORM_SIM)
  * \param[in]       pin: Chip-Select pin number
  *
  * \return          SPIFLASH_SUCCESS if memory data can be read correctly and memory is initialized, SPIFLASH_ERROR otherwise
  */
 SPIFlashStatus_t SPIFlashInit(SPIFlash_t* SPIFlash, void* hSPI, void* GPIO, uint16_t pin);
 
+/**
+ * \brief           Set runtime options. With SPIFLASH_OPT_SKIPUNCHANGED, writes that would need a 0->1 bit transition
+ *                  fail instead of silently corrupting data, while writes needing only 1->0 transitions proceed. With
+ *                  SPIFLASH_OPT_VERIFY, blocking writes also catch worn or unerased cells and corrupted transfers, for
+ *                  one page read per page program (asynchronous writes are not verified)
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       options: bitwise OR of SPIFLASH_OPT_xxx flags, 0 to disable all
+ */
+void SPIFlashSetOptions(SPIFlash_t* SPIFlash, uint8_t options);
+
 /**
  * \brief           Erase entire SPI flash memory
  *
@@ -161,6 +572,18 @@ SPIFlashStatus_t SPIFlashEraseSector(SPIFlash_t* SPIFlash, uint32_t sector);
  */
 SPIFlashStatus_t SPIFlashEraseBlock(SPIFlash_t* SPIFlash, uint32_t block);
 
+/**
+ * \brief           Erase an address range, using the fastest mix of sector, 32 KiB block, block and chip erases
+ *                  according to the chip timing profile
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		address: address of first byte to be erased, must be sector-aligned
+ * \param[in] 		length: number of bytes to be erased, must be a multiple of the sector size
+ *
+ * \return          SPIFLASH_SUCCESS if range is erased successfully, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashEraseRange(SPIFlash_t* SPIFlash, uint32_t address, uint32_t length);
+
 /**
  * \brief           Write at a specific address of SPI flash memory
  *
@@ -171,7 +594,8 @@ SPIFlashStatus_t SPIFlashEraseBlock(SPIFlash_t* SPIFlash, uint32_t block);
  *
  * \return          SPIFLASH_SUCCESS if data is written successfully, SPIFLASH_ERROR otherwise
  */
-SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t size);
+SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data,
+                                      uint32_t size);
 
 /**
  * \brief           Write at a specific page of SPI flash memory
@@ -184,7 +608,7 @@ SPIFlashStatus_t SPIFlashWriteAddress(SPIFlash_t* SPIFlash, uint32_t address, ui
  *
  * \return          SPIFLASH_SUCCESS if data is written successfully, SPIFLASH_ERROR otherwise
  */
-SPIFlashStatus_t SPIFlashWritePage(SPIFlash_t* SPIFlash, uint32_t pageNumber, uint8_t* data, uint32_t size,
+SPIFlashStatus_t SPIFlashWritePage(SPIFlash_t* SPIFlash, uint32_t pageNumber, const uint8_t* data, uint32_t size,
                                    uint32_t offset);
 
 /**
@@ -198,8 +622,8 @@ SPIFlashStatus_t SPIFlashWritePage(SPIFlash_t* SPIFlash, uint32_t pageNumber, ui
  *
  * \return          SPIFLASH_SUCCESS if data is written successfully, SPIFLASH_ERROR otherwise
  */
-SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber, uint8_t* data, uint32_t size,
-                                     uint32_t offset);
+SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber, const uint8_t* data,
+                                     uint32_t size, uint32_t offset);
 
 /**
  * \brief           Write at a specific block of SPI flash memory
@@ -212,8 +636,54 @@ SPIFlashStatus_t SPIFlashWriteSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber
  *
  * \return          SPIFLASH_SUCCESS if data is written successfully, SPIFLASH_ERROR otherwise
  */
-SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, uint8_t* data, uint32_t size,
-                                    uint32_t offset);
+SPIFlashStatus_t SPIFlashWriteBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, const uint8_t* data,
+                                    uint32_t size, uint32_t offset);
+
+/**
+ * \brief           Write several segments of erased SPI flash memory under a single lock. Consecutive segments that
+ *                  land in the same page are packed into one page program, the gaps between them being programmed
+ *                  as 0xFF (which leaves the cells unchanged). Segments must not overlap
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       segments: segments to be written, in order
+ * \param[in]       count: number of segments
+ *
+ * \return          SPIFLASH_SUCCESS if all segments are written, SPIFLASH_BUSY if an asynchronous operation is
+ *                  pending, SPIFLASH_ERROR otherwise (segments before the failing page are written)
+ */
+SPIFlashStatus_t SPIFlashWritev(SPIFlash_t* SPIFlash, const SPIFlashSegment_t* segments, uint32_t count);
+
+/**
+ * \brief           Program the bytes pending in the write-combining buffer (no-op if SPIFLASH_WRITE_COMBINE is 0)
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ *
+ * \return          SPIFLASH_SUCCESS if nothing is pending anymore, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashFlush(SPIFlash_t* SPIFlash);
+
+/**
+ * \brief           Set the sector-sized scratch buffer used by SPIFlashUpdateAddress()
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       scratch: pointer to a buffer of at least 4096 bytes, owned by the driver during updates
+ */
+void SPIFlashSetScratch(SPIFlash_t* SPIFlash, uint8_t* scratch);
+
+/**
+ * \brief           Overwrite bytes at a specific address of SPI flash memory, regardless of its previous content.
+ *                  Sectors are erased only if a bit must go from 0 to 1; in that case only their non-blank pages are
+ *                  programmed back
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		address: address of first byte to be written
+ * \param[in] 		data: pointer to data to be written
+ * \param[in] 		size: number of bytes to be written
+ *
+ * \return          SPIFLASH_SUCCESS if data is written successfully, SPIFLASH_ERROR otherwise (also if no scratch
+ *                  buffer is available)
+ */
+SPIFlashStatus_t SPIFlashUpdateAddress(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data, uint32_t size);
 
 /**
  * \brief           Read from a specific address of SPI flash memory
@@ -269,6 +739,231 @@ SPIFlashStatus_t SPIFlashReadSector(SPIFlash_t* SPIFlash, uint32_t sectorNumber,
 SPIFlashStatus_t SPIFlashReadBlock(SPIFlash_t* SPIFlash, uint32_t blockNumber, uint8_t* data, uint32_t size,
                                    uint32_t offset);
 
+/**
+ * \brief           Read several segments of SPI flash memory under a single lock. Consecutive segments that are
+ *                  contiguous in the flash are read with one command, straight into their buffers
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       segments: segments to be read, in order
+ * \param[in]       count: number of segments
+ *
+ * \return          SPIFLASH_SUCCESS if all segments are read, SPIFLASH_BUSY if an asynchronous operation is pending
+ *                  on the range spanned by the segments (or anywhere without SPIFLASH_SUSPEND), SPIFLASH_ERROR
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashReadv(SPIFlash_t* SPIFlash, const SPIFlashSegment_t* segments, uint32_t count);
+
+/**
+ * \brief           Start erasing the entire SPI flash memory without waiting for completion
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       callback: function called by SPIFlashPoll() on completion, can be NULL
+ * \param[in]       context: user pointer passed to callback
+ *
+ * \return          SPIFLASH_SUCCESS if erase is started, SPIFLASH_BUSY if another asynchronous operation is pending,
+ *                  SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashEraseChipAsync(SPIFlash_t* SPIFlash, SPIFlashCallback_t callback, void* context);
+
+/**
+ * \brief           Start erasing a SPI flash memory sector without waiting for completion
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		sector: number of sector to be erased
+ * \param[in]       callback: function called by SPIFlashPoll() on completion, can be NULL
+ * \param[in]       context: user pointer passed to callback
+ *
+ * \return          SPIFLASH_SUCCESS if erase is started, SPIFLASH_BUSY if another asynchronous operation is pending,
+ *                  SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashEraseSectorAsync(SPIFlash_t* SPIFlash, uint32_t sector, SPIFlashCallback_t callback,
+                                          void* context);
+
+/**
+ * \brief           Start erasing a SPI flash memory block without waiting for completion
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		block: number of block to be erased
+ * \param[in]       callback: function called by SPIFlashPoll() on completion, can be NULL
+ * \param[in]       context: user pointer passed to callback
+ *
+ * \return          SPIFLASH_SUCCESS if erase is started, SPIFLASH_BUSY if another asynchronous operation is pending,
+ *                  SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashEraseBlockAsync(SPIFlash_t* SPIFlash, uint32_t block, SPIFlashCallback_t callback,
+                                         void* context);
+
+/**
+ * \brief           Start writing at a specific address of SPI flash memory. The first page program is issued
+ *                  immediately, the following ones are issued by SPIFlashPoll() as BUSY clears
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		address: address of first byte to be written
+ * \param[in] 		data: pointer to data to be written, must stay valid until completion
+ * \param[in] 		size: number of bytes to be written
+ * \param[in]       callback: function called by SPIFlashPoll() on completion, can be NULL
+ * \param[in]       context: user pointer passed to callback
+ *
+ * \return          SPIFLASH_SUCCESS if write is started, SPIFLASH_BUSY if another asynchronous operation is pending,
+ *                  SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashWriteAddressAsync(SPIFlash_t* SPIFlash, uint32_t address, const uint8_t* data,
+                                           uint32_t size, SPIFlashCallback_t callback, void* context);
+
+/**
+ * \brief           Start reading a region as a single continuous read command, received chunk by chunk into two
+ *                  buffers used alternately (by DMA on SPIFLASH_PLATFORM_HAL_DMA). SPIFlashPoll() passes each filled
+ *                  buffer to the callback while the next one is being received; the transfer pauses, CS still low,
+ *                  if both buffers are waiting for the callback
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in] 		address: address of first byte to be read
+ * \param[in] 		size: number of bytes to be read
+ * \param[out]      buffer0: first buffer, at least chunk bytes
+ * \param[out]      buffer1: second buffer, at least chunk bytes
+ * \param[in] 		chunk: bytes per buffer, at most 65535 (the last one may be shorter)
+ * \param[in]       callback: function called by SPIFlashPoll() with each filled buffer
+ * \param[in]       context: user pointer passed to callback
+ *
+ * \return          SPIFLASH_SUCCESS if the stream is started, SPIFLASH_BUSY if another asynchronous operation is
+ *                  pending, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashReadStream(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size, uint8_t* buffer0,
+                                    uint8_t* buffer1, uint32_t chunk, SPIFlashStreamCallback_t callback,
+                                    void* context);
+
+/**
+ * \brief           Streaming read transfer-complete hook. On SPIFLASH_PLATFORM_HAL_DMA, call it from
+ *                  HAL_SPI_RxCpltCallback() and HAL_SPI_TxRxCpltCallback() for the SPI flash handle. No-op when no
+ *                  stream is running
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ */
+void SPIFlashDMAComplete(SPIFlash_t* SPIFlash);
+
+/**
+ * \brief           Advance the pending asynchronous operation, costing a single status read when the chip is busy, or
+ *                  deliver the next filled buffer of a streaming read. While an asynchronous operation is pending,
+ *                  all other SPIFlash* functions return SPIFLASH_BUSY, except reads outside the target range, which
+ *                  suspend it when SPIFLASH_SUSPEND is enabled
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ *
+ * \return          SPIFLASH_BUSY while the operation is in progress, its final status on the call that completes it
+ *                  (after the callback has been invoked), SPIFLASH_SUCCESS when idle. When idle, it also flushes the
+ *                  write-combining buffer once SPIFLASH_WRITE_COMBINE_TIMEOUT has elapsed
+ */
+SPIFlashStatus_t SPIFlashPoll(SPIFlash_t* SPIFlash);
+
+#if SPIFLASH_POWERDOWN
+/**
+ * \brief           Set the inactivity after which SPIFlashPoll() puts the chip in deep power-down. Time is counted
+ *                  from the end of the last SPIFlash* call, and only while no asynchronous operation is pending and
+ *                  the write-combining buffer is empty. The next call pays the wake-up latency (tRES1, from SFDP
+ *                  when available), so the interval trades standby current against access latency
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       idle: inactivity in us, 0 to keep the chip in standby. Clamped to one hour, as the microsecond
+ *                  tick wraps after about 71 minutes
+ *
+ * \return          SPIFLASH_SUCCESS if set, SPIFLASH_ERROR if the chip has no deep power-down
+ */
+SPIFlashStatus_t SPIFlashSetPowerDown(SPIFlash_t* SPIFlash, uint32_t idle);
+
+/**
+ * \brief           Put the chip in deep power-down now, e.g. before the MCU goes to sleep. The write-combining buffer
+ *                  is flushed first. The next SPIFlash* call wakes the chip up
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ *
+ * \return          SPIFLASH_SUCCESS if the chip is powered down, SPIFLASH_BUSY if an asynchronous operation is
+ *                  pending, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashPowerDown(SPIFlash_t* SPIFlash);
+
+/**
+ * \brief           Get a consistent snapshot of the deep power-down statistics, e.g. to tune the SPIFlashSetPowerDown()
+ *                  interval: an average time down per wake-up close to the interval itself means it is too short
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[out]      stats: pointer to destination
+ */
+void SPIFlashGetPowerStats(SPIFlash_t* SPIFlash, SPIFlashPowerStats_t* stats);
+
+/**
+ * \brief           Reset deep power-down statistics
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ */
+void SPIFlashResetPowerStats(SPIFlash_t* SPIFlash);
+#endif
+
+#if SPIFLASH_STATS
+/**
+ * \brief           Get a consistent snapshot of the statistics, e.g. to spot erases slowing down as the chip wears
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[out]      stats: pointer to destination
+ */
+void SPIFlashGetStats(SPIFlash_t* SPIFlash, SPIFlashStats_t* stats);
+
+/**
+ * \brief           Reset statistics
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ */
+void SPIFlashResetStats(SPIFlash_t* SPIFlash);
+#endif
+
+#if SPIFLASH_TRACE
+/**
+ * \brief           Init (or clear) a trace buffer
+ *
+ * \param[in]       trace: pointer to trace object
+ */
+void SPIFlashTraceInit(SPIFlashTrace_t* trace);
+
+/**
+ * \brief           Start or stop recording reads, programs, erases and suspensions into a trace buffer. Several SPI
+ *                  flash objects can share the same buffer, told apart by id. Concurrent recording from different
+ *                  tasks into a shared buffer needs SPIFLASH_LOCK_ATOMIC
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       trace: pointer to initialized trace object, NULL to stop recording
+ * \param[in]       id: value recorded in each entry
+ */
+void SPIFlashSetTrace(SPIFlash_t* SPIFlash, SPIFlashTrace_t* trace, uint8_t id);
+#endif
+
+/**
+ * \brief           Init a lock of the configured SPIFLASH_LOCK kind. Locks are used by the driver and the companion
+ *                  modules, and can guard application data shared with them
+ *
+ * \param[in]       lock: pointer to lock
+ */
+void SPIFlashLockInit(SPIFlashLock_t* lock);
+
+/**
+ * \brief           Take a lock, waiting for it to be released if needed. Not to be called from ISRs
+ *
+ * \param[in]       lock: pointer to lock
+ */
+void SPIFlashLockAcquire(SPIFlashLock_t* lock);
+
+/**
+ * \brief           Release a lock taken with SPIFlashLockAcquire()
+ *
+ * \param[in]       lock: pointer to lock
+ */
+void SPIFlashLockRelease(SPIFlashLock_t* lock);
+
+/**
+ * \brief           Microsecond time base used by the driver for timeouts, shared with the companion modules
+ *
+ * \return          current time in us, wrapping at 2^32
+ */
+uint32_t SPIFlashGetTimeUs(void);
+
 #ifdef __cplusplus
 }
 #endif
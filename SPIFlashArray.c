@@ -0,0 +1,225 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashArray.c
+ * \author          Andrea Vivani
+ * \brief           Striped array of SPI flash memories seen as one linear address space
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashArray.h"
+#include <stddef.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_PAGE_SIZE                  (1 << 8)
+#define SPIFLASH_SECTOR_SIZE                (1 << 12)
+#define SPIFLASH_BLOCK_SIZE                 (1 << 16)
+
+#define SPIFlashArrayMember(array, address) (((address) / (array)->stripe) % (array)->count)
+
+/* Static  functions ----------------------------------------------------------*/
+
+/* Member address of an array address. Each member sees its stripes back to back, in array order */
+static uint32_t SPIFlashArrayMap(SPIFlashArray_t* array, uint32_t address) {
+    uint32_t stripe = address / array->stripe;
+    return (stripe / array->count) * array->stripe + (address % array->stripe);
+}
+
+/* First array address from address on that belongs to member */
+static uint32_t SPIFlashArrayFirst(SPIFlashArray_t* array, uint8_t member, uint32_t address) {
+    uint32_t stripe = address / array->stripe;
+    uint8_t owner = stripe % array->count;
+    if (owner == member) {
+        return address;
+    }
+    return (stripe + (member + array->count - owner) % array->count) * array->stripe;
+}
+
+/* Complete pending asynchronous operations started elsewhere, so that members are free for the array */
+static SPIFlashStatus_t SPIFlashArrayIdle(SPIFlashArray_t* array) {
+    for (uint8_t ii = 0; ii < array->count; ii++) {
+        if (SPIFlashPoll(array->member[ii]) == SPIFLASH_BUSY) {
+            return SPIFLASH_BUSY;
+        }
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+/* Functions ------------------------------------------------------------------*/
+
+SPIFlashStatus_t SPIFlashArrayInit(SPIFlashArray_t* array, SPIFlash_t** members, uint8_t count, uint32_t stripe) {
+    uint32_t pageNum = 0xFFFFFFFF;
+
+    if ((array == NULL) || (members == NULL) || (count == 0) || (count > SPIFLASH_ARRAY_MEMBERS)
+        || (stripe < SPIFLASH_PAGE_SIZE) || (stripe > SPIFLASH_BLOCK_SIZE) || ((stripe & (stripe - 1)) != 0)) {
+        return SPIFLASH_ERROR;
+    }
+    for (uint8_t ii = 0; ii < count; ii++) {
+        if ((members[ii] == NULL) || (members[ii]->pageNum == 0)) {
+            return SPIFLASH_ERROR;
+        }
+        if (members[ii]->pageNum < pageNum) {
+            pageNum = members[ii]->pageNum;
+        }
+        array->member[ii] = members[ii];
+    }
+    /* Array addresses are 32-bit */
+    if ((uint64_t)pageNum * SPIFLASH_PAGE_SIZE * count > UINT32_MAX) {
+        return SPIFLASH_ERROR;
+    }
+    array->count = count;
+    array->stripe = stripe;
+    array->size = pageNum * SPIFLASH_PAGE_SIZE * count;
+    array->eraseSize = (stripe < SPIFLASH_SECTOR_SIZE) ? SPIFLASH_SECTOR_SIZE * count : SPIFLASH_SECTOR_SIZE;
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashArrayErase(SPIFlashArray_t* array, uint32_t address, uint32_t length) {
+    SPIFlashStatus_t retVal, status;
+    uint32_t next[SPIFLASH_ARRAY_MEMBERS], end[SPIFLASH_ARRAY_MEMBERS];
+    uint8_t pending = 1;
+
+    if ((length == 0) || (address >= array->size) || (length > array->size - address)
+        || ((address % array->eraseSize) != 0) || ((length % array->eraseSize) != 0)) {
+        return SPIFLASH_ERROR;
+    }
+    retVal = SPIFlashArrayIdle(array);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    /* The stripes of a member inside the range are contiguous in its own address space */
+    for (uint8_t ii = 0; ii < array->count; ii++) {
+        next[ii] = SPIFlashArrayMap(array, SPIFlashArrayFirst(array, ii, address));
+        end[ii] = SPIFlashArrayMap(array, SPIFlashArrayFirst(array, ii, address + length));
+    }
+
+    while (pending) {
+        pending = 0;
+        for (uint8_t ii = 0; ii < array->count; ii++) {
+            status = SPIFlashPoll(array->member[ii]);
+            if (status == SPIFLASH_BUSY) {
+                pending = 1;
+                continue;
+            }
+            if (status != SPIFLASH_SUCCESS) {
+                retVal = status;
+            }
+            if ((retVal != SPIFLASH_SUCCESS) || (next[ii] >= end[ii])) {
+                continue;
+            }
+            if (((next[ii] % SPIFLASH_BLOCK_SIZE) == 0) && (end[ii] - next[ii] >= SPIFLASH_BLOCK_SIZE)) {
+                status = SPIFlashEraseBlockAsync(array->member[ii], next[ii] / SPIFLASH_BLOCK_SIZE, NULL, NULL);
+                next[ii] += SPIFLASH_BLOCK_SIZE;
+            } else {
+                status = SPIFlashEraseSectorAsync(array->member[ii], next[ii] / SPIFLASH_SECTOR_SIZE, NULL, NULL);
+                next[ii] += SPIFLASH_SECTOR_SIZE;
+            }
+            if (status != SPIFLASH_SUCCESS) {
+                retVal = status;
+                continue;
+            }
+            pending = 1;
+        }
+    }
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashArrayWrite(SPIFlashArray_t* array, uint32_t address, const uint8_t* data, uint32_t size) {
+    SPIFlashStatus_t retVal, status;
+    uint32_t next[SPIFLASH_ARRAY_MEMBERS], end = address + size, length;
+    uint8_t pending = 1;
+
+    if ((size == 0) || (address >= array->size) || (size > array->size - address)) {
+        return SPIFLASH_ERROR;
+    }
+    retVal = SPIFlashArrayIdle(array);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    for (uint8_t ii = 0; ii < array->count; ii++) {
+        next[ii] = SPIFlashArrayFirst(array, ii, address);
+    }
+
+    /* Keep every member programming: as soon as one is idle, give it its next page */
+    while (pending) {
+        pending = 0;
+        for (uint8_t ii = 0; ii < array->count; ii++) {
+            status = SPIFlashPoll(array->member[ii]);
+            if (status == SPIFLASH_BUSY) {
+                pending = 1;
+                continue;
+            }
+            if (status != SPIFLASH_SUCCESS) {
+                retVal = status;
+            }
+            if ((retVal != SPIFLASH_SUCCESS) || (next[ii] >= end)) {
+                continue;
+            }
+            length = SPIFLASH_PAGE_SIZE - (next[ii] % SPIFLASH_PAGE_SIZE);
+            if (length > end - next[ii]) {
+                length = end - next[ii];
+            }
+            status = SPIFlashWriteAddressAsync(array->member[ii], SPIFlashArrayMap(array, next[ii]),
+                                               &data[next[ii] - address], length, NULL, NULL);
+            if (status != SPIFLASH_SUCCESS) {
+                retVal = status;
+                continue;
+            }
+            next[ii] += length;
+            if ((next[ii] % array->stripe) == 0) {
+                next[ii] += (array->count - 1) * array->stripe;
+            }
+            pending = 1;
+        }
+    }
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashArrayRead(SPIFlashArray_t* array, uint32_t address, uint8_t* data, uint32_t size) {
+    SPIFlashStatus_t retVal = SPIFLASH_SUCCESS;
+    uint32_t length;
+
+    if ((size == 0) || (address >= array->size) || (size > array->size - address)) {
+        return SPIFLASH_ERROR;
+    }
+    while ((size > 0) && (retVal == SPIFLASH_SUCCESS)) {
+        length = array->stripe - (address % array->stripe);
+        if (length > size) {
+            length = size;
+        }
+        retVal = SPIFlashReadAddress(array->member[SPIFlashArrayMember(array, address)],
+                                     SPIFlashArrayMap(array, address), data, length);
+        address += length;
+        data += length;
+        size -= length;
+    }
+    return retVal;
+}
@@ -0,0 +1,124 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashArray.h
+ * \author          Andrea Vivani
+ * \brief           Striped array of SPI flash memories seen as one linear address space
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHARRAY_H__
+#define __SPIFLASHARRAY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+/*---------- SPIFLASH_ARRAY_MEMBERS  -----------*/
+/* Maximum number of chips in an array */
+#ifndef SPIFLASH_ARRAY_MEMBERS
+#define SPIFLASH_ARRAY_MEMBERS 4
+#endif
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * SPI flash array struct. Consecutive stripes of the array address space go to consecutive members, round-robin
+ */
+typedef struct {
+    SPIFlash_t* member[SPIFLASH_ARRAY_MEMBERS];
+    uint8_t count;
+    uint32_t stripe;    /* bytes per stripe, power of 2 from 256 to 65536 */
+    uint32_t size;      /* array capacity in bytes */
+    uint32_t eraseSize; /* erase granularity: one sector per member if stripe < 4096, one sector otherwise */
+} SPIFlashArray_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Init array on initialized SPI flash objects, on the same bus or on different ones. Capacity is set
+ *                  by the smallest member
+ *
+ * \param[in]       array: pointer to SPI flash array object
+ * \param[in]       members: pointers to SPI flash objects
+ * \param[in]       count: number of members, from 1 to SPIFLASH_ARRAY_MEMBERS
+ * \param[in]       stripe: stripe size in bytes, power of 2 from 256 to 65536
+ *
+ * \return          SPIFLASH_SUCCESS if array is initialized, SPIFLASH_ERROR otherwise (also if the capacity does not fit
+ *                  in 32-bit addresses)
+ */
+SPIFlashStatus_t SPIFlashArrayInit(SPIFlashArray_t* array, SPIFlash_t** members, uint8_t count, uint32_t stripe);
+
+/**
+ * \brief           Erase an array range, with all members erasing at the same time
+ *
+ * \param[in]       array: pointer to SPI flash array object
+ * \param[in]       address: first byte to be erased, multiple of eraseSize
+ * \param[in]       length: number of bytes to be erased, multiple of eraseSize
+ *
+ * \return          SPIFLASH_SUCCESS if range is erased, SPIFLASH_BUSY if a member has an asynchronous operation
+ *                  pending, SPIFLASH_TIMEOUT or SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashArrayErase(SPIFlashArray_t* array, uint32_t address, uint32_t length);
+
+/**
+ * \brief           Write erased array memory, with all members programming pages at the same time
+ *
+ * \param[in]       array: pointer to SPI flash array object
+ * \param[in]       address: address of first byte to be written
+ * \param[in]       data: pointer to data to be written
+ * \param[in]       size: number of bytes to be written
+ *
+ * \return          SPIFLASH_SUCCESS if data is written, SPIFLASH_BUSY if a member has an asynchronous operation
+ *                  pending, SPIFLASH_TIMEOUT or SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashArrayWrite(SPIFlashArray_t* array, uint32_t address, const uint8_t* data, uint32_t size);
+
+/**
+ * \brief           Read array memory
+ *
+ * \param[in]       array: pointer to SPI flash array object
+ * \param[in]       address: address of first byte to be read
+ * \param[out]      data: pointer to destination buffer
+ * \param[in]       size: number of bytes to be read
+ *
+ * \return          SPIFLASH_SUCCESS if data is read, SPIFLASH_BUSY if a member is busy, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashArrayRead(SPIFlashArray_t* array, uint32_t address, uint8_t* data, uint32_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHARRAY_H__ */
@@ -0,0 +1,122 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashCRC.h
+ * \author          Andrea Vivani
+ * \brief           CRC-32 and CRC-protected records on SPI flash
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHCRC_H__
+#define __SPIFLASHCRC_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_CRC_RECORD_HEADER 8 /* size and CRC-32 */
+
+/*---------- SPIFLASH_CRC_SLICES  -----------*/
+/* CRC-32 lookup tables, stored in flash: 8 for slicing-by-8 (8 KiB, fastest), 1 for one byte at a time (1 KiB), 0 for
+ * one bit at a time (no table) */
+#ifndef SPIFLASH_CRC_SLICES
+#define SPIFLASH_CRC_SLICES 8
+#endif
+
+/*---------- SPIFLASH_CRC32_HW  -----------*/
+/* CRC-32 computed by a hardware unit. Define as a function-like macro with the contract of SPIFlashCRC32(), e.g.
+ * #define SPIFLASH_CRC32_HW(crc, data, size) myCRC32(crc, data, size)
+ * On STM32 CRC units with a programmable polynomial, set the default polynomial, byte input reversal, output reversal
+ * and INIT = ~crc, feed the data, and return ~DR */
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Update a CRC-32 (IEEE 802.3, as in zlib and Ethernet) with more data
+ *
+ * \param[in]       crc: CRC of the previous data, 0 to start
+ * \param[in]       data: pointer to data
+ * \param[in]       size: number of bytes
+ *
+ * \return          CRC of previous data and data
+ */
+uint32_t SPIFlashCRC32(uint32_t crc, const void* data, uint32_t size);
+
+/**
+ * \brief           CRC-32 of flash memory, read in page-sized chunks
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       address: address of first byte
+ * \param[in]       size: number of bytes
+ * \param[in, out]  crc: CRC of the previous data (0 to start), updated with the flash contents
+ *
+ * \return          SPIFLASH_SUCCESS if memory is read, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashCRCRegion(SPIFlash_t* SPIFlash, uint32_t address, uint32_t size, uint32_t* crc);
+
+/**
+ * \brief           Write a record to erased memory: size and CRC-32 of size and data, then data. Header and the start
+ *                  of data share one page program. Set SPIFLASH_OPT_VERIFY to read each page back after programming
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       address: address of the record
+ * \param[in]       data: pointer to data
+ * \param[in]       size: number of bytes, SPIFLASH_CRC_RECORD_HEADER + size are written
+ *
+ * \return          SPIFLASH_SUCCESS if record is written, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashCRCWrite(SPIFlash_t* SPIFlash, uint32_t address, const void* data, uint32_t size);
+
+/**
+ * \brief           Read and verify a record
+ *
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ * \param[in]       address: address of the record
+ * \param[out]      data: pointer to destination buffer
+ * \param[in]       maxSize: size of destination buffer
+ * \param[out]      size: record data size
+ *
+ * \return          SPIFLASH_SUCCESS if record is read and its CRC matches, SPIFLASH_ERROR if the CRC does not match,
+ *                  the memory is erased or the record is larger than maxSize (size is set), status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashCRCRead(SPIFlash_t* SPIFlash, uint32_t address, uint8_t* data, uint32_t maxSize,
+                                 uint32_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHCRC_H__ */
@@ -0,0 +1,388 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashFTL.c
+ * \author          Andrea Vivani
+ * \brief           Wear-leveling flash translation layer mapping logical sectors to physical ones
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashFTL.h"
+#include <stddef.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_PAGE_SIZE             (1 << 8)
+#define SPIFLASH_SECTOR_SIZE           (1 << 12)
+
+#define SPIFLASH_FTL_MAGIC             0x4C544653 /* "SFTL" */
+#define SPIFLASH_FTL_UNMAPPED          0xFFFF
+
+/* On-flash sector states, each one clearing more bits than the previous one */
+#define SPIFLASH_FTL_STATE_FREE        0xFF /* erased, erase count written */
+#define SPIFLASH_FTL_STATE_WRITING     0xFE /* data being programmed */
+#define SPIFLASH_FTL_STATE_VALID       0xFC /* logical sector, version and check committed */
+#define SPIFLASH_FTL_STATE_OBSOLETE    0xF8 /* superseded or trimmed */
+
+/* In-RAM sector states */
+#define SPIFLASH_FTL_FREE              0
+#define SPIFLASH_FTL_USED              1
+#define SPIFLASH_FTL_GARBAGE           2 /* must be erased before use */
+
+#define SPIFlashFTLState(ftl, index)  ((ftl)->sector[index] & 3)
+#define SPIFlashFTLErases(ftl, index) ((ftl)->sector[index] >> 2)
+#define SPIFlashFTLSet(ftl, index, erases, state)                                                                     \
+    ((ftl)->sector[index] = ((uint32_t)(erases) << 2) | (state))
+#define SPIFlashFTLAddress(ftl, index, offset) (((ftl)->first + (index)) * SPIFLASH_SECTOR_SIZE + (offset))
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/* Sector header. Erase count is written right after the erase, version, logical, state and check when the data is
+ * in place */
+typedef struct {
+    uint32_t magic, erases, version;
+    uint16_t logical;
+    uint8_t state, check;
+} SPIFlashFTLHeader_t;
+
+/* Static  functions ----------------------------------------------------------*/
+
+static uint8_t SPIFlashFTLCheck(const SPIFlashFTLHeader_t* header) {
+    return (uint8_t)(0x5A ^ header->version ^ (header->version >> 8) ^ (header->version >> 16) ^ (header->version >> 24)
+                     ^ header->logical ^ (header->logical >> 8));
+}
+
+static SPIFlashStatus_t SPIFlashFTLReadHeader(SPIFlashFTL_t* ftl, uint32_t sector, SPIFlashFTLHeader_t* header) {
+    return SPIFlashReadAddress(ftl->SPIFlash, SPIFlashFTLAddress(ftl, sector, 0), (uint8_t*)header,
+                               sizeof(SPIFlashFTLHeader_t));
+}
+
+static SPIFlashStatus_t SPIFlashFTLProgram(SPIFlashFTL_t* ftl, uint32_t sector, uint32_t offset, const void* data,
+                                           uint32_t size) {
+    ftl->stats.programmed += size;
+    return SPIFlashWriteAddress(ftl->SPIFlash, SPIFlashFTLAddress(ftl, sector, offset), data, size);
+}
+
+static SPIFlashStatus_t SPIFlashFTLSetState(SPIFlashFTL_t* ftl, uint32_t sector, uint8_t state) {
+    return SPIFlashFTLProgram(ftl, sector, offsetof(SPIFlashFTLHeader_t, state), &state, 1);
+}
+
+/* Stamp the erase count of a freshly erased sector */
+static SPIFlashStatus_t SPIFlashFTLErased(SPIFlashFTL_t* ftl, uint32_t sector) {
+    uint32_t header[2] = {SPIFLASH_FTL_MAGIC, SPIFlashFTLErases(ftl, sector) + 1};
+    SPIFlashStatus_t retVal;
+
+    ftl->stats.erases++;
+    retVal = SPIFlashFTLProgram(ftl, sector, 0, header, sizeof(header));
+    SPIFlashFTLSet(ftl, sector, header[1], (retVal == SPIFLASH_SUCCESS) ? SPIFLASH_FTL_FREE : SPIFLASH_FTL_GARBAGE);
+    return retVal;
+}
+
+static SPIFlashStatus_t SPIFlashFTLRecycle(SPIFlashFTL_t* ftl, uint32_t sector) {
+    SPIFlashStatus_t retVal = SPIFlashEraseSector(ftl->SPIFlash, ftl->first + sector);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    return SPIFlashFTLErased(ftl, sector);
+}
+
+/* Wait for the background erase, if any */
+static SPIFlashStatus_t SPIFlashFTLFinish(SPIFlashFTL_t* ftl) {
+    SPIFlashStatus_t retVal;
+    uint32_t sector = ftl->erasing;
+
+    if (sector >= ftl->count) {
+        return SPIFLASH_SUCCESS;
+    }
+    while ((retVal = SPIFlashPoll(ftl->SPIFlash)) == SPIFLASH_BUSY) {}
+    ftl->erasing = ftl->count;
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    return SPIFlashFTLErased(ftl, sector);
+}
+
+/* Sector in a state with the lowest (or highest) erase count, count if none */
+static uint32_t SPIFlashFTLFind(SPIFlashFTL_t* ftl, uint8_t state, uint8_t highest) {
+    uint32_t found = ftl->count;
+    for (uint32_t ii = 0; ii < ftl->count; ii++) {
+        if ((SPIFlashFTLState(ftl, ii) == state)
+            && ((found == ftl->count)
+                || (highest ? (SPIFlashFTLErases(ftl, ii) > SPIFlashFTLErases(ftl, found))
+                            : (SPIFlashFTLErases(ftl, ii) < SPIFlashFTLErases(ftl, found))))) {
+            found = ii;
+        }
+    }
+    return found;
+}
+
+/* Free sector for a write: the least worn one (dynamic wear leveling), erasing a released one if none is left */
+static SPIFlashStatus_t SPIFlashFTLAllocate(SPIFlashFTL_t* ftl, uint32_t* sector) {
+    SPIFlashStatus_t retVal = SPIFlashFTLFinish(ftl);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    *sector = SPIFlashFTLFind(ftl, SPIFLASH_FTL_FREE, 0);
+    if (*sector < ftl->count) {
+        return SPIFLASH_SUCCESS;
+    }
+    *sector = SPIFlashFTLFind(ftl, SPIFLASH_FTL_GARBAGE, 0);
+    if (*sector >= ftl->count) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashFTLRecycle(ftl, *sector);
+}
+
+/* Point logical at a sector whose data is in place, releasing the previous copy */
+static SPIFlashStatus_t SPIFlashFTLCommit(SPIFlashFTL_t* ftl, uint32_t sector, uint32_t logical) {
+    SPIFlashFTLHeader_t header;
+    SPIFlashStatus_t retVal;
+    uint32_t previous = ftl->map[logical];
+
+    header.version = ftl->version++;
+    header.logical = logical;
+    header.state = SPIFLASH_FTL_STATE_VALID;
+    header.check = SPIFlashFTLCheck(&header);
+    retVal = SPIFlashFTLProgram(ftl, sector, offsetof(SPIFlashFTLHeader_t, version), &header.version,
+                                sizeof(header) - offsetof(SPIFlashFTLHeader_t, version));
+    if (retVal != SPIFLASH_SUCCESS) {
+        SPIFlashFTLSet(ftl, sector, SPIFlashFTLErases(ftl, sector), SPIFLASH_FTL_GARBAGE);
+        return retVal;
+    }
+    SPIFlashFTLSet(ftl, sector, SPIFlashFTLErases(ftl, sector), SPIFLASH_FTL_USED);
+    ftl->map[logical] = sector;
+    if (previous != SPIFLASH_FTL_UNMAPPED) {
+        /* If this is cut short, the higher version wins at mount */
+        SPIFlashFTLSet(ftl, previous, SPIFlashFTLErases(ftl, previous), SPIFLASH_FTL_GARBAGE);
+        retVal = SPIFlashFTLSetState(ftl, previous, SPIFLASH_FTL_STATE_OBSOLETE);
+    }
+    return retVal;
+}
+
+/* Static wear leveling: move the coldest data into the most worn free sector, so that its young sector joins the
+ * pool used by frequent writes */
+static SPIFlashStatus_t SPIFlashFTLLevel(SPIFlashFTL_t* ftl, uint8_t* moved) {
+    SPIFlashFTLHeader_t header;
+    SPIFlashStatus_t retVal;
+    uint8_t buffer[SPIFLASH_PAGE_SIZE];
+    uint32_t cold, worn, offset, length;
+
+    *moved = 0;
+    ftl->wearChecked = ftl->stats.erases;
+    cold = SPIFlashFTLFind(ftl, SPIFLASH_FTL_USED, 0);
+    worn = SPIFlashFTLFind(ftl, SPIFLASH_FTL_FREE, 1);
+    if ((cold >= ftl->count) || (worn >= ftl->count)
+        || (SPIFlashFTLErases(ftl, worn) <= SPIFlashFTLErases(ftl, cold) + SPIFLASH_FTL_WEAR_DELTA)) {
+        return SPIFLASH_SUCCESS;
+    }
+    retVal = SPIFlashFTLReadHeader(ftl, cold, &header);
+    if ((retVal != SPIFLASH_SUCCESS) || (header.logical >= ftl->logical) || (ftl->map[header.logical] != cold)) {
+        return (retVal != SPIFLASH_SUCCESS) ? retVal : SPIFLASH_ERROR;
+    }
+    SPIFlashFTLSet(ftl, worn, SPIFlashFTLErases(ftl, worn), SPIFLASH_FTL_GARBAGE);
+    retVal = SPIFlashFTLSetState(ftl, worn, SPIFLASH_FTL_STATE_WRITING);
+    for (offset = 0; (offset < SPIFLASH_FTL_SECTOR_SIZE) && (retVal == SPIFLASH_SUCCESS); offset += length) {
+        length = SPIFLASH_PAGE_SIZE - ((SPIFLASH_FTL_HEADER + offset) % SPIFLASH_PAGE_SIZE);
+        retVal = SPIFlashReadAddress(ftl->SPIFlash, SPIFlashFTLAddress(ftl, cold, SPIFLASH_FTL_HEADER + offset),
+                                     buffer, length);
+        if (retVal == SPIFLASH_SUCCESS) {
+            retVal = SPIFlashFTLProgram(ftl, worn, SPIFLASH_FTL_HEADER + offset, buffer, length);
+        }
+    }
+    if (retVal == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashFTLCommit(ftl, worn, header.logical);
+        ftl->stats.moves++;
+        *moved = 1;
+    }
+    return retVal;
+}
+
+/* Functions ------------------------------------------------------------------*/
+
+SPIFlashStatus_t SPIFlashFTLMount(SPIFlashFTL_t* ftl, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count,
+                                  uint32_t logical) {
+    SPIFlashFTLHeader_t header, other;
+    SPIFlashStatus_t retVal;
+    uint8_t newest = 0;
+
+    if ((ftl == NULL) || (SPIFlash == NULL) || (count > SPIFLASH_FTL_SECTORS) || (logical + 2 > count)
+        || (first >= SPIFlash->sectorNum) || (count > SPIFlash->sectorNum - first)) {
+        return SPIFLASH_ERROR;
+    }
+    ftl->SPIFlash = SPIFlash;
+    ftl->first = first;
+    ftl->count = count;
+    ftl->logical = logical;
+    ftl->version = 0;
+    ftl->erasing = count;
+    ftl->wearChecked = 0;
+    ftl->stats = (SPIFlashFTLStats_t){0};
+    for (uint32_t ii = 0; ii < logical; ii++) {
+        ftl->map[ii] = SPIFLASH_FTL_UNMAPPED;
+    }
+
+    for (uint32_t ii = 0; ii < count; ii++) {
+        retVal = SPIFlashFTLReadHeader(ftl, ii, &header);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        if (header.magic != SPIFLASH_FTL_MAGIC) {
+            SPIFlashFTLSet(ftl, ii, 0, SPIFLASH_FTL_GARBAGE);
+            continue;
+        }
+        SPIFlashFTLSet(ftl, ii, header.erases, SPIFLASH_FTL_GARBAGE);
+        if (header.state == SPIFLASH_FTL_STATE_FREE) {
+            SPIFlashFTLSet(ftl, ii, header.erases, SPIFLASH_FTL_FREE);
+        } else if ((header.state == SPIFLASH_FTL_STATE_VALID) && (header.check == SPIFlashFTLCheck(&header))
+                   && (header.logical < logical)) {
+            if (ftl->map[header.logical] != SPIFLASH_FTL_UNMAPPED) {
+                /* Power lost before the previous copy was marked obsolete: keep the higher version */
+                retVal = SPIFlashFTLReadHeader(ftl, ftl->map[header.logical], &other);
+                if (retVal != SPIFLASH_SUCCESS) {
+                    return retVal;
+                }
+                if ((int32_t)(header.version - other.version) < 0) {
+                    continue;
+                }
+                SPIFlashFTLSet(ftl, ftl->map[header.logical], SPIFlashFTLErases(ftl, ftl->map[header.logical]),
+                               SPIFLASH_FTL_GARBAGE);
+            }
+            ftl->map[header.logical] = ii;
+            SPIFlashFTLSet(ftl, ii, header.erases, SPIFLASH_FTL_USED);
+            if (!newest || ((int32_t)(header.version - ftl->version) >= 0)) {
+                ftl->version = header.version + 1;
+                newest = 1;
+            }
+        }
+    }
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashFTLFormat(SPIFlashFTL_t* ftl) {
+    SPIFlashStatus_t retVal = SPIFlashFTLFinish(ftl);
+
+    for (uint32_t ii = 0; (ii < ftl->logical) && (retVal == SPIFLASH_SUCCESS); ii++) {
+        ftl->map[ii] = SPIFLASH_FTL_UNMAPPED;
+    }
+    for (uint32_t ii = 0; (ii < ftl->count) && (retVal == SPIFLASH_SUCCESS); ii++) {
+        retVal = SPIFlashFTLRecycle(ftl, ii);
+    }
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashFTLRead(SPIFlashFTL_t* ftl, uint32_t logical, uint32_t offset, uint8_t* data, uint32_t size) {
+    if ((logical >= ftl->logical) || (offset > SPIFLASH_FTL_SECTOR_SIZE)
+        || (size > SPIFLASH_FTL_SECTOR_SIZE - offset)) {
+        return SPIFLASH_ERROR;
+    }
+    if (ftl->map[logical] == SPIFLASH_FTL_UNMAPPED) {
+        for (uint32_t ii = 0; ii < size; ii++) {
+            data[ii] = 0xFF;
+        }
+        return SPIFLASH_SUCCESS;
+    }
+    return SPIFlashReadAddress(ftl->SPIFlash, SPIFlashFTLAddress(ftl, ftl->map[logical], SPIFLASH_FTL_HEADER + offset),
+                               data, size);
+}
+
+SPIFlashStatus_t SPIFlashFTLWrite(SPIFlashFTL_t* ftl, uint32_t logical, const uint8_t* data) {
+    SPIFlashStatus_t retVal;
+    uint32_t sector;
+
+    if ((logical >= ftl->logical) || (data == NULL)) {
+        return SPIFLASH_ERROR;
+    }
+    retVal = SPIFlashFTLAllocate(ftl, &sector);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    /* Until committed, an interrupted write leaves a sector that mount sends to garbage */
+    SPIFlashFTLSet(ftl, sector, SPIFlashFTLErases(ftl, sector), SPIFLASH_FTL_GARBAGE);
+    retVal = SPIFlashFTLSetState(ftl, sector, SPIFLASH_FTL_STATE_WRITING);
+    if (retVal == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashFTLProgram(ftl, sector, SPIFLASH_FTL_HEADER, data, SPIFLASH_FTL_SECTOR_SIZE);
+    }
+    if (retVal == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashFTLCommit(ftl, sector, logical);
+        ftl->stats.writes++;
+    }
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashFTLTrim(SPIFlashFTL_t* ftl, uint32_t logical) {
+    uint32_t sector;
+
+    if (logical >= ftl->logical) {
+        return SPIFLASH_ERROR;
+    }
+    sector = ftl->map[logical];
+    if (sector == SPIFLASH_FTL_UNMAPPED) {
+        return SPIFLASH_SUCCESS;
+    }
+    ftl->map[logical] = SPIFLASH_FTL_UNMAPPED;
+    SPIFlashFTLSet(ftl, sector, SPIFlashFTLErases(ftl, sector), SPIFLASH_FTL_GARBAGE);
+    return SPIFlashFTLSetState(ftl, sector, SPIFLASH_FTL_STATE_OBSOLETE);
+}
+
+SPIFlashStatus_t SPIFlashFTLPoll(SPIFlashFTL_t* ftl) {
+    SPIFlashStatus_t retVal;
+    uint32_t sector = ftl->erasing;
+    uint8_t moved;
+
+    if (sector < ftl->count) {
+        retVal = SPIFlashPoll(ftl->SPIFlash);
+        if (retVal == SPIFLASH_BUSY) {
+            return SPIFLASH_BUSY;
+        }
+        ftl->erasing = ftl->count;
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        retVal = SPIFlashFTLErased(ftl, sector);
+        return (retVal == SPIFLASH_SUCCESS) ? SPIFLASH_BUSY : retVal;
+    }
+    sector = SPIFlashFTLFind(ftl, SPIFLASH_FTL_GARBAGE, 0);
+    if (sector < ftl->count) {
+        retVal = SPIFlashEraseSectorAsync(ftl->SPIFlash, ftl->first + sector, NULL, NULL);
+        if (retVal == SPIFLASH_SUCCESS) {
+            ftl->erasing = sector;
+            return SPIFLASH_BUSY;
+        }
+        return retVal;
+    }
+    /* Wear only changes with erases: no need to look again before the next one */
+    if (ftl->wearChecked != ftl->stats.erases) {
+        retVal = SPIFlashFTLLevel(ftl, &moved);
+        if ((retVal != SPIFLASH_SUCCESS) || moved) {
+            return (retVal != SPIFLASH_SUCCESS) ? retVal : SPIFLASH_BUSY;
+        }
+    }
+    return SPIFLASH_SUCCESS;
+}
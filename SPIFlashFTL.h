@@ -0,0 +1,172 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashFTL.h
+ * \author          Andrea Vivani
+ * \brief           Wear-leveling flash translation layer mapping logical sectors to physical ones
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHFTL_H__
+#define __SPIFLASHFTL_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_FTL_HEADER      16 /* per-sector header: erase count, version, logical sector and state */
+#define SPIFLASH_FTL_SECTOR_SIZE ((1 << 12) - SPIFLASH_FTL_HEADER) /* logical sector size in bytes */
+
+/*---------- SPIFLASH_FTL_SECTORS  -----------*/
+/* Maximum number of physical sectors handled by a translation layer. RAM use is 6 bytes per sector */
+#ifndef SPIFLASH_FTL_SECTORS
+#define SPIFLASH_FTL_SECTORS 256
+#endif
+
+/*---------- SPIFLASH_FTL_WEAR_DELTA  -----------*/
+/* Static wear leveling moves cold data out of a sector once the most worn free sector has been erased this many times
+ * more than it. Lower values level wear more tightly, at the cost of more data moves */
+#ifndef SPIFLASH_FTL_WEAR_DELTA
+#define SPIFLASH_FTL_WEAR_DELTA 32
+#endif
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * Translation layer statistics. Write amplification is programmed / (writes * SPIFLASH_FTL_SECTOR_SIZE)
+ */
+typedef struct {
+    uint32_t writes;     /* logical sector writes */
+    uint32_t moves;      /* sectors moved by static wear leveling */
+    uint32_t erases;     /* physical sector erases */
+    uint64_t programmed; /* bytes programmed, headers included */
+} SPIFlashFTLStats_t;
+
+/**
+ * Translation layer struct
+ */
+typedef struct {
+    SPIFlash_t* SPIFlash;
+    uint32_t first, count, logical; /* first physical sector, physical and logical sectors */
+    uint32_t version;               /* stamped on the next sector written, the newest copy wins at mount */
+    uint32_t erasing;               /* sector erased in the background, count if none */
+    uint32_t wearChecked;           /* stats.erases at the last static wear leveling check */
+    SPIFlashFTLStats_t stats;
+    uint16_t map[SPIFLASH_FTL_SECTORS];    /* physical sector of each logical one, 0xFFFF if unmapped */
+    uint32_t sector[SPIFLASH_FTL_SECTORS]; /* erase count << 2 | state of each physical sector */
+} SPIFlashFTL_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Mount a translation layer, rebuilding the mapping from the header of each physical sector. Sectors
+ *                  without a valid header (e.g. a blank or foreign area) are erased when needed
+ *
+ * \param[in]       ftl: pointer to translation layer object
+ * \param[in]       SPIFlash: pointer to initialized SPI flash object
+ * \param[in]       first: first physical sector
+ * \param[in]       count: number of physical sectors, up to SPIFLASH_FTL_SECTORS
+ * \param[in]       logical: number of logical sectors, at most count - 2. More spare sectors spread wear further
+ *                  and leave more room for background erases
+ *
+ * \return          SPIFLASH_SUCCESS if mounted, SPIFLASH_ERROR if parameters are invalid, status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashFTLMount(SPIFlashFTL_t* ftl, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count,
+                                  uint32_t logical);
+
+/**
+ * \brief           Erase every physical sector, unmapping all logical sectors. Erase counts are kept
+ *
+ * \param[in]       ftl: pointer to mounted translation layer object
+ *
+ * \return          SPIFLASH_SUCCESS if erased, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashFTLFormat(SPIFlashFTL_t* ftl);
+
+/**
+ * \brief           Read from a logical sector. Unmapped sectors read as erased (0xFF)
+ *
+ * \param[in]       ftl: pointer to translation layer object
+ * \param[in]       logical: logical sector
+ * \param[in]       offset: first byte to read
+ * \param[out]      data: pointer to destination buffer
+ * \param[in]       size: number of bytes to read, offset + size at most SPIFLASH_FTL_SECTOR_SIZE
+ *
+ * \return          SPIFLASH_SUCCESS if data is read, SPIFLASH_ERROR if parameters are invalid, status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashFTLRead(SPIFlashFTL_t* ftl, uint32_t logical, uint32_t offset, uint8_t* data, uint32_t size);
+
+/**
+ * \brief           Write a whole logical sector into the least worn free physical sector. The previous copy is
+ *                  released for erasing in the background. An interrupted write leaves the previous contents
+ *
+ * \param[in]       ftl: pointer to translation layer object
+ * \param[in]       logical: logical sector
+ * \param[in]       data: pointer to SPIFLASH_FTL_SECTOR_SIZE bytes
+ *
+ * \return          SPIFLASH_SUCCESS if data is written, SPIFLASH_ERROR if parameters are invalid, status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashFTLWrite(SPIFlashFTL_t* ftl, uint32_t logical, const uint8_t* data);
+
+/**
+ * \brief           Unmap a logical sector, releasing its physical sector
+ *
+ * \param[in]       ftl: pointer to translation layer object
+ * \param[in]       logical: logical sector
+ *
+ * \return          SPIFLASH_SUCCESS if unmapped, SPIFLASH_ERROR if parameters are invalid, status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashFTLTrim(SPIFlashFTL_t* ftl, uint32_t logical);
+
+/**
+ * \brief           Background work, one step per call: erase released sectors (asynchronously, so that reads of other
+ *                  sectors can go on) and move cold data for static wear leveling. Writes do the erases they need
+ *                  themselves when this is not called often enough
+ *
+ * \param[in]       ftl: pointer to translation layer object
+ *
+ * \return          SPIFLASH_BUSY while work is pending, SPIFLASH_SUCCESS when idle, status of the driver on failure
+ */
+SPIFlashStatus_t SPIFlashFTLPoll(SPIFlashFTL_t* ftl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHFTL_H__ */
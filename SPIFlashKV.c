@@ -0,0 +1,434 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashKV.c
+ * \author          Andrea Vivani
+ * \brief           Log-structured key-value store with a hashed in-RAM index
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashKV.h"
+#include <string.h>
+#include "SPIFlashCRC.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_PAGE_SIZE   (1 << 8)
+#define SPIFLASH_SECTOR_SIZE (1 << 12)
+
+#define SPIFLASH_KV_MAGIC    0x564B4653 /* "SFKV" */
+#define SPIFLASH_KV_LIVE     0xFFFFFFFF /* sector state, programmed to 0 once compacted */
+#define SPIFLASH_KV_ERASED   0xFFFFFFFF
+#define SPIFLASH_KV_MAX_KEYS (SPIFLASH_KV_INDEX / 4 * 3)
+
+/* Flash address of offset in the sector holding sequence number sequence */
+#define SPIFlashKVAddress(kv, sequence, offset)                                                                       \
+    ((((kv)->first + (sequence) % (kv)->count) * SPIFLASH_SECTOR_SIZE) + (offset))
+
+/* Records start on 4-byte boundaries */
+#define SPIFlashKVAlign(size) (((size) + 3) & ~3UL)
+
+#define SPIFlashKVLocation(kv, sequence, offset, length)                                                              \
+    ((((sequence) % (kv)->count) << 24) | ((uint32_t)(offset) << 12) | (length))
+#define SPIFlashKVLocationSector(location) ((location) >> 24)
+#define SPIFlashKVLocationOffset(location) (((location) >> 12) & 0xFFF)
+#define SPIFlashKVLocationLength(location) ((location) & 0xFFF)
+
+/* Fibonacci hashing of the key into the index */
+#define SPIFlashKVHash(key)                ((((key) * 0x9E3779B1UL) >> 16) & (SPIFLASH_KV_INDEX - 1))
+
+/* Typedefs ------------------------------------------------------------------*/
+
+typedef struct {
+    uint32_t key, length, crc;
+} SPIFlashKVRecord_t;
+
+/* Static  functions ----------------------------------------------------------*/
+
+/* Index slot of key, or free slot where it goes */
+static uint32_t SPIFlashKVSlot(SPIFlashKV_t* kv, uint32_t key) {
+    uint32_t slot = SPIFlashKVHash(key);
+    while ((kv->index[slot].key != key) && (kv->index[slot].key != SPIFLASH_KV_EMPTY)) {
+        slot = (slot + 1) & (SPIFLASH_KV_INDEX - 1);
+    }
+    return slot;
+}
+
+/* Remove the key in slot, shifting back the following keys of its probe sequence so that no tombstone is needed */
+static void SPIFlashKVRemove(SPIFlashKV_t* kv, uint32_t slot) {
+    uint32_t next = slot, home;
+
+    while (1) {
+        next = (next + 1) & (SPIFLASH_KV_INDEX - 1);
+        if (kv->index[next].key == SPIFLASH_KV_EMPTY) {
+            break;
+        }
+        home = SPIFlashKVHash(kv->index[next].key);
+        /* Move it unless its home lies cyclically in (slot, next] */
+        if (((next - home) & (SPIFLASH_KV_INDEX - 1)) >= ((next - slot) & (SPIFLASH_KV_INDEX - 1))) {
+            kv->index[slot] = kv->index[next];
+            slot = next;
+        }
+    }
+    kv->index[slot].key = SPIFLASH_KV_EMPTY;
+    kv->keys--;
+}
+
+static void SPIFlashKVEmpty(SPIFlashKV_t* kv) {
+    /* The first record moves the head to sequence number 0, in the first sector */
+    kv->headSeq = 0xFFFFFFFF;
+    kv->tailSeq = 0;
+    kv->offset = SPIFLASH_SECTOR_SIZE;
+    kv->keys = 0;
+    for (uint32_t ii = 0; ii < SPIFLASH_KV_INDEX; ii++) {
+        kv->index[ii].key = SPIFLASH_KV_EMPTY;
+    }
+}
+
+/* Read the header of a sector: valid if it is not compacted and carries the sequence number that belongs in it */
+static SPIFlashStatus_t SPIFlashKVHeader(SPIFlashKV_t* kv, uint32_t sector, uint32_t* sequence, uint8_t* valid) {
+    uint32_t header[SPIFLASH_KV_SECTOR_HEADER / 4];
+    SPIFlashStatus_t retVal;
+
+    retVal = SPIFlashReadAddress(kv->SPIFlash, (kv->first + sector) * SPIFLASH_SECTOR_SIZE, (uint8_t*)header,
+                                 SPIFLASH_KV_SECTOR_HEADER);
+    *sequence = header[1];
+    *valid = (header[0] == SPIFLASH_KV_MAGIC) && (header[1] == ~header[2]) && (header[3] == SPIFLASH_KV_LIVE)
+             && ((header[1] % kv->count) == sector);
+    return retVal;
+}
+
+/* Read a record header. Returns 0 at the end of the sector: blank space, torn header or no room left */
+static uint8_t SPIFlashKVNext(SPIFlashKV_t* kv, uint32_t sequence, uint32_t offset, SPIFlashKVRecord_t* record,
+                              SPIFlashStatus_t* retVal) {
+    if (offset + SPIFLASH_KV_RECORD_HEADER > SPIFLASH_SECTOR_SIZE) {
+        *retVal = SPIFLASH_SUCCESS;
+        return 0;
+    }
+    *retVal = SPIFlashReadAddress(kv->SPIFlash, SPIFlashKVAddress(kv, sequence, offset), (uint8_t*)record,
+                                  SPIFLASH_KV_RECORD_HEADER);
+    return (*retVal == SPIFLASH_SUCCESS) && (record->key != SPIFLASH_KV_EMPTY)
+           && (record->length <= SPIFLASH_SECTOR_SIZE - offset - SPIFLASH_KV_RECORD_HEADER);
+}
+
+/* Index the records of a sector, returning in offset where its free space starts */
+static SPIFlashStatus_t SPIFlashKVScan(SPIFlashKV_t* kv, uint32_t sequence, uint32_t* offset) {
+    SPIFlashKVRecord_t record;
+    SPIFlashStatus_t retVal;
+    uint8_t buffer[SPIFLASH_PAGE_SIZE];
+    uint32_t crc, slot, length;
+
+    *offset = SPIFLASH_KV_SECTOR_HEADER;
+    while (SPIFlashKVNext(kv, sequence, *offset, &record, &retVal)) {
+        crc = SPIFlashCRC32(0, &record, SPIFLASH_KV_RECORD_HEADER - sizeof(record.crc));
+        for (uint32_t done = 0; done < record.length; done += length) {
+            length = (record.length - done < SPIFLASH_PAGE_SIZE) ? record.length - done : SPIFLASH_PAGE_SIZE;
+            retVal = SPIFlashReadAddress(kv->SPIFlash,
+                                         SPIFlashKVAddress(kv, sequence, *offset + SPIFLASH_KV_RECORD_HEADER + done),
+                                         buffer, length);
+            if (retVal != SPIFLASH_SUCCESS) {
+                return retVal;
+            }
+            crc = SPIFlashCRC32(crc, buffer, length);
+        }
+        if (record.crc != crc) {
+            kv->corrupted++;
+            if (sequence == kv->headSeq) {
+                /* Torn by a power loss: leave the rest of the sector alone */
+                *offset = SPIFLASH_SECTOR_SIZE;
+                return SPIFLASH_SUCCESS;
+            }
+        } else {
+            slot = SPIFlashKVSlot(kv, record.key);
+            if (record.length == 0) {
+                if (kv->index[slot].key != SPIFLASH_KV_EMPTY) {
+                    SPIFlashKVRemove(kv, slot);
+                }
+            } else {
+                if (kv->index[slot].key == SPIFLASH_KV_EMPTY) {
+                    if (kv->keys >= SPIFLASH_KV_MAX_KEYS) {
+                        return SPIFLASH_ERROR;
+                    }
+                    kv->keys++;
+                }
+                kv->index[slot].key = record.key;
+                kv->index[slot].location = SPIFlashKVLocation(kv, sequence, *offset, record.length);
+            }
+        }
+        *offset += SPIFlashKVAlign(SPIFLASH_KV_RECORD_HEADER + record.length);
+    }
+    if ((retVal == SPIFLASH_SUCCESS) && (*offset + SPIFLASH_KV_RECORD_HEADER <= SPIFLASH_SECTOR_SIZE)
+        && ((record.key != SPIFLASH_KV_EMPTY) || (record.length != SPIFLASH_KV_ERASED)
+            || (record.crc != SPIFLASH_KV_ERASED))) {
+        /* Torn record header */
+        *offset = SPIFLASH_SECTOR_SIZE;
+    }
+    if (*offset > SPIFLASH_SECTOR_SIZE) {
+        *offset = SPIFLASH_SECTOR_SIZE;
+    }
+    return retVal;
+}
+
+/* Copy the live records of the oldest sector into the head, then release it */
+static SPIFlashStatus_t SPIFlashKVCompact(SPIFlashKV_t* kv) {
+    SPIFlashKVRecord_t record;
+    SPIFlashStatus_t retVal;
+    uint8_t buffer[SPIFLASH_PAGE_SIZE];
+    uint32_t offset = SPIFLASH_KV_SECTOR_HEADER, slot, total, length, state = 0;
+
+    while (SPIFlashKVNext(kv, kv->tailSeq, offset, &record, &retVal)) {
+        slot = SPIFlashKVSlot(kv, record.key);
+        total = SPIFLASH_KV_RECORD_HEADER + record.length;
+        /* Live if the index points here: older values and tombstones are dropped */
+        if ((record.length != 0) && (kv->index[slot].key == record.key)
+            && (kv->index[slot].location == SPIFlashKVLocation(kv, kv->tailSeq, offset, record.length))) {
+            if (kv->offset + total > SPIFLASH_SECTOR_SIZE) {
+                return SPIFLASH_ERROR;
+            }
+            for (uint32_t done = 0; done < total; done += length) {
+                length = (total - done < SPIFLASH_PAGE_SIZE) ? total - done : SPIFLASH_PAGE_SIZE;
+                retVal = SPIFlashReadAddress(kv->SPIFlash, SPIFlashKVAddress(kv, kv->tailSeq, offset + done), buffer,
+                                             length);
+                if (retVal == SPIFLASH_SUCCESS) {
+                    retVal = SPIFlashWriteAddress(kv->SPIFlash, SPIFlashKVAddress(kv, kv->headSeq, kv->offset + done),
+                                                  buffer, length);
+                }
+                if (retVal != SPIFLASH_SUCCESS) {
+                    kv->offset = SPIFLASH_SECTOR_SIZE;
+                    return retVal;
+                }
+            }
+            kv->index[slot].location = SPIFlashKVLocation(kv, kv->headSeq, kv->offset, record.length);
+            kv->offset += SPIFlashKVAlign(total);
+        }
+        offset += SPIFlashKVAlign(total);
+    }
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    retVal = SPIFlashWriteAddress(kv->SPIFlash, SPIFlashKVAddress(kv, kv->tailSeq, SPIFLASH_KV_SECTOR_HEADER - 4),
+                                  (uint8_t*)&state, sizeof(state));
+    if (retVal == SPIFLASH_SUCCESS) {
+        kv->tailSeq++;
+    }
+    return retVal;
+}
+
+/* Move the head to a freshly erased sector. If it was the last free one, compact the oldest sector into it */
+static SPIFlashStatus_t SPIFlashKVAdvance(SPIFlashKV_t* kv) {
+    uint32_t sequence = kv->headSeq + 1;
+    uint32_t header[3] = {SPIFLASH_KV_MAGIC, sequence, ~sequence};
+    SPIFlashStatus_t retVal;
+
+    retVal = SPIFlashEraseSector(kv->SPIFlash, kv->first + sequence % kv->count);
+    if (retVal == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashWriteAddress(kv->SPIFlash, SPIFlashKVAddress(kv, sequence, 0), (uint8_t*)header,
+                                      sizeof(header));
+    }
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    kv->headSeq = sequence;
+    kv->offset = SPIFLASH_KV_SECTOR_HEADER;
+    if (sequence - kv->tailSeq + 1 >= kv->count) {
+        retVal = SPIFlashKVCompact(kv);
+    }
+    return retVal;
+}
+
+/* Append a record, a tombstone if size is 0, returning its location */
+static SPIFlashStatus_t SPIFlashKVAppend(SPIFlashKV_t* kv, uint32_t key, const void* data, uint32_t size,
+                                         uint32_t* location) {
+    SPIFlashKVRecord_t record = {key, size, 0};
+    SPIFlashStatus_t retVal;
+    uint8_t buffer[SPIFLASH_PAGE_SIZE];
+    uint32_t address, total = SPIFLASH_KV_RECORD_HEADER + size, length;
+
+    /* Each move of the head compacts one sector: once all have been, live values fill the store */
+    for (uint32_t ii = 0; kv->offset + total > SPIFLASH_SECTOR_SIZE; ii++) {
+        if (ii == kv->count) {
+            return SPIFLASH_ERROR;
+        }
+        retVal = SPIFlashKVAdvance(kv);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+    }
+    record.crc = SPIFlashCRC32(SPIFlashCRC32(0, &record, SPIFLASH_KV_RECORD_HEADER - sizeof(record.crc)), data, size);
+    address = SPIFlashKVAddress(kv, kv->headSeq, kv->offset);
+    *location = SPIFlashKVLocation(kv, kv->headSeq, kv->offset, size);
+
+    /* Header and the start of the value share one page program, the rest goes straight from the caller's buffer. A
+     * header straddling two pages is programmed in two parts */
+    length = SPIFLASH_PAGE_SIZE - (address % SPIFLASH_PAGE_SIZE);
+    if (length < SPIFLASH_KV_RECORD_HEADER) {
+        length = SPIFLASH_KV_RECORD_HEADER;
+    }
+    if (length > total) {
+        length = total;
+    }
+    memcpy(buffer, &record, SPIFLASH_KV_RECORD_HEADER);
+    if (length > SPIFLASH_KV_RECORD_HEADER) {
+        memcpy(&buffer[SPIFLASH_KV_RECORD_HEADER], data, length - SPIFLASH_KV_RECORD_HEADER);
+    }
+    retVal = SPIFlashWriteAddress(kv->SPIFlash, address, buffer, length);
+    if ((retVal == SPIFLASH_SUCCESS) && (length < total)) {
+        retVal = SPIFlashWriteAddress(kv->SPIFlash, address + length,
+                                      (const uint8_t*)data + length - SPIFLASH_KV_RECORD_HEADER, total - length);
+    }
+    /* A torn record would be skipped at mount by its length. If even that may be missing, close the sector */
+    kv->offset = (retVal == SPIFLASH_SUCCESS) ? kv->offset + SPIFlashKVAlign(total) : SPIFLASH_SECTOR_SIZE;
+    return retVal;
+}
+
+/* Functions ------------------------------------------------------------------*/
+
+SPIFlashStatus_t SPIFlashKVMount(SPIFlashKV_t* kv, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count) {
+    SPIFlashStatus_t retVal;
+    uint32_t sequence, offset;
+    uint8_t valid, found = 0;
+
+    if ((kv == NULL) || (SPIFlash == NULL) || (count < 2) || (count > 256) || (first >= SPIFlash->sectorNum)
+        || (count > SPIFlash->sectorNum - first)) {
+        return SPIFLASH_ERROR;
+    }
+    kv->SPIFlash = SPIFlash;
+    kv->first = first;
+    kv->count = count;
+    kv->corrupted = 0;
+    SPIFlashKVEmpty(kv);
+
+    /* Head: the newest sector in use */
+    for (uint32_t ii = 0; ii < count; ii++) {
+        retVal = SPIFlashKVHeader(kv, ii, &sequence, &valid);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        if (valid && (!found || (sequence > kv->headSeq))) {
+            kv->headSeq = sequence;
+            found = 1;
+        }
+    }
+    if (!found) {
+        return SPIFLASH_SUCCESS;
+    }
+
+    /* Tail: the oldest of the sectors in use before it. Sectors in use never fill the area, except when a compaction
+     * into the head was cut short: drop the head, the next record compacts again */
+    kv->tailSeq = kv->headSeq;
+    while (kv->headSeq - kv->tailSeq + 1 < count) {
+        retVal = SPIFlashKVHeader(kv, (kv->tailSeq - 1) % count, &sequence, &valid);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        if (!valid || (sequence != kv->tailSeq - 1)) {
+            break;
+        }
+        kv->tailSeq--;
+    }
+    if (kv->headSeq - kv->tailSeq + 1 == count) {
+        kv->headSeq--;
+    }
+
+    for (sequence = kv->tailSeq; sequence != kv->headSeq + 1; sequence++) {
+        retVal = SPIFlashKVScan(kv, sequence, &offset);
+        if (retVal != SPIFLASH_SUCCESS) {
+            SPIFlashKVEmpty(kv);
+            return retVal;
+        }
+    }
+    kv->offset = offset;
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashKVFormat(SPIFlashKV_t* kv) {
+    SPIFlashStatus_t retVal;
+
+    retVal = SPIFlashEraseRange(kv->SPIFlash, kv->first * SPIFLASH_SECTOR_SIZE, kv->count * SPIFLASH_SECTOR_SIZE);
+    SPIFlashKVEmpty(kv);
+    kv->corrupted = 0;
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashKVGet(SPIFlashKV_t* kv, uint32_t key, uint8_t* data, uint32_t maxSize, uint32_t* size) {
+    uint32_t slot = SPIFlashKVSlot(kv, key), location = kv->index[slot].location;
+
+    *size = 0;
+    if ((key == SPIFLASH_KV_EMPTY) || (kv->index[slot].key == SPIFLASH_KV_EMPTY)) {
+        return SPIFLASH_ERROR;
+    }
+    *size = SPIFlashKVLocationLength(location);
+    if (*size > maxSize) {
+        return SPIFLASH_ERROR;
+    }
+    return SPIFlashReadAddress(kv->SPIFlash,
+                               (kv->first + SPIFlashKVLocationSector(location)) * SPIFLASH_SECTOR_SIZE
+                                   + SPIFlashKVLocationOffset(location) + SPIFLASH_KV_RECORD_HEADER,
+                               data, *size);
+}
+
+SPIFlashStatus_t SPIFlashKVPut(SPIFlashKV_t* kv, uint32_t key, const void* data, uint32_t size) {
+    SPIFlashStatus_t retVal;
+    uint32_t slot, location;
+
+    if ((key == SPIFLASH_KV_EMPTY) || (data == NULL) || (size == 0) || (size > SPIFLASH_KV_MAX_VALUE)) {
+        return SPIFLASH_ERROR;
+    }
+    slot = SPIFlashKVSlot(kv, key);
+    if ((kv->index[slot].key == SPIFLASH_KV_EMPTY) && (kv->keys >= SPIFLASH_KV_MAX_KEYS)) {
+        return SPIFLASH_ERROR;
+    }
+    retVal = SPIFlashKVAppend(kv, key, data, size, &location);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    /* Compaction may have moved keys around */
+    slot = SPIFlashKVSlot(kv, key);
+    if (kv->index[slot].key == SPIFLASH_KV_EMPTY) {
+        kv->index[slot].key = key;
+        kv->keys++;
+    }
+    kv->index[slot].location = location;
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashKVDelete(SPIFlashKV_t* kv, uint32_t key) {
+    SPIFlashStatus_t retVal;
+    uint32_t slot = SPIFlashKVSlot(kv, key), location;
+
+    if ((key == SPIFLASH_KV_EMPTY) || (kv->index[slot].key == SPIFLASH_KV_EMPTY)) {
+        return SPIFLASH_SUCCESS;
+    }
+    retVal = SPIFlashKVAppend(kv, key, NULL, 0, &location);
+    if (retVal == SPIFLASH_SUCCESS) {
+        SPIFlashKVRemove(kv, SPIFlashKVSlot(kv, key));
+    }
+    return retVal;
+}
@@ -0,0 +1,154 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashKV.h
+ * \author          Andrea Vivani
+ * \brief           Log-structured key-value store with a hashed in-RAM index
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHKV_H__
+#define __SPIFLASHKV_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_KV_SECTOR_HEADER 16 /* magic, sequence number, its complement and state */
+#define SPIFLASH_KV_RECORD_HEADER 12 /* key, length and CRC-32 */
+#define SPIFLASH_KV_MAX_VALUE     ((1 << 12) - SPIFLASH_KV_SECTOR_HEADER - SPIFLASH_KV_RECORD_HEADER)
+#define SPIFLASH_KV_EMPTY         0xFFFFFFFF /* reserved key, marks free index slots */
+
+/*---------- SPIFLASH_KV_INDEX  -----------*/
+/* Index slots, power of 2. Up to 3/4 of them can hold keys, so that lookups stay short. RAM use is 8 bytes per
+ * slot */
+#ifndef SPIFLASH_KV_INDEX
+#define SPIFLASH_KV_INDEX 512
+#endif
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * Index slot: key and location of its newest record, as sector << 24 | offset << 12 | value length
+ */
+typedef struct {
+    uint32_t key, location;
+} SPIFlashKVEntry_t;
+
+/**
+ * SPI flash key-value store struct. Records are appended in ring order like in SPIFlashLog_t, sector n % count holding
+ * sequence number n. One sector is always kept free: when the head moves into it, the live records of the oldest
+ * sector are copied there and the oldest sector is released
+ */
+typedef struct {
+    SPIFlash_t* SPIFlash;
+    uint32_t first, count;     /* first sector and number of sectors of the store area */
+    uint32_t headSeq, tailSeq; /* sequence numbers of the newest and oldest sectors */
+    uint32_t offset;           /* next free byte of the head sector */
+    uint32_t keys;             /* keys in the index */
+    uint32_t corrupted;        /* records skipped at mount for a bad CRC */
+    SPIFlashKVEntry_t index[SPIFLASH_KV_INDEX];
+} SPIFlashKV_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Mount a store, building the index from the records of every sector in use. A blank area mounts as
+ *                  an empty store. A record torn by a power loss is skipped, and so is a compaction cut short
+ *
+ * \param[in]       kv: pointer to key-value store object
+ * \param[in]       SPIFlash: pointer to initialized SPI flash object
+ * \param[in]       first: first sector of the store area
+ * \param[in]       count: number of sectors of the store area, from 2 to 256
+ *
+ * \return          SPIFLASH_SUCCESS if store is mounted, SPIFLASH_ERROR if the area is invalid or the keys do not fit
+ *                  in the index, other status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashKVMount(SPIFlashKV_t* kv, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count);
+
+/**
+ * \brief           Erase the whole store area, leaving an empty mounted store
+ *
+ * \param[in]       kv: pointer to key-value store object, with SPIFlash, first and count set (e.g. by a failed mount)
+ *
+ * \return          SPIFLASH_SUCCESS if store is erased, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashKVFormat(SPIFlashKV_t* kv);
+
+/**
+ * \brief           Read the value of a key with a single read, its location coming from the index
+ *
+ * \param[in]       kv: pointer to key-value store object
+ * \param[in]       key: key, any value but SPIFLASH_KV_EMPTY
+ * \param[out]      data: pointer to destination buffer
+ * \param[in]       maxSize: size of destination buffer
+ * \param[out]      size: value size, 0 if key is not found
+ *
+ * \return          SPIFLASH_SUCCESS if value is read, SPIFLASH_ERROR if key is not found or the value is larger than
+ *                  maxSize, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashKVGet(SPIFlashKV_t* kv, uint32_t key, uint8_t* data, uint32_t maxSize, uint32_t* size);
+
+/**
+ * \brief           Write the value of a key, appending a record. Record header and value share one page program when
+ *                  they fit in the page. When the head sector is full, the next one is erased and the oldest sector is
+ *                  compacted into it
+ *
+ * \param[in]       kv: pointer to key-value store object
+ * \param[in]       key: key, any value but SPIFLASH_KV_EMPTY
+ * \param[in]       data: pointer to value
+ * \param[in]       size: value size, from 1 to SPIFLASH_KV_MAX_VALUE bytes
+ *
+ * \return          SPIFLASH_SUCCESS if value is written, SPIFLASH_ERROR if parameters are invalid, the index is full or
+ *                  live values fill the store, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashKVPut(SPIFlashKV_t* kv, uint32_t key, const void* data, uint32_t size);
+
+/**
+ * \brief           Delete a key, appending a tombstone record. The space of its values is reclaimed by compaction
+ *
+ * \param[in]       kv: pointer to key-value store object
+ * \param[in]       key: key
+ *
+ * \return          SPIFLASH_SUCCESS if key is deleted or not found, SPIFLASH_ERROR if live values fill the store,
+ *                  status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashKVDelete(SPIFlashKV_t* kv, uint32_t key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHKV_H__ */
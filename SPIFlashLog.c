@@ -0,0 +1,310 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashLog.c
+ * \author          Andrea Vivani
+ * \brief           Log-structured circular record logger on SPI flash memory
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashLog.h"
+#include <string.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_PAGE_SIZE   (1 << 8)
+#define SPIFLASH_SECTOR_SIZE (1 << 12)
+
+#define SPIFLASH_LOG_MAGIC   0x474C4653 /* "SFLG" */
+#define SPIFLASH_LOG_ERASED  0xFFFF
+
+/* Flash address of offset in the sector holding sequence number sequence */
+#define SPIFlashLogAddress(log, sequence, offset)                                                                      \
+    ((((log)->first + (sequence) % (log)->count) * SPIFLASH_SECTOR_SIZE) + (offset))
+
+/* Records start on 4-byte boundaries, so that a record header never straddles two pages */
+#define SPIFlashLogAlign(size) (((size) + 3) & ~3UL)
+
+/* Static  functions ----------------------------------------------------------*/
+
+/* Fletcher-16 of length and payload. Sums are reduced once at the end: 32 bits hold them for up to 5802 bytes */
+static uint16_t SPIFlashLogChecksum(const uint8_t* data, uint32_t size) {
+    uint32_t sum1 = (size & 0xFF) + (size >> 8), sum2 = sum1;
+    for (uint32_t ii = 0; ii < size; ii++) {
+        sum1 += data[ii];
+        sum2 += sum1;
+    }
+    return (uint16_t)(((sum2 % 255) << 8) | (sum1 % 255));
+}
+
+/* Read the header of a sector: valid if it carries the sequence number that belongs in that sector */
+static SPIFlashStatus_t SPIFlashLogHeader(SPIFlashLog_t* log, uint32_t sector, uint32_t* sequence, uint8_t* valid) {
+    uint32_t header[SPIFLASH_LOG_SECTOR_HEADER / 4];
+    SPIFlashStatus_t retVal;
+
+    retVal = SPIFlashReadAddress(log->SPIFlash, (log->first + sector) * SPIFLASH_SECTOR_SIZE, (uint8_t*)header,
+                                 SPIFLASH_LOG_SECTOR_HEADER);
+    *sequence = header[1];
+    *valid = (header[0] == SPIFLASH_LOG_MAGIC) && (header[1] == ~header[2]) && ((header[1] % log->count) == sector);
+    return retVal;
+}
+
+static void SPIFlashLogEmpty(SPIFlashLog_t* log) {
+    /* The first append moves the head to sequence number 0, in the first sector */
+    log->headSeq = 0xFFFFFFFF;
+    log->tailSeq = 0;
+    log->offset = SPIFLASH_SECTOR_SIZE;
+}
+
+/* Move the head to a freshly erased sector, dropping the oldest one if the log is full */
+static SPIFlashStatus_t SPIFlashLogAdvance(SPIFlashLog_t* log) {
+    uint32_t sequence = log->headSeq + 1;
+    uint32_t header[SPIFLASH_LOG_SECTOR_HEADER / 4] = {SPIFLASH_LOG_MAGIC, sequence, ~sequence};
+    SPIFlashStatus_t retVal;
+
+    if (sequence - log->tailSeq >= log->count) {
+        log->tailSeq = sequence - log->count + 1;
+    }
+    retVal = SPIFlashEraseSector(log->SPIFlash, log->first + sequence % log->count);
+    if (retVal == SPIFLASH_SUCCESS) {
+        retVal = SPIFlashWriteAddress(log->SPIFlash, SPIFlashLogAddress(log, sequence, 0), (uint8_t*)header,
+                                      SPIFLASH_LOG_SECTOR_HEADER);
+    }
+    if (retVal == SPIFLASH_SUCCESS) {
+        log->headSeq = sequence;
+        log->offset = SPIFLASH_LOG_SECTOR_HEADER;
+    }
+    return retVal;
+}
+
+/* Functions ------------------------------------------------------------------*/
+
+SPIFlashStatus_t SPIFlashLogMount(SPIFlashLog_t* log, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count) {
+    SPIFlashStatus_t retVal;
+    uint32_t first0, sequence, low = 0, high = count, mid, offset;
+    uint16_t record[SPIFLASH_LOG_RECORD_HEADER / 2];
+    uint8_t valid;
+
+    if ((log == NULL) || (SPIFlash == NULL) || (count < 2) || (first >= SPIFlash->sectorNum)
+        || (count > SPIFlash->sectorNum - first)) {
+        return SPIFLASH_ERROR;
+    }
+    log->SPIFlash = SPIFlash;
+    log->first = first;
+    log->count = count;
+    log->corrupted = 0;
+    SPIFlashLogEmpty(log);
+
+    /* Head: sectors 0 to head hold consecutive sequence numbers from the one of sector 0, the others older ones or
+     * nothing. Sector 0 is only blank in an empty log or when its erase, as the head moved into it, was cut short */
+    retVal = SPIFlashLogHeader(log, 0, &first0, &valid);
+    if (retVal != SPIFLASH_SUCCESS) {
+        return retVal;
+    }
+    if (!valid) {
+        retVal = SPIFlashLogHeader(log, count - 1, &sequence, &valid);
+        if ((retVal != SPIFLASH_SUCCESS) || !valid) {
+            return retVal;
+        }
+        log->headSeq = sequence;
+    } else {
+        while (high - low > 1) {
+            mid = low + (high - low) / 2;
+            retVal = SPIFlashLogHeader(log, mid, &sequence, &valid);
+            if (retVal != SPIFLASH_SUCCESS) {
+                return retVal;
+            }
+            if (valid && (sequence == first0 + mid)) {
+                low = mid;
+            } else {
+                high = mid;
+            }
+        }
+        log->headSeq = first0 + low;
+    }
+
+    /* Tail: the sector after the head, or the one after that if the head was moving into it, once the log has
+     * wrapped. Sector 0 of the current lap otherwise */
+    log->tailSeq = log->headSeq - log->headSeq % count;
+    for (uint32_t ii = 1; (ii <= 2) && (log->headSeq + ii >= count); ii++) {
+        retVal = SPIFlashLogHeader(log, (log->headSeq + ii) % count, &sequence, &valid);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        if (valid && (sequence == log->headSeq + ii - count)) {
+            log->tailSeq = sequence;
+            break;
+        }
+    }
+    if (log->tailSeq == log->headSeq - log->headSeq % count) {
+        /* Not wrapped yet: sector 0 of this lap must be there */
+        if ((log->tailSeq != log->headSeq) && (log->tailSeq != first0)) {
+            SPIFlashLogEmpty(log);
+            return SPIFLASH_ERROR;
+        }
+    }
+
+    /* Head offset: walk the records of the head sector up to the first blank record header */
+    offset = SPIFLASH_LOG_SECTOR_HEADER;
+    while (offset + SPIFLASH_LOG_RECORD_HEADER <= SPIFLASH_SECTOR_SIZE) {
+        retVal = SPIFlashReadAddress(SPIFlash, SPIFlashLogAddress(log, log->headSeq, offset), (uint8_t*)record,
+                                     SPIFLASH_LOG_RECORD_HEADER);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        if ((record[0] == SPIFLASH_LOG_ERASED) && (record[1] == SPIFLASH_LOG_ERASED)) {
+            break;
+        }
+        if ((record[0] == 0) || (record[0] > SPIFLASH_SECTOR_SIZE - offset - SPIFLASH_LOG_RECORD_HEADER)) {
+            /* Torn record header: leave the rest of the sector alone */
+            offset = SPIFLASH_SECTOR_SIZE;
+            break;
+        }
+        offset += SPIFlashLogAlign(SPIFLASH_LOG_RECORD_HEADER + record[0]);
+    }
+    log->offset = (offset < SPIFLASH_SECTOR_SIZE) ? offset : SPIFLASH_SECTOR_SIZE;
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashLogFormat(SPIFlashLog_t* log) {
+    SPIFlashStatus_t retVal;
+
+    retVal = SPIFlashEraseRange(log->SPIFlash, log->first * SPIFLASH_SECTOR_SIZE, log->count * SPIFLASH_SECTOR_SIZE);
+    SPIFlashLogEmpty(log);
+    log->corrupted = 0;
+    return retVal;
+}
+
+SPIFlashStatus_t SPIFlashLogAppend(SPIFlashLog_t* log, const void* data, uint32_t size) {
+    SPIFlashStatus_t retVal;
+    uint8_t buffer[SPIFLASH_PAGE_SIZE];
+    uint16_t header[SPIFLASH_LOG_RECORD_HEADER / 2];
+    uint32_t address, total = SPIFLASH_LOG_RECORD_HEADER + size, length;
+
+    if ((data == NULL) || (size == 0) || (size > SPIFLASH_LOG_MAX_RECORD)) {
+        return SPIFLASH_ERROR;
+    }
+    if (log->offset + total > SPIFLASH_SECTOR_SIZE) {
+        retVal = SPIFlashLogAdvance(log);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+    }
+    header[0] = size;
+    header[1] = SPIFlashLogChecksum(data, size);
+    address = SPIFlashLogAddress(log, log->headSeq, log->offset);
+
+    /* Header and the start of the payload share one page program, the rest goes straight from the caller's buffer */
+    length = SPIFLASH_PAGE_SIZE - (address % SPIFLASH_PAGE_SIZE);
+    if (length > total) {
+        length = total;
+    }
+    memcpy(buffer, header, SPIFLASH_LOG_RECORD_HEADER);
+    memcpy(&buffer[SPIFLASH_LOG_RECORD_HEADER], data, length - SPIFLASH_LOG_RECORD_HEADER);
+    retVal = SPIFlashWriteAddress(log->SPIFlash, address, buffer, length);
+    if ((retVal == SPIFLASH_SUCCESS) && (length < total)) {
+        retVal = SPIFlashWriteAddress(log->SPIFlash, address + length,
+                                      (const uint8_t*)data + length - SPIFLASH_LOG_RECORD_HEADER, total - length);
+    }
+    /* A torn record is skipped on readback by its length. If even that may be missing, close the sector */
+    log->offset = (retVal == SPIFLASH_SUCCESS) ? log->offset + SPIFlashLogAlign(total) : SPIFLASH_SECTOR_SIZE;
+    return retVal;
+}
+
+void SPIFlashLogFirst(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor) {
+    cursor->sequence = log->tailSeq;
+    cursor->offset = SPIFLASH_LOG_SECTOR_HEADER;
+}
+
+void SPIFlashLogEnd(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor) {
+    cursor->sequence = log->headSeq;
+    cursor->offset = log->offset;
+}
+
+SPIFlashStatus_t SPIFlashLogNext(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor, uint8_t* data, uint32_t maxSize,
+                                 uint32_t* size) {
+    SPIFlashStatus_t retVal;
+    uint16_t header[SPIFLASH_LOG_RECORD_HEADER / 2];
+    uint32_t sequence, length;
+    uint8_t valid;
+
+    while (1) {
+        if ((int32_t)(cursor->sequence - log->tailSeq) < 0) {
+            /* Overwritten since the cursor was set */
+            SPIFlashLogFirst(log, cursor);
+        }
+        if (((int32_t)(cursor->sequence - log->headSeq) > 0)
+            || ((cursor->sequence == log->headSeq) && (cursor->offset >= log->offset))) {
+            return SPIFLASH_BUSY;
+        }
+        if (cursor->offset == SPIFLASH_LOG_SECTOR_HEADER) {
+            /* Entering a sector: skip it if its erase was cut short */
+            retVal = SPIFlashLogHeader(log, cursor->sequence % log->count, &sequence, &valid);
+            if (retVal != SPIFLASH_SUCCESS) {
+                return retVal;
+            }
+            if (!valid || (sequence != cursor->sequence)) {
+                cursor->sequence++;
+                continue;
+            }
+        }
+        length = 0;
+        if (cursor->offset + SPIFLASH_LOG_RECORD_HEADER <= SPIFLASH_SECTOR_SIZE) {
+            retVal = SPIFlashReadAddress(log->SPIFlash, SPIFlashLogAddress(log, cursor->sequence, cursor->offset),
+                                         (uint8_t*)header, SPIFLASH_LOG_RECORD_HEADER);
+            if (retVal != SPIFLASH_SUCCESS) {
+                return retVal;
+            }
+            length = header[0];
+        }
+        if ((length == 0) || (length > SPIFLASH_SECTOR_SIZE - cursor->offset - SPIFLASH_LOG_RECORD_HEADER)) {
+            /* End of the sector: blank space, torn record header or no room left */
+            cursor->sequence++;
+            cursor->offset = SPIFLASH_LOG_SECTOR_HEADER;
+            continue;
+        }
+        *size = length;
+        if (length > maxSize) {
+            return SPIFLASH_ERROR;
+        }
+        retVal = SPIFlashReadAddress(log->SPIFlash,
+                                     SPIFlashLogAddress(log, cursor->sequence,
+                                                        cursor->offset + SPIFLASH_LOG_RECORD_HEADER),
+                                     data, length);
+        if (retVal != SPIFLASH_SUCCESS) {
+            return retVal;
+        }
+        cursor->offset += SPIFlashLogAlign(SPIFLASH_LOG_RECORD_HEADER + length);
+        if (header[1] == SPIFlashLogChecksum(data, length)) {
+            return SPIFLASH_SUCCESS;
+        }
+        log->corrupted++;
+    }
+}
@@ -0,0 +1,150 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashLog.h
+ * \author          Andrea Vivani
+ * \brief           Log-structured circular record logger on SPI flash memory
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHLOG_H__
+#define __SPIFLASHLOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_LOG_SECTOR_HEADER 12 /* magic, sequence number and its complement */
+#define SPIFLASH_LOG_RECORD_HEADER 4  /* length and Fletcher-16 checksum */
+#define SPIFLASH_LOG_MAX_RECORD    ((1 << 12) - SPIFLASH_LOG_SECTOR_HEADER - SPIFLASH_LOG_RECORD_HEADER)
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * SPI flash log struct. Sectors are filled in ring order, sector n % count holding the n-th sector ever written
+ * (sequence number n). The oldest sector is erased when the head moves into it
+ */
+typedef struct {
+    SPIFlash_t* SPIFlash;
+    uint32_t first, count;      /* first sector and number of sectors of the log area */
+    uint32_t headSeq, tailSeq;  /* sequence numbers of the newest and oldest sectors */
+    uint32_t offset;            /* next free byte of the head sector */
+    uint32_t corrupted;         /* records skipped by SPIFlashLogNext() for a bad checksum */
+} SPIFlashLog_t;
+
+/**
+ * SPI flash log read position, valid across appends. A cursor left behind by the tail restarts from the oldest record
+ */
+typedef struct {
+    uint32_t sequence, offset;
+} SPIFlashLogCursor_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Mount a log, finding head and tail with a binary search over the sector headers (about
+ *                  log2(sectors) + 3 header reads) and a walk of the head sector records. A blank area mounts as an
+ *                  empty log. A record torn by a power loss is skipped on readback, and the rest of its sector is left
+ *                  unused
+ *
+ * \param[in]       log: pointer to log object
+ * \param[in]       SPIFlash: pointer to initialized SPI flash object
+ * \param[in]       first: first sector of the log area
+ * \param[in]       count: number of sectors of the log area, at least 2
+ *
+ * \return          SPIFLASH_SUCCESS if log is mounted, SPIFLASH_ERROR if the area is invalid or the sector headers are
+ *                  inconsistent (call SPIFlashLogFormat() to start over), other status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashLogMount(SPIFlashLog_t* log, SPIFlash_t* SPIFlash, uint32_t first, uint32_t count);
+
+/**
+ * \brief           Erase the whole log area, leaving an empty mounted log
+ *
+ * \param[in]       log: pointer to log object, with SPIFlash, first and count set (e.g. by a failed mount)
+ *
+ * \return          SPIFLASH_SUCCESS if log is erased, status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashLogFormat(SPIFlashLog_t* log);
+
+/**
+ * \brief           Append a record. Records never span sectors: when the head sector is full, the next one is erased
+ *                  (dropping the oldest records if the log is full) and the record goes there
+ *
+ * \param[in]       log: pointer to log object
+ * \param[in]       data: pointer to record
+ * \param[in]       size: record size, from 1 to SPIFLASH_LOG_MAX_RECORD bytes
+ *
+ * \return          SPIFLASH_SUCCESS if record is written, SPIFLASH_ERROR if size is invalid, status of the driver
+ *                  otherwise
+ */
+SPIFlashStatus_t SPIFlashLogAppend(SPIFlashLog_t* log, const void* data, uint32_t size);
+
+/**
+ * \brief           Set a cursor on the oldest record
+ *
+ * \param[in]       log: pointer to log object
+ * \param[out]      cursor: pointer to cursor
+ */
+void SPIFlashLogFirst(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor);
+
+/**
+ * \brief           Set a cursor past the newest record, to read only records appended from now on
+ *
+ * \param[in]       log: pointer to log object
+ * \param[out]      cursor: pointer to cursor
+ */
+void SPIFlashLogEnd(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor);
+
+/**
+ * \brief           Read the record at cursor and move the cursor to the next one
+ *
+ * \param[in]       log: pointer to log object
+ * \param[in]       cursor: pointer to cursor
+ * \param[out]      data: pointer to destination buffer
+ * \param[in]       maxSize: size of destination buffer
+ * \param[out]      size: record size
+ *
+ * \return          SPIFLASH_SUCCESS if a record is read, SPIFLASH_BUSY if there are no more records (yet),
+ *                  SPIFLASH_ERROR if the record is larger than maxSize (size is set and the cursor is left on it),
+ *                  status of the driver otherwise
+ */
+SPIFlashStatus_t SPIFlashLogNext(SPIFlashLog_t* log, SPIFlashLogCursor_t* cursor, uint8_t* data, uint32_t maxSize,
+                                 uint32_t* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHLOG_H__ */
@@ -0,0 +1,405 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashSched.c
+ * \author          Andrea Vivani
+ * \brief           Priority-based request scheduler for SPI flash memory shared by several clients
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashSched.h"
+#include <string.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SPIFLASH_PAGE_SIZE   (1 << 8)
+#define SPIFLASH_SECTOR_SIZE (1 << 12)
+#define SPIFLASH_BLOCK_SIZE  (1 << 16)
+
+#if (SPIFLASH_SCHED_ISR_QUEUE & (SPIFLASH_SCHED_ISR_QUEUE - 1)) != 0
+#error "SPIFLASH_SCHED_ISR_QUEUE must be a power of 2"
+#endif
+
+/* Static  functions ----------------------------------------------------------*/
+
+static void SPIFlashSchedLock(SPIFlashSched_t* sched) { SPIFlashLockAcquire(&sched->lock); }
+
+static void SPIFlashSchedUnLock(SPIFlashSched_t* sched) { SPIFlashLockRelease(&sched->lock); }
+
+static uint8_t SPIFlashSchedEarlier(SPIFlashSchedReq_t* a, SPIFlashSchedReq_t* b) {
+    if (a->deadline == 0) {
+        return 0;
+    }
+    return (b->deadline == 0)
+           || ((int32_t)((a->submitTime + a->deadline) - (b->submitTime + b->deadline)) < 0);
+}
+
+static SPIFlashStatus_t SPIFlashSchedCheck(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    uint32_t capacity = sched->SPIFlash->pageNum * SPIFLASH_PAGE_SIZE;
+
+    if ((req->priority >= SPIFLASH_SCHED_PRIORITIES) || (req->size == 0) || (req->address >= capacity)
+        || (req->size > capacity - req->address) || ((req->type != SPIFLASH_SCHED_ERASE) && (req->data == NULL))
+        || ((req->type == SPIFLASH_SCHED_ERASE)
+            && (((req->address | req->size) % SPIFLASH_SECTOR_SIZE) != 0))) {
+        return SPIFLASH_ERROR;
+    }
+    req->status = SPIFLASH_BUSY;
+    req->done = 0;
+    req->group = NULL;
+    req->submitTime = SPIFlashGetTimeUs();
+    return SPIFLASH_SUCCESS;
+}
+
+/* Has to be called with the scheduler locked */
+static void SPIFlashSchedQueue(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    SPIFlashSchedReq_t** link = &sched->queue[req->priority];
+    SPIFlashSchedStats_t* stats = &sched->stats[req->priority];
+
+    while ((*link != NULL) && !SPIFlashSchedEarlier(req, *link)) {
+        link = &(*link)->next;
+    }
+    req->next = *link;
+    *link = req;
+    stats->depth++;
+    if (stats->depth > stats->maxDepth) {
+        stats->maxDepth = stats->depth;
+    }
+}
+
+/* Has to be called with the scheduler locked. Moves requests submitted from ISRs into the queues */
+static void SPIFlashSchedDrain(SPIFlashSched_t* sched) {
+#if SPIFLASH_SCHED_ISR_QUEUE > 0
+    uint32_t tail = sched->isrTail, head = __atomic_load_n(&sched->isrHead, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++) {
+        SPIFlashSchedQueue(sched, sched->isrRing[tail % SPIFLASH_SCHED_ISR_QUEUE]);
+    }
+    __atomic_store_n(&sched->isrTail, tail, __ATOMIC_RELEASE);
+#else
+    (void)sched;
+#endif
+}
+
+static void SPIFlashSchedUnlink(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    SPIFlashSchedReq_t** link = &sched->queue[req->priority];
+    while (*link != req) {
+        link = &(*link)->next;
+    }
+    *link = req->next;
+    sched->stats[req->priority].depth--;
+}
+
+/* Has to be called with the scheduler locked. Callbacks are invoked by SPIFlashSchedNotify() after unlocking */
+static void SPIFlashSchedComplete(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req, SPIFlashStatus_t status) {
+    SPIFlashSchedStats_t* stats = &sched->stats[req->priority];
+    uint32_t latency = SPIFlashGetTimeUs() - req->submitTime;
+
+    SPIFlashSchedUnlink(sched, req);
+    stats->completed++;
+    stats->latencySum += latency;
+    if (latency > stats->latencyMax) {
+        stats->latencyMax = latency;
+    }
+    if ((req->deadline != 0) && (latency > req->deadline)) {
+        stats->missed++;
+    }
+    req->status = status;
+}
+
+static void SPIFlashSchedNotify(SPIFlashSchedReq_t* req) {
+    SPIFlashSchedReq_t* next;
+    while (req != NULL) {
+        next = req->group;
+        if (req->callback != NULL) {
+            req->callback(req->status, req->context);
+        }
+        req = next;
+    }
+}
+
+static uint8_t SPIFlashSchedReadable(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+#if SPIFLASH_SUSPEND
+    uint32_t address = req->address + req->done;
+    SPIFlashAsync_t* async = &sched->SPIFlash->async;
+    return (address + (req->size - req->done) <= async->busyAddress)
+           || (address >= async->busyAddress + async->busyLength);
+#else
+    (void)sched;
+    (void)req;
+    return 0;
+#endif
+}
+
+/* Has to be called with the scheduler locked. Highest priority first, unless a lower-priority request is about to
+ * miss its deadline. While a program/erase is in progress, only reads outside its range can be dispatched */
+static SPIFlashSchedReq_t* SPIFlashSchedPick(SPIFlashSched_t* sched) {
+    SPIFlashSchedReq_t *best = NULL, *req;
+    uint32_t now = SPIFlashGetTimeUs();
+
+    for (uint8_t ii = 0; ii < SPIFLASH_SCHED_PRIORITIES; ii++) {
+        for (req = sched->queue[ii]; req != NULL; req = req->next) {
+            if (sched->active == NULL) {
+                break;
+            }
+            if ((req != sched->active) && (req->type == SPIFLASH_SCHED_READ) && SPIFlashSchedReadable(sched, req)) {
+                break;
+            }
+        }
+        if (req == NULL) {
+            continue;
+        }
+        if (best == NULL) {
+            best = req;
+        } else if ((req->deadline != 0)
+                   && ((int32_t)(req->submitTime + req->deadline - now) < SPIFLASH_SCHED_URGENT)
+                   && SPIFlashSchedEarlier(req, best)) {
+            best = req;
+        }
+    }
+    return best;
+}
+
+static void SPIFlashSchedDone(SPIFlashStatus_t status, void* context) {
+    ((SPIFlashSched_t*)context)->activeStatus = status;
+}
+
+static SPIFlashStatus_t SPIFlashSchedRead(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    SPIFlashStatus_t retVal;
+    uint32_t start = req->address + req->done, length = req->size - req->done;
+    if (length > SPIFLASH_SCHED_READ_CHUNK) {
+        length = SPIFLASH_SCHED_READ_CHUNK;
+    }
+    req->group = NULL;
+
+#if SPIFLASH_SCHED_MERGE_SIZE > 0
+    SPIFlashSchedReq_t *tail = req, *other;
+    uint32_t end = start + length;
+    uint8_t found = (length <= SPIFLASH_SCHED_MERGE_SIZE);
+
+    /* Collect whole queued reads starting inside or right after the chunk, as long as the union fits the buffer */
+    SPIFlashSchedLock(sched);
+    while (found) {
+        found = 0;
+        for (uint8_t ii = 0; ii < SPIFLASH_SCHED_PRIORITIES; ii++) {
+            for (other = sched->queue[ii]; other != NULL; other = other->next) {
+                if ((other == req) || (other->type != SPIFLASH_SCHED_READ) || (other->done != 0)
+                    || (other->group != NULL) || (other == tail) || (other->address < start)
+                    || (other->address > end) || (other->address + other->size - start > SPIFLASH_SCHED_MERGE_SIZE)
+                    || ((sched->active != NULL) && !SPIFlashSchedReadable(sched, other))) {
+                    continue;
+                }
+                tail->group = other;
+                tail = other;
+                other->group = NULL;
+                if (other->address + other->size > end) {
+                    end = other->address + other->size;
+                }
+                found = 1;
+            }
+        }
+    }
+    SPIFlashSchedUnLock(sched);
+
+    if (req->group != NULL) {
+        retVal = SPIFlashReadAddress(sched->SPIFlash, start, sched->merge, end - start);
+        if (retVal == SPIFLASH_BUSY) {
+            for (other = req; other != NULL; other = tail) {
+                tail = other->group;
+                other->group = NULL;
+            }
+            return retVal;
+        }
+        memcpy(&req->data[req->done], sched->merge, length);
+        SPIFlashSchedLock(sched);
+        for (other = req->group; other != NULL; other = other->group) {
+            memcpy(other->data, &sched->merge[other->address - start], other->size);
+            sched->stats[other->priority].merged++;
+            SPIFlashSchedComplete(sched, other, retVal);
+        }
+        req->done += length;
+        if ((retVal != SPIFLASH_SUCCESS) || (req->done == req->size)) {
+            SPIFlashSchedComplete(sched, req, retVal);
+        } else {
+            /* Still queued: notify the merged requests only */
+            other = req->group;
+            req->group = NULL;
+            SPIFlashSchedUnLock(sched);
+            SPIFlashSchedNotify(other);
+            return retVal;
+        }
+        SPIFlashSchedUnLock(sched);
+        SPIFlashSchedNotify(req);
+        return retVal;
+    }
+#endif
+
+    retVal = SPIFlashReadAddress(sched->SPIFlash, start, &req->data[req->done], length);
+    if (retVal == SPIFLASH_BUSY) {
+        return retVal;
+    }
+    SPIFlashSchedLock(sched);
+    req->done += length;
+    if ((retVal != SPIFLASH_SUCCESS) || (req->done == req->size)) {
+        SPIFlashSchedComplete(sched, req, retVal);
+        SPIFlashSchedUnLock(sched);
+        SPIFlashSchedNotify(req);
+        return retVal;
+    }
+    SPIFlashSchedUnLock(sched);
+    return retVal;
+}
+
+static SPIFlashStatus_t SPIFlashSchedStart(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    SPIFlashStatus_t retVal;
+    uint32_t address = req->address + req->done, length;
+
+    sched->activeStatus = SPIFLASH_BUSY;
+    if (req->type == SPIFLASH_SCHED_PROGRAM) {
+        length = SPIFLASH_PAGE_SIZE - (address % SPIFLASH_PAGE_SIZE);
+        if (length > req->size - req->done) {
+            length = req->size - req->done;
+        }
+        retVal = SPIFlashWriteAddressAsync(sched->SPIFlash, address, &req->data[req->done], length,
+                                           SPIFlashSchedDone, sched);
+    } else if (SPIFLASH_SCHED_BLOCK_ERASE && ((address % SPIFLASH_BLOCK_SIZE) == 0)
+               && (req->size - req->done >= SPIFLASH_BLOCK_SIZE)) {
+        length = SPIFLASH_BLOCK_SIZE;
+        retVal = SPIFlashEraseBlockAsync(sched->SPIFlash, address / SPIFLASH_BLOCK_SIZE, SPIFlashSchedDone, sched);
+    } else {
+        length = SPIFLASH_SECTOR_SIZE;
+        retVal = SPIFlashEraseSectorAsync(sched->SPIFlash, address / SPIFLASH_SECTOR_SIZE, SPIFlashSchedDone, sched);
+    }
+
+    if (retVal == SPIFLASH_SUCCESS) {
+        sched->active = req;
+        sched->activeLength = length;
+    } else if (retVal == SPIFLASH_ERROR) {
+        SPIFlashSchedLock(sched);
+        req->group = NULL;
+        SPIFlashSchedComplete(sched, req, retVal);
+        SPIFlashSchedUnLock(sched);
+        SPIFlashSchedNotify(req);
+    }
+    return retVal;
+}
+
+static void SPIFlashSchedAdvance(SPIFlashSched_t* sched) {
+    SPIFlashSchedReq_t* req = sched->active;
+
+    SPIFlashPoll(sched->SPIFlash);
+    if (sched->activeStatus == SPIFLASH_BUSY) {
+        return;
+    }
+    sched->active = NULL;
+    SPIFlashSchedLock(sched);
+    req->done += sched->activeLength;
+    if ((sched->activeStatus != SPIFLASH_SUCCESS) || (req->done == req->size)) {
+        req->group = NULL;
+        SPIFlashSchedComplete(sched, req, sched->activeStatus);
+        SPIFlashSchedUnLock(sched);
+        SPIFlashSchedNotify(req);
+        return;
+    }
+    SPIFlashSchedUnLock(sched);
+}
+
+/* Functions ------------------------------------------------------------------*/
+
+void SPIFlashSchedInit(SPIFlashSched_t* sched, SPIFlash_t* SPIFlash) {
+    memset(sched, 0, sizeof(SPIFlashSched_t));
+    SPIFlashLockInit(&sched->lock);
+    sched->SPIFlash = SPIFlash;
+}
+
+SPIFlashStatus_t SPIFlashSchedSubmit(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    if (SPIFlashSchedCheck(sched, req) != SPIFLASH_SUCCESS) {
+        return SPIFLASH_ERROR;
+    }
+    SPIFlashSchedLock(sched);
+    SPIFlashSchedQueue(sched, req);
+    SPIFlashSchedUnLock(sched);
+    return SPIFLASH_SUCCESS;
+}
+
+#if SPIFLASH_SCHED_ISR_QUEUE > 0
+SPIFlashStatus_t SPIFlashSchedSubmitFromISR(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req) {
+    uint32_t head = __atomic_load_n(&sched->isrHead, __ATOMIC_RELAXED);
+    if (SPIFlashSchedCheck(sched, req) != SPIFLASH_SUCCESS) {
+        return SPIFLASH_ERROR;
+    }
+    if (head - __atomic_load_n(&sched->isrTail, __ATOMIC_ACQUIRE) >= SPIFLASH_SCHED_ISR_QUEUE) {
+        return SPIFLASH_BUSY;
+    }
+    sched->isrRing[head % SPIFLASH_SCHED_ISR_QUEUE] = req;
+    __atomic_store_n(&sched->isrHead, head + 1, __ATOMIC_RELEASE);
+    return SPIFLASH_SUCCESS;
+}
+#endif
+
+SPIFlashStatus_t SPIFlashSchedPoll(SPIFlashSched_t* sched) {
+    SPIFlashSchedReq_t* req;
+
+    if (sched->active != NULL) {
+        SPIFlashSchedAdvance(sched);
+    }
+    SPIFlashSchedLock(sched);
+    SPIFlashSchedDrain(sched);
+    req = SPIFlashSchedPick(sched);
+    SPIFlashSchedUnLock(sched);
+
+    if (req != NULL) {
+        if (req->type == SPIFLASH_SCHED_READ) {
+            SPIFlashSchedRead(sched, req);
+        } else {
+            SPIFlashSchedStart(sched, req);
+        }
+    }
+
+    for (uint8_t ii = 0; ii < SPIFLASH_SCHED_PRIORITIES; ii++) {
+        if (sched->queue[ii] != NULL) {
+            return SPIFLASH_BUSY;
+        }
+    }
+#if SPIFLASH_SCHED_ISR_QUEUE > 0
+    if (__atomic_load_n(&sched->isrHead, __ATOMIC_RELAXED) != sched->isrTail) {
+        return SPIFLASH_BUSY;
+    }
+#endif
+    return SPIFLASH_SUCCESS;
+}
+
+void SPIFlashSchedResetStats(SPIFlashSched_t* sched) {
+    SPIFlashSchedLock(sched);
+    for (uint8_t ii = 0; ii < SPIFLASH_SCHED_PRIORITIES; ii++) {
+        uint32_t depth = sched->stats[ii].depth;
+        memset(&sched->stats[ii], 0, sizeof(SPIFlashSchedStats_t));
+        sched->stats[ii].depth = depth;
+        sched->stats[ii].maxDepth = depth;
+    }
+    SPIFlashSchedUnLock(sched);
+}
@@ -0,0 +1,198 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashSched.h
+ * \author          Andrea Vivani
+ * \brief           Priority-based request scheduler for SPI flash memory shared by several clients
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHSCHED_H__
+#define __SPIFLASHSCHED_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+/*---------- SPIFLASH_SCHED_PRIORITIES  -----------*/
+/* Number of priority levels, 0 being the highest */
+#ifndef SPIFLASH_SCHED_PRIORITIES
+#define SPIFLASH_SCHED_PRIORITIES 4
+#endif
+
+/*---------- SPIFLASH_SCHED_READ_CHUNK  -----------*/
+/* Longest read issued in one go. Longer reads are split so that higher-priority requests can run in between */
+#ifndef SPIFLASH_SCHED_READ_CHUNK
+#define SPIFLASH_SCHED_READ_CHUNK 1024
+#endif
+
+/*---------- SPIFLASH_SCHED_MERGE_SIZE  -----------*/
+/* Size of the buffer used to serve adjacent or overlapping queued reads with a single transfer, 0 to disable */
+#ifndef SPIFLASH_SCHED_MERGE_SIZE
+#define SPIFLASH_SCHED_MERGE_SIZE 256
+#endif
+
+/*---------- SPIFLASH_SCHED_BLOCK_ERASE  -----------*/
+/* 1 to erase aligned 64 KiB runs with one block erase instead of 16 sector erases. Faster overall, but other programs
+ * and erases may then wait for a whole block erase (reads still suspend it when SPIFLASH_SUSPEND is enabled) */
+#ifndef SPIFLASH_SCHED_BLOCK_ERASE
+#define SPIFLASH_SCHED_BLOCK_ERASE 0
+#endif
+
+/*---------- SPIFLASH_SCHED_URGENT  -----------*/
+/* Requests with less than this many us left before their deadline are served ahead of higher priorities */
+#ifndef SPIFLASH_SCHED_URGENT
+#define SPIFLASH_SCHED_URGENT 1000
+#endif
+
+/*---------- SPIFLASH_SCHED_ISR_QUEUE  -----------*/
+/* Slots (power of 2) of the lock-free ring used by SPIFlashSchedSubmitFromISR(), 0 to disable it */
+#ifndef SPIFLASH_SCHED_ISR_QUEUE
+#define SPIFLASH_SCHED_ISR_QUEUE 8
+#endif
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * Scheduler request type
+ */
+typedef enum { SPIFLASH_SCHED_READ = 0, SPIFLASH_SCHED_PROGRAM, SPIFLASH_SCHED_ERASE } SPIFlashSchedType_t;
+
+/**
+ * Scheduler request, owned by the client and linked into the scheduler queues until completion. Fields below next
+ * are private to the scheduler
+ */
+typedef struct SPIFlashSchedReq_s {
+    SPIFlashSchedType_t type;
+    uint8_t priority;                 /* 0 to SPIFLASH_SCHED_PRIORITIES - 1, 0 being the highest */
+    uint32_t address, size;           /* erases must be sector-aligned */
+    uint8_t* data;                    /* destination of reads, source of programs (left untouched) */
+    uint32_t deadline;                /* us from submission, 0 for none */
+    SPIFlashCallback_t callback;      /* called by SPIFlashSchedPoll() on completion, can be NULL */
+    void* context;                    /* user pointer passed to callback */
+    volatile SPIFlashStatus_t status; /* SPIFLASH_BUSY while queued, final status afterwards */
+    struct SPIFlashSchedReq_s* next;
+    struct SPIFlashSchedReq_s* group;
+    uint32_t done, submitTime;
+} SPIFlashSchedReq_t;
+
+/**
+ * Scheduler statistics for one priority level (latencies from submission to completion, in us)
+ */
+typedef struct {
+    uint32_t depth, maxDepth;           /* queued requests, now and at peak */
+    uint32_t completed, merged, missed; /* merged: served by another request's transfer, missed: late on deadline */
+    uint32_t latencyMax;
+    uint64_t latencySum;
+} SPIFlashSchedStats_t;
+
+/**
+ * Scheduler struct
+ */
+typedef struct {
+    SPIFlash_t* SPIFlash;
+    SPIFlashSchedReq_t* queue[SPIFLASH_SCHED_PRIORITIES];
+    SPIFlashSchedReq_t* active; /* request owning the pending asynchronous program/erase */
+    uint32_t activeLength;
+    volatile SPIFlashStatus_t activeStatus;
+    SPIFlashLock_t lock;
+    SPIFlashSchedStats_t stats[SPIFLASH_SCHED_PRIORITIES];
+#if SPIFLASH_SCHED_ISR_QUEUE > 0
+    SPIFlashSchedReq_t* isrRing[SPIFLASH_SCHED_ISR_QUEUE];
+    uint32_t isrHead, isrTail; /* written by the single ISR producer and by SPIFlashSchedPoll() respectively */
+#endif
+#if SPIFLASH_SCHED_MERGE_SIZE > 0
+    uint8_t merge[SPIFLASH_SCHED_MERGE_SIZE];
+#endif
+} SPIFlashSched_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Init scheduler on an initialized SPI flash object
+ *
+ * \param[in]       sched: pointer to scheduler object
+ * \param[in]       SPIFlash: pointer to SPI flash object
+ */
+void SPIFlashSchedInit(SPIFlashSched_t* sched, SPIFlash_t* SPIFlash);
+
+/**
+ * \brief           Queue a request. Requests are served by priority, by deadline within the same priority and in
+ *                  submission order otherwise. Requests touching overlapping ranges are not ordered with respect to
+ *                  each other: wait for completion before submitting a dependent one
+ *
+ * \param[in]       sched: pointer to scheduler object
+ * \param[in]       req: pointer to request, must stay valid until completion
+ *
+ * \return          SPIFLASH_SUCCESS if request is queued, SPIFLASH_ERROR if it is invalid
+ */
+SPIFlashStatus_t SPIFlashSchedSubmit(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req);
+
+#if SPIFLASH_SCHED_ISR_QUEUE > 0
+/**
+ * \brief           Queue a request without taking any lock, for ISRs and other contexts that cannot block. Lock-free
+ *                  single producer: calls must not preempt each other. Requests are moved into the priority queues by
+ *                  the next SPIFlashSchedPoll()
+ *
+ * \param[in]       sched: pointer to scheduler object
+ * \param[in]       req: pointer to request, must stay valid until completion
+ *
+ * \return          SPIFLASH_SUCCESS if request is queued, SPIFLASH_BUSY if the ring is full, SPIFLASH_ERROR if it is
+ *                  invalid
+ */
+SPIFlashStatus_t SPIFlashSchedSubmitFromISR(SPIFlashSched_t* sched, SPIFlashSchedReq_t* req);
+#endif
+
+/**
+ * \brief           Dispatch queued requests, one read chunk, page program or erase at a time. Reads are served while a
+ *                  program/erase is in progress when SPIFLASH_SUSPEND is enabled. Must be called from a single task
+ *
+ * \param[in]       sched: pointer to scheduler object
+ *
+ * \return          SPIFLASH_BUSY while requests are pending, SPIFLASH_SUCCESS when idle
+ */
+SPIFlashStatus_t SPIFlashSchedPoll(SPIFlashSched_t* sched);
+
+/**
+ * \brief           Reset scheduler statistics, except current queue depths
+ *
+ * \param[in]       sched: pointer to scheduler object
+ */
+void SPIFlashSchedResetStats(SPIFlashSched_t* sched);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHSCHED_H__ */
@@ -0,0 +1,710 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashSim.c
+ * \author          Andrea Vivani
+ * \brief           Host-side simulated SPI NOR flash device
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include "SPIFlashSim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define SIM_STATUS1_BUSY  (1 << 0)
+#define SIM_STATUS1_WEL   (1 << 1)
+#define SIM_STATUS2_QE    (1 << 1)
+#define SIM_STATUS2_SUS   (1 << 7)
+#define SIM_STATUS3_ADS   (1 << 0)
+
+#define SIM_BUSY_NONE     0
+#define SIM_BUSY_PROGRAM  1
+#define SIM_BUSY_ERASE    2
+#define SIM_BUSY_REGISTER 3
+
+#define SIM_PAGE_SIZE     256
+#define SIM_SECTOR_SIZE   4096
+#define SIM_HALF_SIZE     32768
+#define SIM_BLOCK_SIZE    65536
+
+#define SIM_SFDP_BFPT     0x30 /* 16 DWORDs */
+#define SIM_SFDP_4BAIT    0x70 /* 2 DWORDs */
+
+/* Private variables ---------------------------------------------------------*/
+
+/* Simulated time is shared by all devices, so that several chips can be busy concurrently */
+static uint64_t simTimePs = 0;
+
+/* Static  functions ----------------------------------------------------------*/
+
+static inline uint64_t SPIFlashSimNow(void) { return simTimePs / 1000; }
+
+static uint32_t SPIFlashSimCapacity(uint8_t capacity) {
+    if ((capacity >= 0x11) && (capacity <= 0x19)) {
+        return 1UL << capacity;
+    }
+    if (capacity == 0x20) {
+        return 1UL << 26;
+    }
+    return 0;
+}
+
+static void SPIFlashSimUpdate(SPIFlashSim_t* sim) {
+    if ((sim->status1 & SIM_STATUS1_BUSY) && (SPIFlashSimNow() >= sim->busyUntil)) {
+        if (sim->status2 & SIM_STATUS2_SUS) {
+            /* Suspend latency elapsed, operation stays pending */
+            sim->status1 &= ~SIM_STATUS1_BUSY;
+        } else {
+            sim->status1 &= ~(SIM_STATUS1_BUSY | SIM_STATUS1_WEL);
+            sim->busyOp = SIM_BUSY_NONE;
+        }
+    }
+}
+
+/* SFDP time field: value rounded up to the smallest unit giving a count that fits countBits */
+static uint32_t SPIFlashSimSFDPTime(uint64_t ns, const uint64_t* units, uint8_t unitNum, uint8_t countBits,
+                                    uint8_t countShift, uint8_t unitShift) {
+    uint64_t count = 1;
+    uint8_t unit;
+    for (unit = 0; unit < unitNum; unit++) {
+        count = (ns + units[unit] - 1) / units[unit];
+        if (count <= (1ULL << countBits)) {
+            break;
+        }
+    }
+    if (unit == unitNum) {
+        unit = unitNum - 1;
+        count = 1ULL << countBits;
+    }
+    if (count == 0) {
+        count = 1;
+    }
+    return ((uint32_t)(count - 1) << countShift) | ((uint32_t)unit << unitShift);
+}
+
+static void SPIFlashSimPutDwords(uint8_t* dst, const uint32_t* dwords, uint32_t count) {
+    for (uint32_t i = 0; i < 4 * count; i++) {
+        dst[i] = (uint8_t)(dwords[i / 4] >> (8 * (i % 4)));
+    }
+}
+
+/* JESD216B tables describing the simulated device: header, BFPT and, with sfdp == 1, the 4-byte address table */
+static void SPIFlashSimBuildSFDP(SPIFlashSim_t* sim) {
+    static const uint64_t eraseUnit[4] = {1000000, 16000000, 128000000, 1000000000};
+    static const uint64_t chipUnit[4] = {16000000, 256000000, 4000000000ULL, 64000000000ULL};
+    static const uint64_t progUnit[2] = {8000, 64000};
+    static const uint64_t byteUnit[2] = {1000, 8000};
+    static const uint64_t latencyUnit[4] = {128, 1000, 8000, 64000};
+    const SPIFlashSimConfig_t* c = &sim->config;
+    uint8_t bait = (c->sfdp == 1);
+    uint32_t header[6] = {0x50444653, 0xFF000106 | ((uint32_t)bait << 16), 0x10010600, 0xFF000000 | SIM_SFDP_BFPT,
+                          0x02010084, 0xFF000000 | SIM_SFDP_4BAIT};
+    uint32_t bfpt[16], tables[2] = {0x00000EFF, 0xFFDC5C21};
+    uint32_t resume = (c->tRS + 63) / 64;
+
+    memset(sim->sfdp, 0xFF, sizeof(sim->sfdp));
+    if ((c->sfdp == 0) || (c->sfdp > 2)) {
+        return;
+    }
+    resume = (resume == 0) ? 0 : ((resume > 16) ? 15 : resume - 1);
+    /* 4 KiB erase 0x20, 1-1-2, 1-2-2, 1-4-4 and 1-1-4 reads, 3 or 4-byte addressing above 16 MiB */
+    bfpt[0] = 0xFF800000 | (0x07UL << 20) | (1UL << 16) | (0x20 << 8) | 0x05
+              | ((sim->size > (1UL << 24)) ? (1UL << 17) : 0);
+    bfpt[1] = sim->size * 8 - 1;
+    bfpt[2] = (0x6B08UL << 16) | 0xEB44;         /* 1-1-4: 8 dummy clocks, 1-4-4: 2 mode + 4 dummy clocks */
+    bfpt[3] = (0xBB80UL << 16) | 0x3B08;         /* 1-2-2: 4 mode clocks, 1-1-2: 8 dummy clocks */
+    bfpt[4] = 0xFFFFFFEE;                        /* no 2-2-2 nor 4-4-4 */
+    bfpt[5] = 0x0000FFFF;
+    bfpt[6] = 0x0000FFFF;
+    bfpt[7] = 0x520F200C;                        /* 4 KiB 0x20, 32 KiB 0x52 */
+    bfpt[8] = 0x0000D810;                        /* 64 KiB 0xD8 */
+    bfpt[9] = 0x07 /* max = 16 x typical */
+              | SPIFlashSimSFDPTime(1000ULL * c->tSE, eraseUnit, 4, 5, 4, 9)
+              | SPIFlashSimSFDPTime(1000ULL * c->tBE32, eraseUnit, 4, 5, 11, 16)
+              | SPIFlashSimSFDPTime(1000ULL * c->tBE, eraseUnit, 4, 5, 18, 23);
+    bfpt[10] = 0x80000085 /* 256 B pages, max = 12 x typical */
+               | SPIFlashSimSFDPTime(1000ULL * c->tPP, progUnit, 2, 5, 8, 13)
+               | SPIFlashSimSFDPTime(1000ULL * c->tBP1, byteUnit, 2, 4, 14, 18)
+               | SPIFlashSimSFDPTime(1000ULL * (c->tPP - c->tBP1) / 255 + 1, byteUnit, 2, 4, 19, 23)
+               | SPIFlashSimSFDPTime(1000000ULL * c->tCE, chipUnit, 4, 5, 24, 29);
+    bfpt[11] = (1UL << 8) | (resume << 20) | (resume << 9)
+               | SPIFlashSimSFDPTime(1000ULL * c->tSUS, latencyUnit, 4, 5, 24, 29)
+               | SPIFlashSimSFDPTime(1000ULL * c->tSUS, latencyUnit, 4, 5, 13, 18);
+    bfpt[12] = 0x757A757A;
+    bfpt[13] = (0xB9UL << 23) | (0xABUL << 15) | (1UL << 2) | 0x03
+               | SPIFlashSimSFDPTime(1000ULL * c->tRES1, latencyUnit, 4, 5, 8, 13);
+    bfpt[14] = 0x05UL << 20;                     /* QE is SR2 bit 1, written with 0x01 and 2 bytes */
+    bfpt[15] = ((0x01UL | (bait ? 0x20 : 0)) << 24) | (1UL << 14) | (1UL << 12) | 0x80;
+
+    SPIFlashSimPutDwords(sim->sfdp, header, bait ? 6 : 4);
+    SPIFlashSimPutDwords(&sim->sfdp[SIM_SFDP_BFPT], bfpt, 16);
+    if (bait) {
+        SPIFlashSimPutDwords(&sim->sfdp[SIM_SFDP_4BAIT], tables, 2);
+    }
+}
+
+static void SPIFlashSimStartBusy(SPIFlashSim_t* sim, uint8_t op, uint64_t durationNs) {
+    sim->status1 |= SIM_STATUS1_BUSY;
+    sim->busyOp = op;
+    sim->busyUntil = SPIFlashSimNow() + durationNs;
+    sim->stats.busyNs += durationNs;
+}
+
+static uint8_t SPIFlashSimIsAllowedWhileBusy(uint8_t opcode) {
+    switch (opcode) {
+        case 0x05: /* READSTATUS1 */
+        case 0x35: /* READSTATUS2 */
+        case 0x15: /* READSTATUS3 */
+        case 0x75: /* SUSPEND */ return 1;
+        default: return 0;
+    }
+}
+
+static uint8_t SPIFlashSimIsAllowedWhileSuspended(uint8_t opcode) {
+    switch (opcode) {
+        case 0x03:
+        case 0x13:
+        case 0x0B:
+        case 0x0C:
+        case 0x3B:
+        case 0x3C:
+        case 0xBB:
+        case 0xBC:
+        case 0x6B:
+        case 0x6C:
+        case 0xEB:
+        case 0xEC: /* Reads */
+        case 0x05:
+        case 0x35:
+        case 0x15: /* Status */
+        case 0x06:
+        case 0x04: /* Write enable/disable */
+        case 0x7A: /* RESUME */
+        case 0x9F:
+        case 0x90:
+        case 0x4B:
+        case 0x5A: /* IDs and SFDP */ return 1;
+        default: return 0;
+    }
+}
+
+static void SPIFlashSimDecode(SPIFlashSim_t* sim, uint8_t opcode) {
+    uint8_t addrBytes = sim->addr4 ? 4 : 3;
+    sim->opcode = opcode;
+    sim->addrBytes = 0;
+    sim->dummyBytes = 0;
+    sim->addrLines = 1;
+    sim->dataLines = 1;
+    sim->address = 0;
+
+    if (SPIFlashSimNow() < sim->readyAt) {
+        /* Command issued before tRES1 elapsed */
+        sim->stats.violations++;
+        sim->opcode = 0;
+        return;
+    }
+    if (sim->powerDown && (opcode != 0xAB)) {
+        sim->opcode = 0;
+        return;
+    }
+    SPIFlashSimUpdate(sim);
+    if ((sim->status1 & SIM_STATUS1_BUSY) && !SPIFlashSimIsAllowedWhileBusy(opcode)) {
+        sim->stats.violations++;
+        sim->opcode = 0;
+        return;
+    }
+    if ((sim->status2 & SIM_STATUS2_SUS) && !SPIFlashSimIsAllowedWhileSuspended(opcode)) {
+        sim->stats.violations++;
+        sim->opcode = 0;
+        return;
+    }
+
+    switch (opcode) {
+        case 0x02: /* PAGEPROG3ADD */
+            memset(sim->page, 0xFF, sizeof(sim->page));
+            sim->addrBytes = addrBytes;
+            break;
+        case 0x12: /* PAGEPROG4ADD */
+            memset(sim->page, 0xFF, sizeof(sim->page));
+            sim->addrBytes = 4;
+            break;
+        case 0x03: /* READDATA3ADD */
+        case 0x13: /* READDATA4ADD */
+            if (sim->config.clock > sim->config.fR) {
+                /* Data is not guaranteed above fR */
+                sim->stats.violations++;
+            }
+            sim->addrBytes = (opcode == 0x13) ? 4 : addrBytes;
+            break;
+        case 0x20: /* SECTORERASE3ADD */
+        case 0x52: /* HALFBLOCKERASE3ADD */
+        case 0xD8: /* BLOCKERASE3ADD */ sim->addrBytes = addrBytes; break;
+        case 0x21: /* SECTORERASE4ADD */
+        case 0x5C: /* HALFBLOCKERASE4ADD */
+        case 0xDC: /* BLOCKERASE4ADD */ sim->addrBytes = 4; break;
+        case 0x0B: /* FASTREAD3ADD */
+            sim->addrBytes = addrBytes;
+            sim->dummyBytes = 1;
+            break;
+        case 0x0C: /* FASTREAD4ADD */
+            sim->addrBytes = 4;
+            sim->dummyBytes = 1;
+            break;
+        case 0x3B: /* DUAL OUTPUT READ 1-1-2 */
+        case 0x3C:
+            sim->addrBytes = (opcode == 0x3C) ? 4 : addrBytes;
+            sim->dummyBytes = 1;
+            sim->dataLines = 2;
+            break;
+        case 0xBB: /* DUAL I/O READ 1-2-2, mode byte on 2 lines */
+        case 0xBC:
+            sim->addrBytes = (opcode == 0xBC) ? 4 : addrBytes;
+            sim->dummyBytes = 1;
+            sim->addrLines = 2;
+            sim->dataLines = 2;
+            break;
+        case 0x6B: /* QUAD OUTPUT READ 1-1-4 */
+        case 0x6C:
+            sim->addrBytes = (opcode == 0x6C) ? 4 : addrBytes;
+            sim->dummyBytes = 1;
+            sim->dataLines = 4;
+            break;
+        case 0xEB: /* QUAD I/O READ 1-4-4, mode byte + 4 dummy clocks on 4 lines */
+        case 0xEC:
+            sim->addrBytes = (opcode == 0xEC) ? 4 : addrBytes;
+            sim->dummyBytes = 3;
+            sim->addrLines = 4;
+            sim->dataLines = 4;
+            break;
+        case 0x32: /* QUAD PAGE PROGRAM 1-1-4 */
+        case 0x34:
+            memset(sim->page, 0xFF, sizeof(sim->page));
+            sim->addrBytes = (opcode == 0x34) ? 4 : addrBytes;
+            sim->dataLines = 4;
+            break;
+        case 0x5A: /* READSFDP */
+            sim->addrBytes = 3;
+            sim->dummyBytes = 1;
+            break;
+        case 0x90: /* ID */ sim->addrBytes = 3; break;
+        case 0xAB: /* RELEASE */ sim->dummyBytes = 3; break;
+        case 0x4B: /* UNIQUEID */ sim->dummyBytes = 4; break;
+        case 0x05:
+        case 0x35:
+        case 0x15: sim->stats.statusReads++; break;
+        default: break;
+    }
+
+    if ((sim->dataLines == 4) && !(sim->status2 & SIM_STATUS2_QE)) {
+        /* Quad commands are ignored while QE is cleared */
+        sim->stats.violations++;
+        sim->opcode = 0;
+    }
+}
+
+static uint8_t SPIFlashSimExpectedLines(SPIFlashSim_t* sim) {
+    if ((sim->count == 0) || (sim->opcode == 0)) {
+        return 1;
+    }
+    if (sim->count <= (uint32_t)(sim->addrBytes + sim->dummyBytes)) {
+        return sim->addrLines;
+    }
+    return sim->dataLines;
+}
+
+static uint8_t SPIFlashSimByte(SPIFlashSim_t* sim, uint8_t in) {
+    uint8_t out = 0xFF;
+    uint32_t n;
+
+    if (sim->count == 0) {
+        SPIFlashSimDecode(sim, in);
+        sim->count++;
+        return out;
+    }
+    if (sim->count <= sim->addrBytes) {
+        sim->address = (sim->address << 8) | in;
+        sim->count++;
+        return out;
+    }
+    if (sim->count <= (uint32_t)(sim->addrBytes + sim->dummyBytes)) {
+        sim->count++;
+        return out;
+    }
+
+    n = sim->count - 1 - sim->addrBytes - sim->dummyBytes;
+    sim->count++;
+    switch (sim->opcode) {
+        case 0x03:
+        case 0x13:
+        case 0x0B:
+        case 0x0C:
+        case 0x3B:
+        case 0x3C:
+        case 0xBB:
+        case 0xBC:
+        case 0x6B:
+        case 0x6C:
+        case 0xEB:
+        case 0xEC:
+            if ((sim->status2 & SIM_STATUS2_SUS)
+                && ((sim->address % sim->size) - sim->busyAddress < sim->busyLength)) {
+                /* Reading the array being erased/programmed while suspended returns undefined data */
+                sim->stats.violations++;
+            }
+            out = sim->memory[sim->address % sim->size];
+            sim->address++;
+            break;
+        case 0x02:
+        case 0x12:
+        case 0x32:
+        case 0x34: sim->page[(sim->address + n) % SIM_PAGE_SIZE] = in; break;
+        case 0x05:
+            SPIFlashSimUpdate(sim);
+            out = sim->status1;
+            break;
+        case 0x35:
+            SPIFlashSimUpdate(sim);
+            out = sim->status2;
+            break;
+        case 0x15: out = sim->status3; break;
+        case 0x9F:
+            if (n == 0) {
+                out = sim->config.manufacturer;
+            } else if (n == 1) {
+                out = sim->config.memType;
+            } else if (n == 2) {
+                out = sim->config.capacity;
+            } else {
+                out = 0x00;
+            }
+            break;
+        case 0x5A:
+            out = (sim->address < sizeof(sim->sfdp)) ? sim->sfdp[sim->address] : 0xFF;
+            sim->address++;
+            break;
+        case 0x90: out = ((sim->address + n) & 0x01) ? (sim->config.capacity - 1) : sim->config.manufacturer; break;
+        case 0xAB: out = sim->config.capacity - 1; break;
+        case 0x4B: out = (uint8_t)(0xA0 + (n & 0x07)); break;
+        case 0x01:
+        case 0x31:
+        case 0x11:
+            if (n < 2) {
+                sim->page[n] = in;
+            }
+            break;
+        default: break;
+    }
+    return out;
+}
+
+static void SPIFlashSimCommit(SPIFlashSim_t* sim) {
+    uint32_t base, n, length = 0;
+    uint8_t wel = sim->status1 & SIM_STATUS1_WEL;
+    uint8_t headerDone = (sim->count >= (uint32_t)(1 + sim->addrBytes));
+
+    if (sim->count == 0) {
+        return;
+    }
+    switch (sim->opcode) {
+        case 0x06: sim->status1 |= SIM_STATUS1_WEL; break;
+        case 0x04: sim->status1 &= ~SIM_STATUS1_WEL; break;
+        case 0x50: sim->writeStatusEn = 1; return;
+        case 0xB7:
+            sim->addr4 = 1;
+            sim->status3 |= SIM_STATUS3_ADS;
+            break;
+        case 0xE9:
+            sim->addr4 = 0;
+            sim->status3 &= ~SIM_STATUS3_ADS;
+            break;
+        case 0x02:
+        case 0x12:
+        case 0x32:
+        case 0x34:
+            n = sim->count - 1 - sim->addrBytes;
+            if (wel && headerDone && (n > 0)) {
+                base = (sim->address % sim->size) & ~(SIM_PAGE_SIZE - 1);
+                for (uint32_t i = 0; i < SIM_PAGE_SIZE; i++) {
+                    sim->memory[base + i] &= sim->page[i];
+                }
+                sim->busyAddress = base;
+                sim->busyLength = SIM_PAGE_SIZE;
+                if (n > SIM_PAGE_SIZE) {
+                    n = SIM_PAGE_SIZE;
+                }
+                sim->stats.programs++;
+                SPIFlashSimStartBusy(sim, SIM_BUSY_PROGRAM,
+                                     1000ULL * (sim->config.tBP1
+                                                + ((uint64_t)(n - 1) * (sim->config.tPP - sim->config.tBP1))
+                                                      / (SIM_PAGE_SIZE - 1)));
+            }
+            break;
+        case 0x20:
+        case 0x21: length = SIM_SECTOR_SIZE; break;
+        case 0x52:
+        case 0x5C: length = SIM_HALF_SIZE; break;
+        case 0xD8:
+        case 0xDC: length = SIM_BLOCK_SIZE; break;
+        case 0x60:
+        case 0xC7:
+            if (wel) {
+                memset(sim->memory, 0xFF, sim->size);
+                sim->busyAddress = 0;
+                sim->busyLength = sim->size;
+                sim->stats.erases++;
+                SPIFlashSimStartBusy(sim, SIM_BUSY_ERASE, 1000000ULL * sim->config.tCE);
+            }
+            break;
+        case 0x01:
+        case 0x31:
+        case 0x11:
+            if ((wel || sim->writeStatusEn) && (sim->count >= 2)) {
+                if (sim->opcode == 0x01) {
+                    sim->status1 = (sim->status1 & 0x03) | (sim->page[0] & 0xFC);
+                    if (sim->count >= 3) {
+                        sim->status2 = (sim->status2 & 0x80) | (sim->page[1] & 0x7B);
+                    }
+                } else if (sim->opcode == 0x31) {
+                    sim->status2 = (sim->status2 & 0x80) | (sim->page[0] & 0x7B);
+                } else {
+                    sim->status3 = (sim->status3 & 0x1B) | (sim->page[0] & 0xE4);
+                }
+                if (!sim->writeStatusEn) {
+                    SPIFlashSimStartBusy(sim, SIM_BUSY_REGISTER, 1000ULL * sim->config.tW);
+                }
+            }
+            break;
+        case 0x75:
+            SPIFlashSimUpdate(sim);
+            if ((sim->status1 & SIM_STATUS1_BUSY) && !(sim->status2 & SIM_STATUS2_SUS)
+                && (sim->busyOp != SIM_BUSY_REGISTER)) {
+                if (SPIFlashSimNow() < sim->resumedAt + 1000ULL * sim->config.tRS) {
+                    /* Suspend issued before tRS elapsed since the last resume */
+                    sim->stats.violations++;
+                }
+                sim->suspendRemaining = sim->busyUntil - SPIFlashSimNow();
+                sim->status2 |= SIM_STATUS2_SUS;
+                sim->busyUntil = SPIFlashSimNow() + 1000ULL * sim->config.tSUS;
+            }
+            break;
+        case 0x7A:
+            SPIFlashSimUpdate(sim);
+            if ((sim->status2 & SIM_STATUS2_SUS) && !(sim->status1 & SIM_STATUS1_BUSY)) {
+                sim->status2 &= ~SIM_STATUS2_SUS;
+                sim->status1 |= SIM_STATUS1_BUSY;
+                sim->busyUntil = SPIFlashSimNow() + sim->suspendRemaining;
+                sim->resumedAt = SPIFlashSimNow();
+            }
+            break;
+        case 0xB9:
+            if (!(sim->status1 & SIM_STATUS1_BUSY)) {
+                sim->powerDown = 1;
+            }
+            break;
+        case 0xAB:
+            if (sim->powerDown) {
+                sim->powerDown = 0;
+                sim->readyAt = SPIFlashSimNow() + 1000ULL * sim->config.tRES1;
+            }
+            break;
+        default: break;
+    }
+
+    if (length && wel && headerDone) {
+        base = (sim->address % sim->size) & ~(length - 1);
+        memset(&sim->memory[base], 0xFF, length);
+        sim->busyAddress = base;
+        sim->busyLength = length;
+        sim->stats.erases++;
+        SPIFlashSimStartBusy(sim, SIM_BUSY_ERASE,
+                             1000ULL
+                                 * ((length == SIM_SECTOR_SIZE) ? sim->config.tSE
+                                    : (length == SIM_HALF_SIZE) ? sim->config.tBE32
+                                                                : sim->config.tBE));
+    }
+    sim->writeStatusEn = 0;
+}
+
+/* Functions -----------------------------------------------------------------*/
+
+void SPIFlashSimDefaultConfig(SPIFlashSimConfig_t* config) {
+    memset(config, 0, sizeof(SPIFlashSimConfig_t));
+    config->manufacturer = 0xEF;
+    config->memType = 0x40;
+    config->capacity = 0x18;
+    config->clock = 50000000;
+    config->fR = 50000000;
+    config->lines = 1;
+    config->tCS = 500;
+    config->tBP1 = 30;
+    config->tPP = 400;
+    config->tSE = 45000;
+    config->tBE32 = 120000;
+    config->tBE = 150000;
+    config->tCE = 40000;
+    config->tW = 10000;
+    config->tSUS = 20;
+    config->tRS = 100;
+    config->tRES1 = 3;
+    config->sfdp = 1;
+}
+
+SPIFlashStatus_t SPIFlashSimInit(SPIFlashSim_t* sim, const SPIFlashSimConfig_t* config, uint8_t* memory) {
+    if ((sim == NULL) || (config == NULL) || (memory == NULL) || (config->clock == 0)
+        || (SPIFlashSimCapacity(config->capacity) == 0) || (config->tPP < config->tBP1)
+        || ((config->lines != 1) && (config->lines != 2) && (config->lines != 4))) {
+        return SPIFLASH_ERROR;
+    }
+    memset(sim, 0, sizeof(SPIFlashSim_t));
+    sim->config = *config;
+    sim->size = SPIFlashSimCapacity(config->capacity);
+    sim->memory = memory;
+    sim->cs = 1;
+    memset(sim->memory, 0xFF, sim->size);
+    SPIFlashSimBuildSFDP(sim);
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashSimInitFile(SPIFlashSim_t* sim, const SPIFlashSimConfig_t* config, const char* path) {
+    FILE* f;
+    uint8_t* memory;
+    if ((config == NULL) || (path == NULL) || (SPIFlashSimCapacity(config->capacity) == 0)) {
+        return SPIFLASH_ERROR;
+    }
+    memory = malloc(SPIFlashSimCapacity(config->capacity));
+    if (SPIFlashSimInit(sim, config, memory) == SPIFLASH_ERROR) {
+        free(memory);
+        return SPIFLASH_ERROR;
+    }
+    f = fopen(path, "rb");
+    if (f != NULL) {
+        size_t read = fread(sim->memory, 1, sim->size, f);
+        (void)read;
+        fclose(f);
+    }
+    sim->file = strdup(path);
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashSimSync(SPIFlashSim_t* sim) {
+    FILE* f;
+    size_t written;
+    if (sim->file == NULL) {
+        return SPIFLASH_SUCCESS;
+    }
+    f = fopen((const char*)sim->file, "wb");
+    if (f == NULL) {
+        return SPIFLASH_ERROR;
+    }
+    written = fwrite(sim->memory, 1, sim->size, f);
+    fclose(f);
+    return (written == sim->size) ? SPIFLASH_SUCCESS : SPIFLASH_ERROR;
+}
+
+void SPIFlashSimDeInit(SPIFlashSim_t* sim) {
+    if (sim->file != NULL) {
+        SPIFlashSimSync(sim);
+        free(sim->file);
+        free(sim->memory);
+    }
+    memset(sim, 0, sizeof(SPIFlashSim_t));
+}
+
+void SPIFlashSimResetStats(SPIFlashSim_t* sim) { memset(&sim->stats, 0, sizeof(SPIFlashSimStats_t)); }
+
+void SPIFlashSimWritePin(void* sim, uint8_t state) {
+    SPIFlashSim_t* dev = (SPIFlashSim_t*)sim;
+    if (state == dev->cs) {
+        return;
+    }
+    if (dev->dmaUntil > simTimePs) {
+        /* CS toggled in the middle of a background transfer */
+        dev->stats.violations++;
+    }
+    dev->cs = state;
+    if (state) {
+        SPIFlashSimCommit(dev);
+    } else {
+        dev->count = 0;
+        dev->stats.transactions++;
+        SPIFlashSimAdvanceNs(dev->config.tCS);
+        dev->stats.busNs += dev->config.tCS;
+    }
+}
+
+SPIFlashStatus_t SPIFlashSimTransmitReceive(void* sim, const uint8_t* Tx, uint8_t* Rx, uint32_t size) {
+    return SPIFlashSimTransfer(sim, Tx, Rx, size, 1);
+}
+
+SPIFlashStatus_t SPIFlashSimTransfer(void* sim, const uint8_t* Tx, uint8_t* Rx, uint32_t size, uint8_t lines) {
+    SPIFlashSim_t* dev = (SPIFlashSim_t*)sim;
+    uint64_t bytePs = 8000000000000ULL / ((uint64_t)dev->config.clock * lines);
+    if ((lines > dev->config.lines) || (dev->dmaUntil > simTimePs)) {
+        /* IO2/IO3 (or IO1) not wired, or bus still owned by a background transfer */
+        dev->stats.violations++;
+    }
+    for (uint32_t i = 0; i < size; i++) {
+        uint8_t out = 0xFF;
+        simTimePs += bytePs;
+        if (dev->cs == 0) {
+            if (lines != SPIFlashSimExpectedLines(dev)) {
+                dev->stats.violations++;
+            }
+            out = SPIFlashSimByte(dev, (Tx != NULL) ? Tx[i] : 0xFF);
+        }
+        if (Rx != NULL) {
+            Rx[i] = out;
+        }
+    }
+    dev->stats.busBytes += size;
+    dev->stats.busNs += (bytePs * size) / 1000;
+    return SPIFLASH_SUCCESS;
+}
+
+SPIFlashStatus_t SPIFlashSimTransferDMA(void* sim, uint8_t* Rx, uint32_t size, uint8_t lines) {
+    SPIFlashSim_t* dev = (SPIFlashSim_t*)sim;
+    uint64_t start = simTimePs;
+    SPIFlashSimTransfer(sim, NULL, Rx, size, lines);
+    dev->dmaUntil = simTimePs;
+    simTimePs = start;
+    return SPIFLASH_SUCCESS;
+}
+
+uint8_t SPIFlashSimDMABusy(void* sim) { return ((SPIFlashSim_t*)sim)->dmaUntil > simTimePs; }
+
+void SPIFlashSimDelay(uint32_t ms) { SPIFlashSimAdvanceNs(1000000ULL * ms); }
+
+uint32_t SPIFlashSimGetTick(void) { return (uint32_t)(SPIFlashSimNow() / 1000000ULL); }
+
+uint64_t SPIFlashSimGetTimeNs(void) { return SPIFlashSimNow(); }
+
+void SPIFlashSimAdvanceNs(uint64_t ns) { simTimePs += 1000ULL * ns; }
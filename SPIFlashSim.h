@@ -0,0 +1,233 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashSim.h
+ * \author          Andrea Vivani
+ * \brief           Host-side simulated SPI NOR flash device
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __SPIFLASHSIM_H__
+#define __SPIFLASHSIM_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include "SPIFlash.h"
+
+/* Typedefs ------------------------------------------------------------------*/
+
+/**
+ * Simulated device configuration (times in us unless noted)
+ */
+typedef struct {
+    uint8_t manufacturer, memType, capacity; /* JEDEC ID bytes */
+    uint32_t clock;                          /* SPI clock in Hz */
+    uint32_t fR;                             /* maximum clock for READ DATA (0x03/0x13) in Hz */
+    uint8_t lines;                           /* IO lines wired to the host (1, 2 or 4) */
+    uint32_t tCS;                            /* per-transaction overhead (CS setup/hold + driver) in ns */
+    uint32_t tBP1;                           /* first byte program time */
+    uint32_t tPP;                            /* full page program time */
+    uint32_t tSE;                            /* 4 KiB sector erase time */
+    uint32_t tBE32;                          /* 32 KiB block erase time */
+    uint32_t tBE;                            /* 64 KiB block erase time */
+    uint32_t tCE;                            /* chip erase time, in ms */
+    uint32_t tW;                             /* non-volatile status register write time */
+    uint32_t tSUS;                           /* suspend latency */
+    uint32_t tRS;                            /* minimum time from resume to the next suspend */
+    uint32_t tRES1;                          /* release from power-down latency */
+    uint8_t sfdp;                            /* SFDP tables: 0 none, 1 BFPT and 4-byte address table, 2 BFPT only */
+} SPIFlashSimConfig_t;
+
+/**
+ * Simulated device statistics
+ */
+typedef struct {
+    uint32_t transactions, programs, erases, statusReads, violations;
+    uint64_t busBytes, busNs, busyNs;
+} SPIFlashSimStats_t;
+
+/**
+ * Simulated device struct
+ */
+typedef struct {
+    SPIFlashSimConfig_t config;
+    SPIFlashSimStats_t stats;
+    uint8_t* memory;
+    uint32_t size;
+    void* file;
+    uint64_t busyUntil, suspendRemaining, readyAt, resumedAt;
+    uint64_t dmaUntil; /* end of the background transfer started by SPIFlashSimTransferDMA(), in ps */
+    uint8_t status1, status2, status3;
+    uint8_t cs, addr4, powerDown, writeStatusEn;
+    uint8_t opcode, addrBytes, dummyBytes, addrLines, dataLines;
+    uint32_t address, count;
+    uint32_t busyAddress, busyLength;
+    uint8_t busyOp;
+    uint8_t page[256];
+    uint8_t sfdp[128]; /* SFDP area, built from config */
+} SPIFlashSim_t;
+
+/* Function prototypes --------------------------------------------------------*/
+
+/**
+ * \brief           Fill a configuration with W25Q128JV-like typical values
+ *
+ * \param[out]      config: pointer to configuration to be filled
+ */
+void SPIFlashSimDefaultConfig(SPIFlashSimConfig_t* config);
+
+/**
+ * \brief           Init a RAM-backed simulated device
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[in]       config: pointer to device configuration
+ * \param[in]       memory: pointer to backing buffer, at least as large as the JEDEC capacity. Filled with 0xFF (erased)
+ *
+ * \return          SPIFLASH_SUCCESS if device is initialized, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashSimInit(SPIFlashSim_t* sim, const SPIFlashSimConfig_t* config, uint8_t* memory);
+
+/**
+ * \brief           Init a file-backed simulated device. Missing or short files are padded with 0xFF
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[in]       config: pointer to device configuration
+ * \param[in]       path: path of the image file
+ *
+ * \return          SPIFLASH_SUCCESS if device is initialized, SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashSimInitFile(SPIFlashSim_t* sim, const SPIFlashSimConfig_t* config, const char* path);
+
+/**
+ * \brief           Write back the memory content of a file-backed device
+ *
+ * \param[in]       sim: pointer to simulated device object
+ *
+ * \return          SPIFLASH_SUCCESS if image is written (or device is RAM-backed), SPIFLASH_ERROR otherwise
+ */
+SPIFlashStatus_t SPIFlashSimSync(SPIFlashSim_t* sim);
+
+/**
+ * \brief           De-init simulated device, syncing and releasing file-backed memory
+ *
+ * \param[in]       sim: pointer to simulated device object
+ */
+void SPIFlashSimDeInit(SPIFlashSim_t* sim);
+
+/**
+ * \brief           Reset simulated device statistics
+ *
+ * \param[in]       sim: pointer to simulated device object
+ */
+void SPIFlashSimResetStats(SPIFlashSim_t* sim);
+
+/**
+ * \brief           Drive the simulated chip-select line
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[in]       state: 0 to select the device, 1 to deselect it
+ */
+void SPIFlashSimWritePin(void* sim, uint8_t state);
+
+/**
+ * \brief           Full-duplex transfer with the simulated device, advancing the simulated clock
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[in]       Tx: bytes to be sent, NULL to send dummy bytes
+ * \param[out]      Rx: received bytes, NULL to discard them
+ * \param[in]       size: number of bytes
+ *
+ * \return          SPIFLASH_SUCCESS
+ */
+SPIFlashStatus_t SPIFlashSimTransmitReceive(void* sim, const uint8_t* Tx, uint8_t* Rx, uint32_t size);
+
+/**
+ * \brief           Multi-line transfer with the simulated device. Each byte takes 8 / lines clock cycles
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[in]       Tx: bytes to be sent, NULL to send dummy bytes
+ * \param[out]      Rx: received bytes, NULL to discard them
+ * \param[in]       size: number of bytes
+ * \param[in]       lines: number of IO lines used by this transfer (1, 2 or 4)
+ *
+ * \return          SPIFLASH_SUCCESS
+ */
+SPIFlashStatus_t SPIFlashSimTransfer(void* sim, const uint8_t* Tx, uint8_t* Rx, uint32_t size, uint8_t lines);
+
+/**
+ * \brief           Receive-only transfer running in the background, as by DMA. Data is available immediately, but the
+ *                  simulated clock is not advanced: the transfer is in progress until SPIFlashSimDMABusy() returns 0,
+ *                  and any other bus activity on the device until then is a violation
+ *
+ * \param[in]       sim: pointer to simulated device object
+ * \param[out]      Rx: received bytes
+ * \param[in]       size: number of bytes
+ * \param[in]       lines: number of IO lines used by this transfer (1, 2 or 4)
+ *
+ * \return          SPIFLASH_SUCCESS
+ */
+SPIFlashStatus_t SPIFlashSimTransferDMA(void* sim, uint8_t* Rx, uint32_t size, uint8_t lines);
+
+/**
+ * \brief           Check whether a transfer started by SPIFlashSimTransferDMA() is still in progress
+ *
+ * \param[in]       sim: pointer to simulated device object
+ *
+ * \return          1 while in progress, 0 otherwise
+ */
+uint8_t SPIFlashSimDMABusy(void* sim);
+
+/**
+ * \brief           Advance simulated time by the given number of ms
+ */
+void SPIFlashSimDelay(uint32_t ms);
+
+/**
+ * \brief           Simulated time in ms
+ */
+uint32_t SPIFlashSimGetTick(void);
+
+/**
+ * \brief           Simulated time in ns
+ */
+uint64_t SPIFlashSimGetTimeNs(void);
+
+/**
+ * \brief           Advance simulated time by the given number of ns
+ */
+void SPIFlashSimAdvanceNs(uint64_t ns);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*  __SPIFLASHSIM_H__ */
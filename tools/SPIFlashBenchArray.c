@@ -0,0 +1,178 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchArray.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of striped multi-chip arrays
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchArray \
+ *         tools/SPIFlashBenchArray.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchArray
+ * Erases, writes and reads back 1 MiB on arrays of 1, 2 and 4 simulated W25Q128s sharing one simulated bus, for
+ * 256 B, 4 KiB and 64 KiB stripes, next to the plain single-chip API. The exit status is non-zero if data is wrong,
+ * if invalid arrays or requests are accepted or if the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashArray.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_CHIPS  4
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_LENGTH (1UL << 20)
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_CHIPS][BENCH_SIZE];
+static uint8_t source[BENCH_LENGTH], destination[BENCH_LENGTH];
+static SPIFlashSim_t sim[BENCH_CHIPS];
+static SPIFlash_t flash[BENCH_CHIPS];
+static SPIFlash_t* members[BENCH_CHIPS];
+static const uint32_t stripes[] = {256, 4096, 65536};
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint32_t BenchViolations(void) {
+    uint32_t violations = 0;
+    for (uint32_t i = 0; i < BENCH_CHIPS; i++) {
+        violations += sim[i].stats.violations;
+    }
+    return violations;
+}
+
+static double BenchElapsedMs(uint64_t start) { return (double)(SPIFlashSimGetTimeNs() - start) / 1e6; }
+
+static int BenchRun(uint32_t stripe, uint8_t count) {
+    SPIFlashArray_t array;
+    double erase, write, read;
+    uint64_t start;
+    int fail;
+
+    fail = (SPIFlashArrayInit(&array, members, count, stripe) != SPIFLASH_SUCCESS);
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashArrayErase(&array, 0, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    erase = BenchElapsedMs(start);
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashArrayWrite(&array, 0, source, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    write = BenchElapsedMs(start);
+    memset(destination, 0, sizeof(destination));
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashArrayRead(&array, 0, destination, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    read = BenchElapsedMs(start);
+    fail |= (memcmp(source, destination, BENCH_LENGTH) != 0);
+    printf("stripe %5u x%u: erase 1 MiB %6.0f ms, write %5.0f KiB/s, read %5.0f KiB/s %s\n", stripe, count, erase,
+           1024 / (write / 1e3), 1024 / (read / 1e3), fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Unaligned transfers over a member count that is not a power of 2 */
+static int BenchUnaligned(void) {
+    SPIFlashArray_t array;
+    int fail;
+
+    fail = (SPIFlashArrayInit(&array, members, 3, 512) != SPIFLASH_SUCCESS)
+           || (SPIFlashArrayErase(&array, 0, array.eraseSize * 4) != SPIFLASH_SUCCESS)
+           || (SPIFlashArrayWrite(&array, 1000, source, 30000) != SPIFLASH_SUCCESS);
+    memset(destination, 0, 30000);
+    fail |= (SPIFlashArrayRead(&array, 1000, destination, 30000) != SPIFLASH_SUCCESS);
+    fail |= (memcmp(source, destination, 30000) != 0);
+    fail |= (SPIFlashArrayErase(&array, 4096, 4096) != SPIFLASH_ERROR);
+    printf("3 members, 512 B stripe, unaligned 30000 B at 1000: %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Four 8 Gbit members do not fit the 32-bit address space, four 4 Gbit ones do */
+static int BenchCapacity(void) {
+    SPIFlash_t large[BENCH_CHIPS];
+    SPIFlash_t* largeMembers[BENCH_CHIPS];
+    SPIFlashArray_t array;
+    int fail;
+
+    for (uint32_t i = 0; i < BENCH_CHIPS; i++) {
+        large[i] = flash[i];
+        large[i].pageNum = (512UL << 20) / 256;
+        largeMembers[i] = &large[i];
+    }
+    fail = (SPIFlashArrayInit(&array, largeMembers, BENCH_CHIPS, 4096) != SPIFLASH_SUCCESS)
+           || (array.size != 0x80000000UL);
+    for (uint32_t i = 0; i < BENCH_CHIPS; i++) {
+        large[i].pageNum = (1UL << 30) / 256;
+    }
+    fail |= (SPIFlashArrayInit(&array, largeMembers, BENCH_CHIPS, 4096) != SPIFLASH_ERROR);
+    printf("4 x 4 Gbit accepted, 4 x 8 Gbit rejected: %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    uint64_t start;
+    double erase, write;
+    int fail = 0;
+
+    SPIFlashSimDefaultConfig(&config);
+    for (uint32_t i = 0; i < BENCH_CHIPS; i++) {
+        fail |= (SPIFlashSimInit(&sim[i], &config, memory[i]) != SPIFLASH_SUCCESS)
+                || (SPIFlashInit(&flash[i], &sim[i], &sim[i], 0) != SPIFLASH_SUCCESS);
+        members[i] = &flash[i];
+    }
+    srand(1);
+    for (uint32_t i = 0; i < BENCH_LENGTH; i++) {
+        source[i] = (uint8_t)rand();
+    }
+
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashEraseRange(&flash[0], 0, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    erase = BenchElapsedMs(start);
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashWriteAddress(&flash[0], 0, source, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    write = BenchElapsedMs(start);
+    printf("plain API, 1 chip: erase 1 MiB %6.0f ms, write %5.0f KiB/s\n", erase, 1024 / (write / 1e3));
+
+    for (uint32_t s = 0; s < sizeof(stripes) / sizeof(stripes[0]); s++) {
+        for (uint8_t count = 1; count <= BENCH_CHIPS; count *= 2) {
+            fail |= BenchRun(stripes[s], count);
+        }
+    }
+    fail |= BenchUnaligned();
+    fail |= BenchCapacity();
+    printf("violations %u\n", BenchViolations());
+    return fail || (BenchViolations() != 0);
+}
@@ -0,0 +1,182 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchCRC.c
+ * \author          Andrea Vivani
+ * \brief           Benchmark and checks of the CRC-32 layer
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root, once per implementation:
+ *     for s in 0 1 8; do
+ *         cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -DSPIFLASH_CRC_SLICES=$s \
+ *             -o SPIFlashBenchCRC tools/SPIFlashBenchCRC.c SPIFlash*.c -lpthread && ./SPIFlashBenchCRC
+ *     done
+ * Checks SPIFlashCRC32() against the CRC-32 check value and a bitwise reference over unaligned buffers, including
+ * chained calls, then measures its host throughput. On the simulator, times SPIFLASH_OPT_VERIFY and
+ * SPIFlashCRCRegion() and checks that corrupted or erased records are rejected. The exit status is non-zero if a
+ * check fails.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "SPIFlash.h"
+#include "SPIFlashCRC.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_LENGTH (1UL << 20)
+#define BENCH_CHECK  0xCBF43926 /* CRC-32 of "123456789" */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static uint8_t buffer[BENCH_LENGTH];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Reflected CRC-32, polynomial 0xEDB88320, one bit at a time, with the zlib crc32() chaining convention */
+static uint32_t BenchReference(uint32_t crc, const uint8_t* data, uint32_t size) {
+    crc = ~crc;
+    while (size--) {
+        crc ^= *data++;
+        for (uint32_t k = 0; k < 8; k++) {
+            crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+        }
+    }
+    return ~crc;
+}
+
+static double BenchNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static int BenchCompute(void) {
+    uint32_t whole, chained, seed = 1;
+    volatile uint32_t sink = 0;
+    uint32_t reps = SPIFLASH_CRC_SLICES ? 200 : 20;
+    double start, seconds;
+    int fail = 0, result;
+
+    result = (SPIFlashCRC32(0, "123456789", 9) != BENCH_CHECK);
+    printf("slices %d: check value %08X %s\n", SPIFLASH_CRC_SLICES, SPIFlashCRC32(0, "123456789", 9),
+           result ? "FAIL" : "ok");
+    fail |= result;
+
+    for (uint32_t i = 0; i < BENCH_LENGTH; i++) {
+        buffer[i] = (uint8_t)(i * 131 + 7);
+    }
+    /* Every start alignment and a spread of lengths, split at arbitrary points */
+    result = 0;
+    for (uint32_t i = 0; i < 2000; i++) {
+        uint32_t offset, size, split;
+        seed = seed * 1103515245 + 12345;
+        offset = (seed >> 8) % 64;
+        size = (i < 100) ? i : (seed >> 4) % 70000;
+        split = size ? (seed >> 12) % size : 0;
+        whole = SPIFlashCRC32(0, &buffer[offset], size);
+        chained = SPIFlashCRC32(SPIFlashCRC32(0, &buffer[offset], split), &buffer[offset + split], size - split);
+        result |= (whole != BenchReference(0, &buffer[offset], size)) || (chained != whole);
+    }
+    whole = SPIFlashCRC32(0, buffer, BENCH_LENGTH);
+    chained = SPIFlashCRC32(SPIFlashCRC32(0, buffer, 1000), &buffer[1000], BENCH_LENGTH - 1000);
+    result |= (whole != BenchReference(0, buffer, BENCH_LENGTH)) || (chained != whole);
+    printf("unaligned and chained calls match the reference: %s\n", result ? "FAIL" : "ok");
+    fail |= result;
+
+    start = BenchNow();
+    for (uint32_t r = 0; r < reps; r++) {
+        sink += SPIFlashCRC32(r, buffer, BENCH_LENGTH);
+    }
+    seconds = BenchNow() - start;
+    printf("host throughput %.0f MB/s, 64 KiB in %.1f us\n", reps * (double)BENCH_LENGTH / seconds / 1e6,
+           seconds / reps / 16 * 1e6);
+    (void)sink;
+    return fail;
+}
+
+static int BenchFlash(void) {
+    SPIFlashSimConfig_t config;
+    uint8_t record[300];
+    uint32_t crc = 0, size;
+    uint64_t start;
+    double plain, verified;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashWriteAddress(&flash, 0, buffer, 65536) != SPIFLASH_SUCCESS);
+    plain = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+    SPIFlashSetOptions(&flash, SPIFLASH_OPT_VERIFY);
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashWriteAddress(&flash, 65536, buffer, 65536) != SPIFLASH_SUCCESS);
+    verified = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+    printf("64 KiB write %.2f ms, with SPIFLASH_OPT_VERIFY %.2f ms (+%.1f%%)\n", plain, verified,
+           100 * (verified / plain - 1));
+
+    /* Programming can only clear bits: verification must catch data written over unerased memory */
+    memset(&memory[200000], 0x00, 16);
+    fail |= (SPIFlashWriteAddress(&flash, 200000, buffer, 16) != SPIFLASH_ERROR);
+    SPIFlashSetOptions(&flash, 0);
+
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashCRCRegion(&flash, 0, 65536, &crc) != SPIFLASH_SUCCESS);
+    fail |= (crc != SPIFlashCRC32(0, buffer, 65536));
+    printf("SPIFlashCRCRegion() of 64 KiB: %.2f ms\n", (double)(SPIFlashSimGetTimeNs() - start) / 1e6);
+
+    fail |= (SPIFlashCRCWrite(&flash, 300000 - 4, buffer, 250) != SPIFLASH_SUCCESS);
+    fail |= (SPIFlashCRCRead(&flash, 300000 - 4, record, sizeof(record), &size) != SPIFLASH_SUCCESS);
+    fail |= (size != 250) || memcmp(record, buffer, 250);
+    memory[300000 + 100] ^= 0x10;
+    fail |= (SPIFlashCRCRead(&flash, 300000 - 4, record, sizeof(record), &size) != SPIFLASH_ERROR);
+    fail |= (SPIFlashCRCRead(&flash, 400000, record, sizeof(record), &size) != SPIFLASH_ERROR);
+    printf("verify failure, record round trip, bit flip and erased record: %s, violations %u\n",
+           fail ? "FAIL" : "ok", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    int fail = BenchCompute();
+    fail |= BenchFlash();
+    return fail;
+}
@@ -0,0 +1,116 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchErase.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of the range erase planner
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchErase \
+ *         tools/SPIFlashBenchErase.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchErase
+ * Times SPIFlashEraseRange() over ranges of different sizes and alignments on the simulated W25Q128 and compares it
+ * with erasing the same range one sector at a time. The exit status is non-zero if a range is not erased exactly,
+ * if invalid ranges are accepted or if the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE (1UL << 24)
+
+/* Typedefs ------------------------------------------------------------------*/
+
+typedef struct {
+    uint32_t address, length;
+} BenchRange_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static const BenchRange_t ranges[] = {
+    {0, 4096},  {0, 32768},         {0, 65536},   {4096, 300 * 1024}, {65536, 300 * 1024},
+    {0, 1 << 20}, {12288, 1 << 20}, {0, BENCH_SIZE},
+};
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Only the range must read as erased */
+static int BenchCheck(uint32_t address, uint32_t length) {
+    for (uint32_t i = 0; i < BENCH_SIZE; i++) {
+        if (memory[i] != (((i >= address) && (i - address < length)) ? 0xFF : 0x00)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+
+    printf("range                    erases       time  sector-only\n");
+    for (uint32_t i = 0; i < sizeof(ranges) / sizeof(ranges[0]); i++) {
+        uint64_t start;
+        double ms;
+        int result;
+
+        memset(memory, 0, sizeof(memory));
+        SPIFlashSimResetStats(&sim);
+        start = SPIFlashSimGetTimeNs();
+        result = (SPIFlashEraseRange(&flash, ranges[i].address, ranges[i].length) != SPIFLASH_SUCCESS);
+        ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+        result |= BenchCheck(ranges[i].address, ranges[i].length);
+        printf("%6u KiB @%5u KiB  %6u  %8.0f ms  %8.0f ms  %s\n", ranges[i].length / 1024, ranges[i].address / 1024,
+               sim.stats.erases, ms, (ranges[i].length / 4096) * config.tSE / 1e3, result ? "FAIL" : "ok");
+        fail |= result;
+    }
+
+    fail |= (SPIFlashEraseRange(&flash, 100, 4096) != SPIFLASH_ERROR);
+    fail |= (SPIFlashEraseRange(&flash, BENCH_SIZE - 4096, 8192) != SPIFLASH_ERROR);
+    printf("unaligned and out-of-range requests rejected, violations %u %s\n", sim.stats.violations,
+           fail ? "FAIL" : "ok");
+    return fail || (sim.stats.violations != 0);
+}
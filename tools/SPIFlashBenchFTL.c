@@ -0,0 +1,297 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchFTL.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark and checks of the flash translation layer
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchFTL \
+ *         tools/SPIFlashBenchFTL.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchFTL [writes]
+ * Add -DSPIFLASH_FTL_SECTORS=4096 to also time the mount of the whole 16 MiB chip. Times are simulated W25Q128JV
+ * times. The exit status is non-zero if a check fails.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashFTL.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_CAPACITY 0x18 /* JEDEC capacity code of the simulated chip, 16 MiB */
+#define BENCH_SIZE     (1UL << 24)
+#define BENCH_PHYSICAL 256
+#define BENCH_LOGICAL  250
+#define BENCH_HOT      4  /* logical sectors receiving 90% of the writes */
+#define BENCH_STATE    14 /* offset of the state byte in the sector header */
+#define BENCH_TRIMMED  0xFFFFFFFF
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static SPIFlashFTL_t ftl;
+static uint32_t written[BENCH_LOGICAL]; /* version last written to each logical sector */
+static uint32_t inPlace[BENCH_PHYSICAL]; /* erases of each sector when rewriting in place, without the FTL */
+static uint32_t seed = 12345;
+
+/* Private functions ---------------------------------------------------------*/
+
+static int BenchInit(void) {
+    SPIFlashSimConfig_t config;
+    SPIFlashSimDefaultConfig(&config);
+    config.capacity = BENCH_CAPACITY;
+    memset(&flash, 0, sizeof(flash));
+    return (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+}
+
+static void BenchFill(uint8_t* data, uint32_t logical, uint32_t version) {
+    for (uint32_t i = 0; i < SPIFLASH_FTL_SECTOR_SIZE; i++) {
+        data[i] = (uint8_t)(logical * 13 + version * 7 + i);
+    }
+}
+
+static uint32_t BenchRandom(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+/* Run background work to completion, as an idle task would */
+static SPIFlashStatus_t BenchIdle(void) {
+    SPIFlashStatus_t status;
+    while ((status = SPIFlashFTLPoll(&ftl)) == SPIFLASH_BUSY) {
+        SPIFlashSimAdvanceNs(100000);
+    }
+    return status;
+}
+
+static double BenchMount(uint32_t count, uint32_t logical, int* fail) {
+    uint64_t start = SPIFlashSimGetTimeNs();
+    *fail |= (SPIFlashFTLMount(&ftl, &flash, 0, count, logical) != SPIFLASH_SUCCESS);
+    return (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+}
+
+static uint32_t BenchVerify(void) {
+    uint8_t data[SPIFLASH_FTL_SECTOR_SIZE], expected[SPIFLASH_FTL_SECTOR_SIZE];
+    uint32_t bad = 0;
+
+    for (uint32_t logical = 0; logical < BENCH_LOGICAL; logical++) {
+        if (written[logical] == BENCH_TRIMMED) {
+            memset(expected, 0xFF, sizeof(expected));
+        } else {
+            BenchFill(expected, logical, written[logical]);
+        }
+        if ((SPIFlashFTLRead(&ftl, logical, 0, data, SPIFLASH_FTL_SECTOR_SIZE) != SPIFLASH_SUCCESS)
+            || memcmp(data, expected, SPIFLASH_FTL_SECTOR_SIZE)) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static void BenchWear(const char* name, const uint32_t* erases, uint32_t count) {
+    uint32_t max = 0, min = UINT32_MAX;
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        max = (erases[i] > max) ? erases[i] : max;
+        min = (erases[i] < min) ? erases[i] : min;
+        sum += erases[i];
+    }
+    printf("%-20s erase count max %u min %u mean %.1f\n", name, max, min, (double)sum / count);
+}
+
+/* Hot-spot workload: 90% of the writes go to a few logical sectors, each write followed by idle time */
+static int BenchWorkload(uint32_t writes) {
+    uint8_t data[SPIFLASH_FTL_SECTOR_SIZE];
+    uint32_t erases[BENCH_PHYSICAL];
+    SPIFlashFTLStats_t before;
+    uint64_t start;
+    double ms;
+    int fail = 0;
+
+    printf("RAM: sizeof(SPIFlashFTL_t) %u B for %u sectors\n", (unsigned)sizeof(ftl), SPIFLASH_FTL_SECTORS);
+    printf("mount of %u blank sectors: %.3f ms\n", BENCH_PHYSICAL, BenchMount(BENCH_PHYSICAL, BENCH_LOGICAL, &fail));
+    for (uint32_t logical = 0; logical < BENCH_LOGICAL; logical++) {
+        written[logical] = 0;
+        inPlace[logical] = 1;
+        BenchFill(data, logical, 0);
+        fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS);
+    }
+    fail |= (BenchIdle() != SPIFLASH_SUCCESS);
+
+    start = SPIFlashSimGetTimeNs();
+    before = ftl.stats;
+    for (uint32_t i = 0; i < writes; i++) {
+        uint32_t logical = (BenchRandom() % 10) ? BenchRandom() % BENCH_HOT
+                                                : BENCH_HOT + BenchRandom() % (BENCH_LOGICAL - BENCH_HOT);
+        BenchFill(data, logical, ++written[logical]);
+        fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS) || (BenchIdle() != SPIFLASH_SUCCESS);
+        inPlace[logical]++;
+    }
+    ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+    printf("%u writes in %.1f s (%.2f ms per write with background erase), %u moves, %u erases\n", writes, ms / 1e3,
+           ms / writes, ftl.stats.moves - before.moves, ftl.stats.erases - before.erases);
+    printf("write amplification %.3f\n", (double)(ftl.stats.programmed - before.programmed)
+                                              / ((double)(ftl.stats.writes - before.writes) * SPIFLASH_FTL_SECTOR_SIZE));
+    for (uint32_t i = 0; i < BENCH_PHYSICAL; i++) {
+        erases[i] = ftl.sector[i] >> 2;
+    }
+    BenchWear("FTL:", erases, BENCH_PHYSICAL);
+    BenchWear("in place (no FTL):", inPlace, BENCH_PHYSICAL);
+
+    printf("remount of %u sectors: %.3f ms\n", BENCH_PHYSICAL, BenchMount(BENCH_PHYSICAL, BENCH_LOGICAL, &fail));
+    for (uint32_t i = 0; i < BENCH_PHYSICAL; i++) {
+        fail |= ((ftl.sector[i] >> 2) != erases[i]);
+    }
+    fail |= (BenchVerify() != 0);
+    printf("verify after workload and remount: %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Power loss at each step of a write, emulated by editing the sector headers and remounting */
+static int BenchPowerLoss(void) {
+    uint8_t data[SPIFLASH_FTL_SECTOR_SIZE];
+    uint32_t logical = 2, previous, next;
+    int fail = 0, result;
+
+    /* Data programmed, not committed: the previous copy must survive */
+    previous = ftl.map[logical];
+    BenchFill(data, logical, written[logical] + 1);
+    fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS);
+    next = ftl.map[logical];
+    memset(&memory[next * 4096 + 8], 0xFF, 8);
+    memory[next * 4096 + BENCH_STATE] = 0xFE;
+    memory[previous * 4096 + BENCH_STATE] = 0xFC;
+    BenchMount(BENCH_PHYSICAL, BENCH_LOGICAL, &fail);
+    result = (ftl.map[logical] != previous) || (BenchVerify() != 0);
+    printf("cut before commit: %s\n", result ? "FAIL" : "ok");
+    fail |= result || (BenchIdle() != SPIFLASH_SUCCESS);
+
+    /* Committed, previous copy not yet obsolete: the higher version must win */
+    previous = ftl.map[logical];
+    BenchFill(data, logical, ++written[logical]);
+    fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS);
+    next = ftl.map[logical];
+    memory[previous * 4096 + BENCH_STATE] = 0xFC;
+    BenchMount(BENCH_PHYSICAL, BENCH_LOGICAL, &fail);
+    result = (ftl.map[logical] != next) || (BenchVerify() != 0);
+    printf("cut before release: %s\n", result ? "FAIL" : "ok");
+    fail |= result || (BenchIdle() != SPIFLASH_SUCCESS) || (BenchVerify() != 0);
+
+    /* Background erase cut short: blank sector without header */
+    fail |= (SPIFlashFTLTrim(&ftl, logical) != SPIFLASH_SUCCESS);
+    written[logical] = BENCH_TRIMMED;
+    memset(&memory[next * 4096], 0xFF, 4096);
+    BenchMount(BENCH_PHYSICAL, BENCH_LOGICAL, &fail);
+    result = (BenchVerify() != 0) || (BenchIdle() != SPIFLASH_SUCCESS) || (BenchVerify() != 0);
+    printf("cut erase: %s\n", result ? "FAIL" : "ok");
+    return fail | result;
+}
+
+#if SPIFLASH_FTL_SECTORS >= 4096
+static int BenchLargeMount(void) {
+    uint8_t data[SPIFLASH_FTL_SECTOR_SIZE];
+    int fail = (SPIFlashFTLMount(&ftl, &flash, 0, 4096, 4000) != SPIFLASH_SUCCESS)
+               || (SPIFlashFTLFormat(&ftl) != SPIFLASH_SUCCESS);
+
+    for (uint32_t logical = 0; logical < 4000; logical++) {
+        BenchFill(data, logical, 0);
+        fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS);
+    }
+    fail |= (BenchIdle() != SPIFLASH_SUCCESS);
+    printf("mount of 4096 sectors (16 MiB, 4000 mapped): %.3f ms\n", BenchMount(4096, 4000, &fail));
+    return fail;
+}
+#endif
+
+/* Spare sectors erased by power-cycled background erases come back with erase count 0 at mount, younger than any
+ * sector holding data: static wear leveling must not move cold data into them */
+static int BenchColdSpares(void) {
+    uint8_t data[SPIFLASH_FTL_SECTOR_SIZE], used[6] = {0};
+    uint32_t erases, moves;
+    int fail = 0;
+
+    if (BenchInit() || (SPIFlashFTLMount(&ftl, &flash, 0, 6, 4) != SPIFLASH_SUCCESS)) {
+        return 1;
+    }
+    /* Logical sectors 2 and 3 are written once and stay cold, 0 and 1 are hot */
+    for (uint32_t i = 0; i < 300; i++) {
+        uint32_t logical = (i < 2) ? i + 2 : i % 2;
+        BenchFill(data, logical, i);
+        fail |= (SPIFlashFTLWrite(&ftl, logical, data) != SPIFLASH_SUCCESS) || (BenchIdle() != SPIFLASH_SUCCESS);
+    }
+    for (uint32_t logical = 0; logical < 4; logical++) {
+        if (ftl.map[logical] < 6) {
+            used[ftl.map[logical]] = 1;
+        }
+    }
+    for (uint32_t sector = 0; sector < 6; sector++) {
+        if (!used[sector]) {
+            memset(&memory[sector * 4096], 0xFF, 4096);
+        }
+    }
+    fail |= (SPIFlashFTLMount(&ftl, &flash, 0, 6, 4) != SPIFLASH_SUCCESS);
+    erases = ftl.stats.erases;
+    moves = ftl.stats.moves;
+    fail |= (BenchIdle() != SPIFLASH_SUCCESS);
+    erases = ftl.stats.erases - erases;
+    moves = ftl.stats.moves - moves;
+    fail |= (moves != 0) || (erases != 2);
+    printf("raw-erased spares after remount: %u moves, %u erases (expected 0 moves, 2 erases) %s\n", moves,
+           erases, fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(int argc, char** argv) {
+    int fail;
+
+    fail = BenchInit();
+    fail |= BenchWorkload((argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 20000);
+    fail |= BenchPowerLoss();
+#if SPIFLASH_FTL_SECTORS >= 4096
+    fail |= BenchLargeMount();
+#endif
+    fail |= BenchColdSpares();
+    printf("simulator timing violations: %u\n", sim.stats.violations);
+    fail |= (sim.stats.violations != 0);
+    return fail;
+}
@@ -0,0 +1,267 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchKV.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark and checks of the key-value store
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchKV \
+ *         tools/SPIFlashBenchKV.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchKV [updates]
+ * Runs puts, gets and deletes against a RAM model of the store, 90% of the updates going to a few hot keys, and
+ * compares them with rewriting a whole settings sector. Then checks a remount, a record torn by a power loss and a
+ * compaction cut short. Times are simulated W25Q128JV times. The exit status is non-zero if the store and the model
+ * disagree or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashKV.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_CAPACITY 0x18 /* JEDEC capacity code of the simulated chip, 16 MiB */
+#define BENCH_SIZE     (1UL << 24)
+#define BENCH_FIRST    1000 /* first sector of the store area */
+#define BENCH_COUNT    8
+#define BENCH_KEYS     300
+#define BENCH_HOT      20
+#define BENCH_VALUE    64
+#define BENCH_STATE    12 /* offset of the state word in the sector header */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static SPIFlashKV_t kv;
+static uint8_t value[BENCH_KEYS][BENCH_VALUE]; /* model: value of each key, length 0 if deleted */
+static uint32_t length[BENCH_KEYS];
+static uint32_t seed = 7;
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint32_t BenchRandom(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static uint32_t BenchKey(uint32_t i) { return 0x1000 + i * 37; }
+
+static void BenchValue(uint32_t i) {
+    length[i] = 8 + BenchRandom() % (BENCH_VALUE - 7);
+    for (uint32_t k = 0; k < length[i]; k++) {
+        value[i][k] = (uint8_t)BenchRandom();
+    }
+}
+
+static int BenchPut(uint32_t i) {
+    BenchValue(i);
+    return SPIFlashKVPut(&kv, BenchKey(i), value[i], length[i]) != SPIFLASH_SUCCESS;
+}
+
+static double BenchMount(int* fail) {
+    uint64_t start = SPIFlashSimGetTimeNs();
+    *fail |= (SPIFlashKVMount(&kv, &flash, BENCH_FIRST, BENCH_COUNT) != SPIFLASH_SUCCESS);
+    return (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+}
+
+/* Every key of the model must read back, deleted keys must be missing */
+static int BenchVerify(const char* name) {
+    uint8_t data[BENCH_VALUE];
+    uint32_t size, keys = 0, bad = 0;
+
+    for (uint32_t i = 0; i < BENCH_KEYS; i++) {
+        SPIFlashStatus_t status = SPIFlashKVGet(&kv, BenchKey(i), data, sizeof(data), &size);
+        if (length[i] != 0) {
+            keys++;
+            bad += (status != SPIFLASH_SUCCESS) || (size != length[i]) || memcmp(data, value[i], size);
+        } else {
+            bad += (status != SPIFLASH_ERROR) || (size != 0);
+        }
+    }
+    printf("%-28s keys %u (model %u), bad %u, corrupted %u %s\n", name, kv.keys, keys, bad, kv.corrupted,
+           (bad || (kv.keys != keys)) ? "FAIL" : "ok");
+    return bad || (kv.keys != keys);
+}
+
+/* Flash address of the value of a key, from the index */
+static uint32_t BenchLocate(uint32_t key) {
+    for (uint32_t slot = 0; slot < SPIFLASH_KV_INDEX; slot++) {
+        if (kv.index[slot].key == key) {
+            uint32_t location = kv.index[slot].location;
+            return (BENCH_FIRST + (location >> 24)) * 4096 + ((location >> 12) & 0xFFF) + SPIFLASH_KV_RECORD_HEADER;
+        }
+    }
+    return 0;
+}
+
+static int BenchWorkload(uint32_t updates) {
+    uint8_t sector[4096];
+    uint32_t erases, singles = 0, deletes = 0, transactions, size;
+    double mean = 0, max = 0, single = 0, ms;
+    uint64_t start;
+    int fail = 0;
+
+    printf("RAM: sizeof(SPIFlashKV_t) %u B, %u index slots\n", (unsigned)sizeof(kv), SPIFLASH_KV_INDEX);
+
+    /* Baseline: every update erases and rewrites a settings sector */
+    memset(sector, 0x5A, sizeof(sector));
+    start = SPIFlashSimGetTimeNs();
+    for (uint32_t i = 0; i < 20; i++) {
+        sector[i] = (uint8_t)i;
+        fail |= (SPIFlashEraseSector(&flash, 2000) != SPIFLASH_SUCCESS)
+                || (SPIFlashWriteSector(&flash, 2000, sector, sizeof(sector), 0) != SPIFLASH_SUCCESS);
+    }
+    printf("settings sector rewrite: %.3f ms per update\n", (double)(SPIFlashSimGetTimeNs() - start) / 1e6 / 20);
+
+    printf("mount of a blank area: %.3f ms\n", BenchMount(&fail));
+    for (uint32_t i = 0; i < BENCH_KEYS; i++) {
+        fail |= BenchPut(i);
+    }
+    fail |= BenchVerify("after the first fill");
+
+    erases = sim.stats.erases;
+    for (uint32_t n = 0; n < updates; n++) {
+        uint32_t i = (BenchRandom() % 10) ? BenchRandom() % BENCH_HOT : BenchRandom() % BENCH_KEYS;
+        uint32_t programs = sim.stats.programs;
+
+        start = SPIFlashSimGetTimeNs();
+        if (BenchRandom() % 50 == 0) {
+            fail |= (SPIFlashKVDelete(&kv, BenchKey(i)) == SPIFLASH_TIMEOUT);
+            length[i] = 0;
+            deletes++;
+        } else {
+            fail |= BenchPut(i);
+        }
+        ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+        mean += ms;
+        max = (ms > max) ? ms : max;
+        if (sim.stats.programs - programs == 1) {
+            singles++;
+            single += ms;
+        }
+    }
+    printf("%u updates (%u deletes): mean %.3f ms, max %.3f ms, %.1f%% a single page program (%.3f ms), "
+           "%u sector erases\n",
+           updates, deletes, mean / updates, max, 100.0 * singles / updates, singles ? single / singles : 0,
+           sim.stats.erases - erases);
+
+    start = SPIFlashSimGetTimeNs();
+    transactions = sim.stats.transactions;
+    for (uint32_t i = 0; i < BENCH_KEYS; i++) {
+        SPIFlashKVGet(&kv, BenchKey(i), sector, BENCH_VALUE, &size);
+    }
+    printf("get: %.4f ms, %.2f transactions\n", (double)(SPIFlashSimGetTimeNs() - start) / 1e6 / BENCH_KEYS,
+           (double)(sim.stats.transactions - transactions) / BENCH_KEYS);
+    fail |= BenchVerify("after the updates");
+    printf("remount: %.3f ms\n", BenchMount(&fail));
+    fail |= BenchVerify("after remount");
+    return fail;
+}
+
+/* Power loss while a value is programmed: its CRC fails and the previous value must come back at mount */
+static int BenchTornRecord(void) {
+    uint8_t previous[BENCH_VALUE];
+    uint32_t previousLength = length[5], address;
+    int fail = 0;
+
+    memcpy(previous, value[5], sizeof(previous));
+    fail |= BenchPut(5);
+    address = BenchLocate(BenchKey(5)) + length[5] - 1;
+    memory[address] = (uint8_t)~memory[address];
+    memcpy(value[5], previous, sizeof(previous));
+    length[5] = previousLength;
+    BenchMount(&fail);
+    fail |= (kv.corrupted == 0);
+    fail |= BenchVerify("after a torn record");
+    fail |= BenchPut(5);
+    fail |= BenchVerify("put after the torn record");
+    return fail;
+}
+
+/* Power loss during compaction: the oldest sector is not released yet and the copies in the head sector are partial.
+ * The oldest sector must stay authoritative */
+static int BenchCutCompaction(void) {
+    static uint8_t snapshot[BENCH_COUNT * 4096];
+    uint8_t previous[BENCH_VALUE];
+    uint32_t head, i, previousLength, tail;
+    int fail = 0;
+
+    do {
+        memcpy(snapshot, &memory[BENCH_FIRST * 4096], sizeof(snapshot));
+        head = kv.headSeq;
+        i = BenchRandom() % BENCH_KEYS;
+        previousLength = length[i];
+        memcpy(previous, value[i], sizeof(previous));
+        fail |= BenchPut(i);
+        if (kv.headSeq != head) {
+            /* The put that started the compaction is lost with it */
+            memcpy(value[i], previous, sizeof(previous));
+            length[i] = previousLength;
+        }
+    } while ((kv.headSeq == head) && !fail);
+    tail = (kv.tailSeq - 1) % BENCH_COUNT;
+    memcpy(&memory[(BENCH_FIRST + tail) * 4096 + BENCH_STATE], &snapshot[tail * 4096 + BENCH_STATE], 4);
+    memset(&memory[(BENCH_FIRST + kv.headSeq % BENCH_COUNT) * 4096 + 1024], 0xFF, 3072);
+    printf("mount after a cut compaction: %.3f ms\n", BenchMount(&fail));
+    fail |= BenchVerify("after a cut compaction");
+
+    for (uint32_t n = 0; n < 3000; n++) {
+        fail |= BenchPut(BenchRandom() % BENCH_KEYS);
+    }
+    BenchMount(&fail);
+    fail |= BenchVerify("after more updates");
+    return fail;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(int argc, char** argv) {
+    SPIFlashSimConfig_t config;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    config.capacity = BENCH_CAPACITY;
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    fail |= BenchWorkload((argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 20000);
+    fail |= BenchTornRecord();
+    fail |= BenchCutCompaction();
+    printf("simulator timing violations: %u\n", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
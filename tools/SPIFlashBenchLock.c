@@ -0,0 +1,183 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchLock.c
+ * \author          Andrea Vivani
+ * \brief           Multi-threaded stress test of the driver lock on the simulator
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchLock \
+ *         tools/SPIFlashBenchLock.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchLock
+ * This uses the default SPIFLASH_LOCK_ATOMIC. To measure SPIFLASH_LOCK_RTOS on a pthread mutex, add:
+ *     -DSPIFLASH_LOCK=SPIFLASH_LOCK_RTOS -DSPIFLASH_LOCK_HEADER='<pthread.h>' -DSPIFLASH_MUTEX_TYPE=pthread_mutex_t \
+ *     -D'SPIFLASH_MUTEX_INIT(m)=pthread_mutex_init(&(m), NULL)' -D'SPIFLASH_MUTEX_LOCK(m)=pthread_mutex_lock(&(m))' \
+ *     -D'SPIFLASH_MUTEX_UNLOCK(m)=pthread_mutex_unlock(&(m))'
+ * For 1 to 8 threads, reports the contended throughput and the distribution of the time to take the lock in bare lock
+ * cycles, then of the duration of SPIFlashReadAddress() calls sharing one simulated chip. Times are host wall-clock times, so contention depends on
+ * the number of host CPUs. The exit status is non-zero if an update is lost, data is wrong or the simulator flags a
+ * protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE    (1UL << 24)
+#define BENCH_THREADS 8
+#define BENCH_CYCLES  200000 /* lock cycles per thread */
+#define BENCH_READS   20000  /* driver reads per thread */
+#define BENCH_WORK    50     /* iterations of the dummy critical section */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static SPIFlashLock_t lock;
+static volatile uint32_t counter, bad;
+static double* wait;
+
+/* Private functions ---------------------------------------------------------*/
+
+static double BenchNow(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+static int BenchCompare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Non-atomic read-modify-write of a shared counter: any overlap of two critical sections loses an update */
+static void* BenchLockWorker(void* arg) {
+    double* waits = &wait[(size_t)arg * BENCH_CYCLES];
+
+    for (uint32_t i = 0; i < BENCH_CYCLES; i++) {
+        double start = BenchNow();
+        uint32_t value;
+
+        SPIFlashLockAcquire(&lock);
+        waits[i] = BenchNow() - start;
+        value = counter;
+        for (volatile uint32_t k = 0; k < BENCH_WORK; k++) {}
+        counter = value + 1;
+        SPIFlashLockRelease(&lock);
+        for (volatile uint32_t k = 0; k < BENCH_WORK; k++) {}
+    }
+    return NULL;
+}
+
+static void* BenchReadWorker(void* arg) {
+    double* waits = &wait[(size_t)arg * BENCH_READS];
+    unsigned int seed = (unsigned int)(size_t)arg;
+    uint8_t data[64];
+
+    for (uint32_t i = 0; i < BENCH_READS; i++) {
+        uint32_t address = ((uint32_t)rand_r(&seed) % 4096) * sizeof(data);
+        double start = BenchNow();
+        SPIFlashStatus_t status = SPIFlashReadAddress(&flash, address, data, sizeof(data));
+
+        waits[i] = BenchNow() - start;
+        if ((status != SPIFLASH_SUCCESS) || memcmp(data, &memory[address], sizeof(data))) {
+            __atomic_fetch_add(&bad, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+/* Run the worker on each thread and print the throughput and the distribution of the per-operation times */
+static void BenchRun(const char* name, void* (*worker)(void*), uint32_t threads, uint32_t ops) {
+    pthread_t thread[BENCH_THREADS];
+    uint32_t n = threads * ops;
+    double start, elapsed;
+
+    start = BenchNow();
+    for (size_t i = 0; i < threads; i++) {
+        pthread_create(&thread[i], NULL, worker, (void*)i);
+    }
+    for (uint32_t i = 0; i < threads; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    elapsed = BenchNow() - start;
+    qsort(wait, n, sizeof(wait[0]), BenchCompare);
+    printf("%s %u thr: %5.2f M ops/s, p50 %6.2f us p99 %7.2f us p99.9 %8.1f us max %8.1f us\n", name, threads,
+           n / elapsed * 1e3, wait[n / 2] / 1e3, wait[n / 100 * 99] / 1e3, wait[n / 1000 * 999] / 1e3,
+           wait[n - 1] / 1e3);
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < BENCH_SIZE; i++) {
+        memory[i] = (uint8_t)(i * 7);
+    }
+    wait = malloc(sizeof(double) * BENCH_THREADS * BENCH_CYCLES);
+    if (wait == NULL) {
+        return 1;
+    }
+    SPIFlashLockInit(&lock);
+
+    printf("lock backend %d, %u cycles per thread\n", SPIFLASH_LOCK, BENCH_CYCLES);
+    for (uint32_t threads = 1; threads <= BENCH_THREADS; threads *= 2) {
+        counter = 0;
+        BenchRun("acquire", BenchLockWorker, threads, BENCH_CYCLES);
+        if (counter != threads * BENCH_CYCLES) {
+            printf("lost updates: %u\n", threads * BENCH_CYCLES - counter);
+            fail = 1;
+        }
+    }
+
+    printf("driver reads of 64 B, %u per thread\n", BENCH_READS);
+    for (uint32_t threads = 1; threads <= BENCH_THREADS; threads *= 2) {
+        BenchRun("read   ", BenchReadWorker, threads, BENCH_READS);
+    }
+    printf("bad reads %u, violations %u %s\n", bad, sim.stats.violations,
+           (fail || bad || sim.stats.violations) ? "FAIL" : "ok");
+    free(wait);
+    return fail || bad || (sim.stats.violations != 0);
+}
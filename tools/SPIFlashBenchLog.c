@@ -0,0 +1,242 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchLog.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark and checks of the append-only log
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchLog \
+ *         tools/SPIFlashBenchLog.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchLog
+ * Fills a log over the whole simulated 128 Mbit chip for one and a half laps, times the mount against a linear scan
+ * of the sector headers and reads every record back. Then checks a torn record, an erase cut short in the sector
+ * after the head and in sector 0 of a small ring, and live cursors. Times are simulated W25Q128JV times. The exit
+ * status is non-zero if a record is lost, reordered or wrong, or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashLog.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_CAPACITY 0x18 /* JEDEC capacity code of the simulated chip, 16 MiB */
+#define BENCH_SIZE     (1UL << 24)
+#define BENCH_RECORD   64         /* largest record */
+#define BENCH_EMPTY    0xFFFFFFFF /* headSeq of an empty log */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static SPIFlashLog_t logger;
+static uint32_t next; /* identifier of the next record */
+
+/* Private functions ---------------------------------------------------------*/
+
+/* Records of 8 to 64 bytes starting with their identifier */
+static uint32_t BenchLength(uint32_t id) { return 8 + (id * 7) % 57; }
+
+static void BenchRecord(uint8_t* data, uint32_t id) {
+    for (uint32_t k = 0; k < BenchLength(id); k++) {
+        data[k] = (uint8_t)(id * 31 + k);
+    }
+    memcpy(data, &id, sizeof(id));
+}
+
+static int BenchAppend(void) {
+    uint8_t data[BENCH_RECORD];
+    BenchRecord(data, next);
+    return SPIFlashLogAppend(&logger, data, BenchLength(next++)) != SPIFLASH_SUCCESS;
+}
+
+static double BenchMount(uint32_t first, uint32_t count, int* fail) {
+    uint64_t start = SPIFlashSimGetTimeNs();
+    *fail |= (SPIFlashLogMount(&logger, &flash, first, count) != SPIFLASH_SUCCESS);
+    return (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+}
+
+/* Read the whole log back: records must be intact, in order and end with the last one appended, with exactly the
+ * given number of records skipped as corrupted */
+static int BenchVerify(const char* name, uint32_t corrupted) {
+    SPIFlashLogCursor_t cursor;
+    uint8_t data[BENCH_RECORD], expected[BENCH_RECORD];
+    uint32_t size, id, first = 0, last = 0, count = 0, bad = 0, gaps = 0, skipped = logger.corrupted;
+    int fail;
+
+    SPIFlashLogFirst(&logger, &cursor);
+    while (SPIFlashLogNext(&logger, &cursor, data, sizeof(data), &size) == SPIFLASH_SUCCESS) {
+        memcpy(&id, data, sizeof(id));
+        BenchRecord(expected, id);
+        bad += (size != BenchLength(id)) || memcmp(data, expected, size);
+        if (count == 0) {
+            first = id;
+        } else if (id != last + 1) {
+            gaps += (id > last + 1) ? id - last - 1 : 1;
+        }
+        last = id;
+        count++;
+    }
+    /* logger.corrupted runs on from the last mount, so only count what this pass skipped */
+    skipped = logger.corrupted - skipped;
+    fail = bad || (count == 0) || (last != next - 1) || (gaps != corrupted) || (skipped != corrupted);
+    printf("%-28s %u records, %u..%u, bad %u, missing %u, corrupted %u %s\n", name, count, first, last, bad, gaps,
+           skipped, fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* One and a half laps over the whole chip, then mount time against a linear scan of the sector headers */
+static int BenchWrap(void) {
+    uint32_t sectors = flash.sectorNum, head, tail, offset;
+    uint8_t header[SPIFLASH_LOG_SECTOR_HEADER];
+    uint64_t start;
+    double ms;
+    int fail = 0;
+
+    printf("mount of %u blank sectors: %.3f ms\n", sectors, BenchMount(0, sectors, &fail));
+    start = SPIFlashSimGetTimeNs();
+    while (((logger.headSeq == BENCH_EMPTY) || (logger.headSeq < sectors + sectors / 2)) && !fail) {
+        fail |= BenchAppend();
+    }
+    ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+    printf("%u records in %.1f s, %.1f us per record\n", next, ms / 1e3, ms * 1e3 / next);
+
+    head = logger.headSeq;
+    tail = logger.tailSeq;
+    offset = logger.offset;
+    ms = BenchMount(0, sectors, &fail);
+    fail |= (logger.headSeq != head) || (logger.tailSeq != tail) || (logger.offset != offset);
+    printf("remount: %.3f ms, head %u tail %u offset %u %s\n", ms, logger.headSeq, logger.tailSeq, logger.offset,
+           fail ? "FAIL" : "ok");
+    start = SPIFlashSimGetTimeNs();
+    for (uint32_t sector = 0; sector < sectors; sector++) {
+        fail |= (SPIFlashReadAddress(&flash, sector * 4096, header, sizeof(header)) != SPIFLASH_SUCCESS);
+    }
+    printf("linear scan of the sector headers: %.3f ms\n", (double)(SPIFlashSimGetTimeNs() - start) / 1e6);
+    fail |= BenchVerify("after wrap and remount", 0);
+    return fail;
+}
+
+/* Power loss while a record is programmed, then while the head moves into the next sector */
+static int BenchPowerLoss(void) {
+    uint32_t address, nextSector;
+    int fail = 0;
+
+    address = (logger.first + logger.headSeq % logger.count) * 4096 + logger.offset;
+    fail |= BenchAppend();
+    memory[address + SPIFLASH_LOG_RECORD_HEADER + 2] ^= 0x0F;
+    fail |= BenchAppend();
+    BenchMount(0, flash.sectorNum, &fail);
+    fail |= BenchVerify("after a torn record", 1);
+
+    /* Fill the head sector, then blank the next one as an erase cut short would, dropping the oldest sector */
+    while ((logger.offset + SPIFLASH_LOG_RECORD_HEADER + BENCH_RECORD <= 4096) && !fail) {
+        fail |= BenchAppend();
+    }
+    nextSector = logger.first + (logger.headSeq + 1) % logger.count;
+    memset(&memory[nextSector * 4096], 0xFF, 4096);
+    printf("mount after an erase cut short: %.3f ms\n", BenchMount(0, flash.sectorNum, &fail));
+    fail |= BenchVerify("after a cut erase", 1);
+    fail |= BenchAppend();
+    fail |= BenchVerify("append after the cut erase", 1);
+    return fail;
+}
+
+/* A cursor opened at the end only returns records appended after it */
+static int BenchCursor(void) {
+    SPIFlashLogCursor_t cursor;
+    uint8_t data[BENCH_RECORD];
+    uint32_t size, id = 0;
+    int fail;
+
+    SPIFlashLogEnd(&logger, &cursor);
+    fail = (SPIFlashLogNext(&logger, &cursor, data, sizeof(data), &size) != SPIFLASH_BUSY);
+    fail |= BenchAppend();
+    fail |= (SPIFlashLogNext(&logger, &cursor, data, sizeof(data), &size) != SPIFLASH_SUCCESS);
+    memcpy(&id, data, sizeof(id));
+    fail |= (id != next - 1);
+    printf("end cursor sees only new records: %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Ring of 4 sectors wrapped with the head in the last one, sector 0 blanked as an erase cut short would */
+static int BenchSmallRing(void) {
+    uint8_t data[8];
+    double ms;
+    int fail;
+
+    fail = (SPIFlashLogMount(&logger, &flash, 4000, 4) != SPIFLASH_SUCCESS)
+           || (SPIFlashLogFormat(&logger) != SPIFLASH_SUCCESS);
+    next = 0;
+    while (((logger.headSeq == BENCH_EMPTY) || (logger.headSeq < 7)
+            || (logger.offset + SPIFLASH_LOG_RECORD_HEADER + BENCH_RECORD <= 4096))
+           && !fail) {
+        fail |= BenchAppend();
+    }
+    memset(&memory[4000 * 4096], 0xFF, 4096);
+    BenchMount(4000, 4, &fail);
+    fail |= BenchVerify("4-sector ring, cut erase of 0", 0);
+
+    /* Worst case mount: the head sector full of 1-byte records to walk */
+    fail |= (SPIFlashLogMount(&logger, &flash, 100, 100) != SPIFLASH_SUCCESS)
+            || (SPIFlashLogFormat(&logger) != SPIFLASH_SUCCESS);
+    memset(data, 1, sizeof(data));
+    do {
+        fail |= (SPIFlashLogAppend(&logger, data, 1) != SPIFLASH_SUCCESS);
+    } while ((logger.offset + SPIFLASH_LOG_RECORD_HEADER + 1 <= 4096) && !fail);
+    ms = BenchMount(100, 100, &fail);
+    printf("mount with the head sector full of 1-byte records: %.3f ms\n", ms);
+    return fail;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    config.capacity = BENCH_CAPACITY;
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    fail |= BenchWrap();
+    fail |= BenchPowerLoss();
+    fail |= BenchCursor();
+    fail |= BenchSmallRing();
+    printf("simulator timing violations: %u\n", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
@@ -0,0 +1,89 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchProgram.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of page program throughput
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchProgram \
+ *         tools/SPIFlashBenchProgram.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchProgram
+ * Times a 1 MiB SPIFlashWriteAddress() to erased memory on the default simulated chip (tPP 400 us, 50 MHz) and
+ * counts the status reads issued while waiting. Add -DSPIFLASH_POLL=SPIFLASH_POLL_CONTINUOUS to compare continuous
+ * STATUS1 polling. The exit status is non-zero if data is wrong or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_LENGTH (1UL << 20)
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static uint8_t data[BENCH_LENGTH];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    uint64_t start;
+    double seconds;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < BENCH_LENGTH; i++) {
+        data[i] = (uint8_t)(i * 7 + (i >> 8));
+    }
+
+    SPIFlashSimResetStats(&sim);
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashWriteAddress(&flash, 0, data, BENCH_LENGTH) != SPIFLASH_SUCCESS);
+    seconds = (double)(SPIFlashSimGetTimeNs() - start) / 1e9;
+    fail |= (memcmp(memory, data, BENCH_LENGTH) != 0);
+
+    printf("%s polling: 1 MiB in %.2f s, %.0f KiB/s, %u page programs, %u status reads, violations %u %s\n",
+           (SPIFLASH_POLL == SPIFLASH_POLL_CONTINUOUS) ? "continuous" : "reissued", seconds, 1024 / seconds,
+           sim.stats.programs, sim.stats.statusReads, sim.stats.violations, fail ? "FAIL" : "ok");
+    return fail || (sim.stats.violations != 0);
+}
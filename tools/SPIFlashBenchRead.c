@@ -0,0 +1,142 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchRead.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of read throughput against the SPI clock and data lines
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchRead \
+ *         tools/SPIFlashBenchRead.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchRead
+ * For each SPI clock, then for 1, 2 and 4 data lines at 80 MHz, prints the read and page program opcodes chosen by
+ * SPIFlashInit() and the throughput of 256 B, 4 KiB and 64 KiB reads, averaged over 16 reads including the
+ * per-transaction overhead, and of a 64 KiB write. The dual and quad rows run once with the full SFDP table (1-2-2,
+ * 1-4-4 reads) and once with the I/O reads cleared from it (1-1-2, 1-1-4 reads). The simulated chip accepts READ DATA
+ * (0x03) up to 50 MHz. The exit status is non-zero if data is wrong, the expected opcode is not chosen or the
+ * simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE  (1UL << 24)
+#define BENCH_READS 16
+#define BENCH_WRITE 0xF00000 /* erased 64 KiB for the write */
+#define BENCH_BFPT  0x30     /* BFPT offset in the simulated SFDP area */
+#define BENCH_IO    0x30     /* 1-2-2 and 1-4-4 support, bits 20 and 21 of BFPT DWORD 1 */
+
+/* Typedefs ------------------------------------------------------------------*/
+
+typedef struct {
+    uint32_t clock;
+    uint8_t lines, noIO;      /* noIO: clear 1-2-2 and 1-4-4 from the SFDP table */
+    uint8_t readCmd, progCmd; /* expected opcodes */
+} BenchCase_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static uint8_t buffer[65536], data[65536];
+static const BenchCase_t cases[] = {
+    {50000000, 1, 0, 0x03, 0x02},  {80000000, 1, 0, 0x0B, 0x02},  {104000000, 1, 0, 0x0B, 0x02},
+    {80000000, 2, 1, 0x3B, 0x02},  {80000000, 2, 0, 0xBB, 0x02},  {80000000, 4, 1, 0x6B, 0x32},
+    {80000000, 4, 0, 0xEB, 0x32},
+};
+static const uint32_t sizes[] = {256, 4096, 65536};
+
+/* Private functions ---------------------------------------------------------*/
+
+static int BenchRun(const BenchCase_t* bench) {
+    SPIFlashSimConfig_t config;
+    SPIFlashSim_t sim;
+    SPIFlash_t flash;
+    uint64_t start;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    config.clock = bench->clock;
+    config.fR = 50000000;
+    config.lines = bench->lines;
+    memset(&flash, 0, sizeof(flash));
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS);
+    if (bench->noIO) {
+        sim.sfdp[BENCH_BFPT + 2] &= ~BENCH_IO;
+    }
+    fail |= (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < BENCH_WRITE; i++) {
+        memory[i] = (uint8_t)(i ^ (i >> 8) ^ (i >> 16));
+    }
+    fail |= (flash.readCmd != bench->readCmd) || (flash.progCmd != bench->progCmd);
+
+    printf("%u line(s) @%3u MHz: read 0x%02X program 0x%02X", bench->lines, bench->clock / 1000000, flash.readCmd,
+           flash.progCmd);
+    for (uint32_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint64_t elapsed;
+        start = SPIFlashSimGetTimeNs();
+        for (uint32_t k = 0; k < BENCH_READS; k++) {
+            uint32_t address = k * 65536;
+            fail |= (SPIFlashReadAddress(&flash, address, buffer, sizes[s]) != SPIFLASH_SUCCESS);
+            fail |= (memcmp(buffer, &memory[address], sizes[s]) != 0);
+        }
+        elapsed = (SPIFlashSimGetTimeNs() - start) / BENCH_READS;
+        printf("  %5u B: %6.2f MB/s", sizes[s], sizes[s] * 1e3 / (double)elapsed);
+    }
+
+    /* Written with the chosen program opcode, read back with the chosen read opcode */
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+        data[i] = (uint8_t)rand();
+    }
+    start = SPIFlashSimGetTimeNs();
+    fail |= (SPIFlashWriteAddress(&flash, BENCH_WRITE, data, sizeof(data)) != SPIFLASH_SUCCESS);
+    printf("  write: %4.0f KiB/s", 64 * 1e9 / (double)(SPIFlashSimGetTimeNs() - start));
+    fail |= (SPIFlashReadAddress(&flash, BENCH_WRITE, buffer, sizeof(buffer)) != SPIFLASH_SUCCESS)
+            || memcmp(buffer, data, sizeof(data)) || memcmp(&memory[BENCH_WRITE], data, sizeof(data));
+    printf("  violations %u %s\n", sim.stats.violations, fail ? "FAIL" : "ok");
+    return fail || (sim.stats.violations != 0);
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    int fail = 0;
+    for (uint32_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        fail |= BenchRun(&cases[i]);
+    }
+    return fail;
+}
@@ -0,0 +1,375 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchSched.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark and checks of the request scheduler
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchSched \
+ *         tools/SPIFlashBenchSched.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchSched
+ * Checks the dispatch order by priority, by deadline and for urgent requests, then measures the latency of small
+ * high-priority reads behind a 512 KiB dump with and without the scheduler, the merging of adjacent reads and a high
+ * priority program during a 64 KiB program. Last, a thread standing for an ISR feeds reads through
+ * SPIFlashSchedSubmitFromISR() while the main thread polls. Times are simulated W25Q128JV times. The exit status is
+ * non-zero if a request is served out of order, late or with wrong data, or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSched.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_DUMP   (512 * 1024)
+#define BENCH_PARAMS 200    /* parameter reads during the dump */
+#define BENCH_PERIOD 500000 /* ns between parameter reads */
+#define BENCH_MERGE  32
+#define BENCH_ISR    100000 /* requests submitted from the ISR thread */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static SPIFlashSched_t sched;
+static uint8_t dump[BENCH_DUMP];
+static SPIFlashSchedReq_t req[BENCH_ISR];
+static uint8_t data[BENCH_ISR][32];
+static uint64_t arrival[BENCH_PARAMS];
+static double latency[BENCH_PARAMS];
+static uint32_t order[8], served, bad;
+static volatile uint32_t stop;
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint8_t BenchPattern(uint32_t address) { return (uint8_t)(address + 3); }
+
+static int BenchCheck(const uint8_t* buffer, uint32_t address, uint32_t size) {
+    for (uint32_t k = 0; k < size; k++) {
+        if (buffer[k] != BenchPattern(address + k)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int BenchCompare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Records the completion order, context being the index of the request */
+static void BenchOrderDone(SPIFlashStatus_t status, void* context) {
+    uint32_t i = (uint32_t)(size_t)context;
+    bad += (status != SPIFLASH_SUCCESS) || BenchCheck(data[i], req[i].address, req[i].size);
+    order[served++] = i;
+}
+
+/* Records the latency of a parameter read from its arrival */
+static void BenchParamDone(SPIFlashStatus_t status, void* context) {
+    uint32_t i = (uint32_t)(size_t)context;
+    latency[served++] = (double)(SPIFlashSimGetTimeNs() - arrival[i]) / 1e3;
+    bad += (status != SPIFLASH_SUCCESS) || BenchCheck(data[i], req[i].address, req[i].size);
+}
+
+static void BenchISRDone(SPIFlashStatus_t status, void* context) {
+    uint32_t i = (uint32_t)(size_t)context;
+    bad += (status != SPIFLASH_SUCCESS) || BenchCheck(data[i], req[i].address, req[i].size);
+    served++;
+}
+
+static void BenchRead(uint32_t i, uint8_t priority, uint32_t address, uint32_t size, uint32_t deadline,
+                      SPIFlashCallback_t callback) {
+    memset(&req[i], 0, sizeof(req[i]));
+    memset(data[i], 0, sizeof(data[i]));
+    req[i].type = SPIFLASH_SCHED_READ;
+    req[i].priority = priority;
+    req[i].address = address;
+    req[i].size = size;
+    req[i].data = data[i];
+    req[i].deadline = deadline;
+    req[i].callback = callback;
+    req[i].context = (void*)(size_t)i;
+}
+
+/* Queue the given reads, 1 MiB apart so that none are merged, and check they complete in the expected order */
+static int BenchOrder(const char* name, uint32_t count, const uint8_t* priority, const uint32_t* deadline,
+                      const uint32_t* expected) {
+    int fail;
+
+    served = 0;
+    bad = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        BenchRead(i, priority[i], i << 20, 16, deadline[i], BenchOrderDone);
+        SPIFlashSchedSubmit(&sched, &req[i]);
+    }
+    while (SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY) {}
+    fail = (served != count) || bad || memcmp(order, expected, count * sizeof(order[0]));
+    printf("%-30s served", name);
+    for (uint32_t i = 0; i < served; i++) {
+        printf(" %u", order[i]);
+    }
+    printf(" %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+static int BenchOrders(void) {
+    static const uint8_t byPriority[] = {3, 2, 1, 0}, sameLevel[] = {1, 1, 1}, urgent[] = {0, 3};
+    static const uint32_t none[] = {0, 0, 0, 0}, deadlines[] = {0, 50000, 20000}, urgentDeadline[] = {0, 500};
+    static const uint32_t byPriorityOrder[] = {3, 2, 1, 0}, deadlineOrder[] = {2, 1, 0}, urgentOrder[] = {1, 0};
+    int fail;
+
+    fail = BenchOrder("priorities 3, 2, 1, 0", 4, byPriority, none, byPriorityOrder);
+    fail |= BenchOrder("deadlines none, 50 ms, 20 ms", 3, sameLevel, deadlines, deadlineOrder);
+    fail |= BenchOrder("urgent priority 3 vs 0", 2, urgent, urgentDeadline, urgentOrder);
+    return fail;
+}
+
+/* Parameter reads every 500 us while a 512 KiB dump is read, directly and through the scheduler */
+static int BenchLatency(void) {
+    SPIFlashSchedReq_t big = {0};
+    uint64_t start, period = BENCH_PERIOD;
+    uint32_t arrived = 0, offset = 0, direct, missed;
+    int fail;
+
+    served = 0;
+    bad = 0;
+    start = SPIFlashSimGetTimeNs();
+    while ((offset < BENCH_DUMP) || (arrived < BENCH_PARAMS)) {
+        while ((start + arrived * period <= SPIFlashSimGetTimeNs()) && (arrived < BENCH_PARAMS)) {
+            arrival[arrived] = start + arrived * period;
+            arrived++;
+        }
+        while (served < arrived) {
+            BenchRead(served, 0, (served * 32) % 4096, 32, 0, BenchParamDone);
+            BenchParamDone(SPIFlashReadAddress(&flash, req[served].address, data[served], 32), (void*)(size_t)served);
+        }
+        if (offset < BENCH_DUMP) {
+            SPIFlashReadAddress(&flash, 65536 + offset, &dump[offset], 65536);
+            offset += 65536;
+        } else {
+            SPIFlashSimAdvanceNs(start + arrived * period - SPIFlashSimGetTimeNs());
+        }
+    }
+    qsort(latency, served, sizeof(latency[0]), BenchCompare);
+    direct = (uint32_t)latency[served / 2];
+    printf("direct: param read p50 %7.1f us p99 %7.1f us max %7.1f us\n", latency[served / 2],
+           latency[served * 99 / 100], latency[served - 1]);
+    fail = bad || BenchCheck(dump, 65536, BENCH_DUMP);
+
+    memset(dump, 0, sizeof(dump));
+    SPIFlashSchedResetStats(&sched);
+    served = 0;
+    arrived = 0;
+    big.type = SPIFLASH_SCHED_READ;
+    big.priority = 3;
+    big.address = 65536;
+    big.size = BENCH_DUMP;
+    big.data = dump;
+    start = SPIFlashSimGetTimeNs();
+    SPIFlashSchedSubmit(&sched, &big);
+    while ((arrived < BENCH_PARAMS) || (SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY)) {
+        while ((start + arrived * period <= SPIFlashSimGetTimeNs()) && (arrived < BENCH_PARAMS)) {
+            arrival[arrived] = start + arrived * period;
+            BenchRead(arrived, 0, (arrived * 32) % 4096, 32, 2000, BenchParamDone);
+            SPIFlashSchedSubmit(&sched, &req[arrived]);
+            arrived++;
+        }
+        if ((SPIFlashSchedPoll(&sched) == SPIFLASH_SUCCESS) && (arrived < BENCH_PARAMS)) {
+            SPIFlashSimAdvanceNs(start + arrived * period - SPIFlashSimGetTimeNs());
+        }
+    }
+    qsort(latency, served, sizeof(latency[0]), BenchCompare);
+    missed = sched.stats[0].missed;
+    printf("sched:  param read p50 %7.1f us p99 %7.1f us max %7.1f us, missed %u\n", latency[served / 2],
+           latency[served * 99 / 100], latency[served - 1], missed);
+    fail |= bad || (served != BENCH_PARAMS) || (big.status != SPIFLASH_SUCCESS) || BenchCheck(dump, 65536, BENCH_DUMP)
+            || missed || ((uint32_t)latency[served / 2] >= direct);
+    printf("dump latency %s\n", fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Adjacent 8 B reads from several clients, one by one and queued together */
+static int BenchMerge(void) {
+    uint32_t transactions, separate, merged = 0;
+    uint64_t start;
+    double ms;
+    int fail;
+
+    bad = 0;
+    transactions = sim.stats.transactions;
+    start = SPIFlashSimGetTimeNs();
+    for (uint32_t i = 0; i < BENCH_MERGE; i++) {
+        BenchRead(i, i % 4, 1000 + 8 * ((i * 7) % BENCH_MERGE), 8, 0, NULL);
+        bad += (SPIFlashReadAddress(&flash, req[i].address, data[i], 8) != SPIFLASH_SUCCESS)
+               || BenchCheck(data[i], req[i].address, 8);
+    }
+    separate = sim.stats.transactions - transactions;
+    ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e3;
+    printf("%u x 8 B adjacent reads: separate %u transactions, %.1f us", BENCH_MERGE, separate, ms);
+
+    SPIFlashSchedResetStats(&sched);
+    transactions = sim.stats.transactions;
+    start = SPIFlashSimGetTimeNs();
+    for (uint32_t i = 0; i < BENCH_MERGE; i++) {
+        BenchRead(i, i % 4, 1000 + 8 * ((i * 7) % BENCH_MERGE), 8, 0, NULL);
+        SPIFlashSchedSubmit(&sched, &req[i]);
+    }
+    while (SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY) {}
+    for (uint32_t i = 0; i < BENCH_MERGE; i++) {
+        bad += (req[i].status != SPIFLASH_SUCCESS) || BenchCheck(data[i], req[i].address, 8);
+    }
+    for (uint32_t p = 0; p < SPIFLASH_SCHED_PRIORITIES; p++) {
+        merged += sched.stats[p].merged;
+    }
+    transactions = sim.stats.transactions - transactions;
+    fail = bad || (transactions != 1) || (merged != BENCH_MERGE - 1);
+    printf(", merged %u transaction, %.1f us (%u merged) %s\n", transactions,
+           (double)(SPIFlashSimGetTimeNs() - start) / 1e3, merged, fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* A high-priority 64 B program submitted during a low-priority 64 KiB program */
+static int BenchWrite(void) {
+    static uint8_t large[65536], small[64];
+    SPIFlashSchedReq_t erase = {0}, slow = {0}, quick = {0};
+    uint64_t submitted = 0;
+    double us = 0;
+    int fail;
+
+    for (uint32_t i = 0; i < sizeof(large); i++) {
+        large[i] = (uint8_t)rand();
+    }
+    memset(small, 0x5A, sizeof(small));
+    erase.type = SPIFLASH_SCHED_ERASE;
+    erase.priority = 3;
+    erase.address = 0x100000;
+    erase.size = 0x20000;
+    SPIFlashSchedSubmit(&sched, &erase);
+    while (SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY) {
+        SPIFlashSimAdvanceNs(20000);
+    }
+    slow.type = quick.type = SPIFLASH_SCHED_PROGRAM;
+    slow.priority = 3;
+    slow.address = 0x100010;
+    slow.size = sizeof(large);
+    slow.data = large;
+    quick.address = 0x118000;
+    quick.size = sizeof(small);
+    quick.data = small;
+    SPIFlashSchedSubmit(&sched, &slow);
+    for (uint32_t k = 1; SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY; k++) {
+        SPIFlashSimAdvanceNs(20000);
+        if (k == 100) {
+            SPIFlashSchedSubmit(&sched, &quick);
+            submitted = SPIFlashSimGetTimeNs();
+        } else if ((submitted != 0) && (us == 0) && (quick.status != SPIFLASH_BUSY)) {
+            us = (double)(SPIFlashSimGetTimeNs() - submitted) / 1e3;
+        }
+    }
+    fail = (erase.status != SPIFLASH_SUCCESS) || (slow.status != SPIFLASH_SUCCESS)
+           || (quick.status != SPIFLASH_SUCCESS) || memcmp(&memory[slow.address], large, sizeof(large))
+           || memcmp(&memory[quick.address], small, sizeof(small)) || (us == 0);
+    printf("priority 0 program during a 64 KiB program: %.1f us %s\n", us, fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Single producer standing for an ISR, retrying while the ring is full */
+static void* BenchISRThread(void* arg) {
+    uint32_t* full = arg;
+
+    for (uint32_t i = 0; i < BENCH_ISR; i++) {
+        BenchRead(i, i % SPIFLASH_SCHED_PRIORITIES, (i * 16) % (1 << 20), 16, 0, BenchISRDone);
+        while (SPIFlashSchedSubmitFromISR(&sched, &req[i]) == SPIFLASH_BUSY) {
+            (*full)++;
+            sched_yield();
+        }
+    }
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static int BenchISR(void) {
+    pthread_t thread;
+    uint32_t full = 0, merged = 0;
+    int fail;
+
+    SPIFlashSchedResetStats(&sched);
+    served = 0;
+    bad = 0;
+    pthread_create(&thread, NULL, BenchISRThread, &full);
+    while ((SPIFlashSchedPoll(&sched) == SPIFLASH_BUSY) || !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+        if (SPIFlashSchedPoll(&sched) == SPIFLASH_SUCCESS) {
+            sched_yield();
+        }
+    }
+    pthread_join(thread, NULL);
+    for (uint32_t p = 0; p < SPIFLASH_SCHED_PRIORITIES; p++) {
+        merged += sched.stats[p].merged;
+    }
+    fail = bad || (served != BENCH_ISR);
+    printf("ISR ring: %u/%u served, %u bad, ring full %u times, %u merged %s\n", served, BENCH_ISR, bad, full, merged,
+           fail ? "FAIL" : "ok");
+    return fail;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < BENCH_SIZE; i++) {
+        memory[i] = BenchPattern(i);
+    }
+    SPIFlashSchedInit(&sched, &flash);
+
+    fail |= BenchOrders();
+    fail |= BenchLatency();
+    fail |= BenchMerge();
+    fail |= BenchWrite();
+    fail |= BenchISR();
+    printf("simulator timing violations: %u\n", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
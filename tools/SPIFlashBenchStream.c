@@ -0,0 +1,177 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchStream.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of streaming reads against chunked reads
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchStream \
+ *         tools/SPIFlashBenchStream.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchStream
+ * Reads 4 MiB while the application spends a fixed time processing every 4 KiB, first as one SPIFlashReadAddress()
+ * per chunk followed by the processing, then with SPIFlashReadStream(), whose chunks are received by
+ * SPIFlashSimTransferDMA() in the background while the previous one is processed. Prints both times, the chip
+ * selects and the stream speed against the wire time, for several chunk sizes. Then checks a stream of odd length
+ * and alignment and that other calls are refused while a stream runs. Times are simulated W25Q128JV times at the
+ * default clock. The exit status is non-zero if data is wrong, a stream that is not processing-bound falls below 99%
+ * of wire speed, or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_REGION (4UL << 20)
+#define BENCH_CHUNK  16384 /* largest chunk */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static uint8_t buffer0[BENCH_CHUNK], buffer1[BENCH_CHUNK], chunked[BENCH_CHUNK];
+static uint32_t processNs, received, bad, base;
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint8_t BenchPattern(uint32_t address) { return (uint8_t)(address * 13); }
+
+/* Application side: check the data, then spend processNs per 4 KiB */
+static void BenchProcess(const uint8_t* data, uint32_t length, void* context) {
+    (void)context;
+    for (uint32_t k = 0; k < length; k++) {
+        if (data[k] != BenchPattern(base + received + k)) {
+            bad++;
+            break;
+        }
+    }
+    received += length;
+    SPIFlashSimAdvanceNs((uint64_t)processNs * length / 4096);
+}
+
+/* Stream a region and poll it to the end, returning the time in ms */
+static double BenchStream(uint32_t address, uint32_t size, uint32_t chunk, SPIFlashStatus_t* status) {
+    uint64_t start = SPIFlashSimGetTimeNs();
+
+    base = address;
+    received = 0;
+    *status = SPIFlashReadStream(&flash, address, size, buffer0, buffer1, chunk, BenchProcess, NULL);
+    if (*status == SPIFLASH_SUCCESS) {
+        while ((*status = SPIFlashPoll(&flash)) == SPIFLASH_BUSY) {
+            SPIFlashSimAdvanceNs(1000);
+        }
+    }
+    return (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    static const uint32_t chunks[] = {1024, 4096, BENCH_CHUNK}, processing[] = {0, 300000, 600000, 1000000};
+    SPIFlashSimConfig_t config;
+    SPIFlashStatus_t status;
+    uint32_t transactions, violations;
+    double wire, ms, streamMs, efficiency;
+    uint64_t start;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < BENCH_SIZE; i++) {
+        memory[i] = BenchPattern(i);
+    }
+    wire = BENCH_REGION * 8.0 / flash.readDataLines / config.clock * 1e3;
+    printf("4 MiB at %u MHz on %u line(s): wire time %.1f ms\n", config.clock / 1000000, flash.readDataLines, wire);
+
+    for (uint32_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++) {
+        for (uint32_t p = 0; p < sizeof(processing) / sizeof(processing[0]); p++) {
+            uint32_t chunk = chunks[c];
+            int bound;
+
+            processNs = processing[p];
+            bad = 0;
+            base = 0;
+            received = 0;
+            transactions = sim.stats.transactions;
+            start = SPIFlashSimGetTimeNs();
+            for (uint32_t address = 0; address < BENCH_REGION; address += chunk) {
+                fail |= (SPIFlashReadAddress(&flash, address, chunked, chunk) != SPIFLASH_SUCCESS);
+                BenchProcess(chunked, chunk, NULL);
+            }
+            ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+            printf("chunk %5u, process %4u us/4 KiB: read+process %7.1f ms (%4u CS)", chunk, processNs / 1000, ms,
+                   sim.stats.transactions - transactions);
+
+            transactions = sim.stats.transactions;
+            violations = sim.stats.violations;
+            streamMs = BenchStream(0, BENCH_REGION, chunk, &status);
+            transactions = sim.stats.transactions - transactions;
+            efficiency = 100.0 * wire / streamMs;
+            /* Processing-bound when 4 KiB take longer to process than to receive */
+            bound = (processNs * 1e-6 > wire * 4096 / BENCH_REGION);
+            fail |= (status != SPIFLASH_SUCCESS) || (received != BENCH_REGION) || bad || (transactions != 1)
+                    || (sim.stats.violations != violations) || (!bound && (efficiency < 99.0));
+            printf(" | stream %7.1f ms (%u CS), %5.1f%% of wire speed%s, bad %u\n", streamMs, transactions,
+                   efficiency, bound ? " (processing-bound)" : "", bad);
+        }
+    }
+
+    /* Odd alignment and a short last chunk */
+    bad = 0;
+    processNs = 0;
+    BenchStream(12345, 100000, 4096, &status);
+    fail |= (status != SPIFLASH_SUCCESS) || (received != 100000) || bad;
+    printf("stream of 100000 B at 12345: got %u, bad %u %s\n", received, bad,
+           ((status != SPIFLASH_SUCCESS) || (received != 100000) || bad) ? "FAIL" : "ok");
+
+    /* Every other call is refused while the stream runs */
+    base = 0;
+    received = 0;
+    fail |= (SPIFlashReadStream(&flash, 0, 8192, buffer0, buffer1, 4096, BenchProcess, NULL) != SPIFLASH_SUCCESS);
+    status = SPIFlashReadAddress(&flash, 0, chunked, 4);
+    fail |= (status != SPIFLASH_BUSY) || (SPIFlashEraseSector(&flash, 5) != SPIFLASH_BUSY);
+    while (SPIFlashPoll(&flash) == SPIFLASH_BUSY) {
+        SPIFlashSimAdvanceNs(1000);
+    }
+    fail |= (SPIFlashReadAddress(&flash, 0, chunked, 4) != SPIFLASH_SUCCESS) || (received != 8192) || bad;
+    printf("calls during a stream: read %d, then %d after it %s\n", status,
+           SPIFlashReadAddress(&flash, 0, chunked, 4), fail ? "FAIL" : "ok");
+    printf("simulator timing violations: %u\n", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
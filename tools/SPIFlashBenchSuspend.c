@@ -0,0 +1,141 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchSuspend.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark of read latency during background erases
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchSuspend \
+ *         tools/SPIFlashBenchSuspend.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchSuspend
+ * Issues 64 B reads every 0.2-1 ms during 8 back-to-back 64 KiB asynchronous erases and reports the read latency
+ * and the total erase time. Add -DSPIFLASH_SUSPEND=0 to compare with reads waiting for the erases. The exit status
+ * is non-zero if data is wrong, if a read overlapping the erase is served or if the simulator flags a protocol
+ * violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_SIZE   (1UL << 24)
+#define BENCH_BLOCKS 8
+#define BENCH_READS  100000
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static double latency[BENCH_READS];
+static uint32_t done;
+
+/* Private functions ---------------------------------------------------------*/
+
+static void BenchDone(SPIFlashStatus_t status, void* context) {
+    (void)context;
+    done = (status == SPIFLASH_SUCCESS) ? 1 : 2;
+}
+
+static int BenchCompare(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y) ? -1 : (x > y);
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(void) {
+    SPIFlashSimConfig_t config;
+    uint32_t reads = 0;
+    uint64_t start;
+    double ms;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    for (uint32_t i = 0; i < 65536; i++) {
+        memory[i] = (uint8_t)i;
+    }
+
+    /* Block 0 holds the data being read, blocks 1 to 8 are erased */
+    start = SPIFlashSimGetTimeNs();
+    for (uint32_t block = 1; block <= BENCH_BLOCKS; block++) {
+        done = 0;
+        fail |= (SPIFlashEraseBlockAsync(&flash, block, BenchDone, NULL) != SPIFLASH_SUCCESS);
+        while (!done && (reads < BENCH_READS)) {
+            uint8_t data[64];
+            uint32_t address = (uint32_t)rand() % (65536 - sizeof(data));
+            uint64_t issued;
+
+            SPIFlashSimAdvanceNs(200000 + (uint64_t)(rand() % 800000));
+            SPIFlashPoll(&flash);
+            if (done) {
+                break;
+            }
+            issued = SPIFlashSimGetTimeNs();
+            while (SPIFlashReadAddress(&flash, address, data, sizeof(data)) == SPIFLASH_BUSY) {
+                SPIFlashSimAdvanceNs(100000);
+                SPIFlashPoll(&flash);
+            }
+            latency[reads++] = (double)(SPIFlashSimGetTimeNs() - issued) / 1e3;
+            for (uint32_t i = 0; i < sizeof(data); i++) {
+                fail |= (data[i] != (uint8_t)(address + i));
+            }
+        }
+        fail |= (done != 1);
+    }
+    ms = (double)(SPIFlashSimGetTimeNs() - start) / 1e6;
+    qsort(latency, reads, sizeof(latency[0]), BenchCompare);
+    printf("SUSPEND=%d: %u reads during %u x 64 KiB erases, latency p50 %.1f us p99 %.1f us max %.1f us, "
+           "erases took %.1f ms\n",
+           SPIFLASH_SUSPEND, reads, BENCH_BLOCKS, latency[reads / 2], latency[reads * 99 / 100], latency[reads - 1],
+           ms);
+
+    /* The array returns undefined data in the region being erased: such reads must not suspend */
+    done = 0;
+    fail |= (SPIFlashEraseSectorAsync(&flash, 0, BenchDone, NULL) != SPIFLASH_SUCCESS);
+    fail |= (SPIFlashReadAddress(&flash, 100, (uint8_t[4]){0}, 4) != SPIFLASH_BUSY);
+    while (!done) {
+        SPIFlashSimAdvanceNs(1000000);
+        SPIFlashPoll(&flash);
+    }
+    fail |= (done != 1);
+    printf("overlapping read deferred, violations %u %s\n", sim.stats.violations, fail ? "FAIL" : "ok");
+    return fail || (sim.stats.violations != 0);
+}
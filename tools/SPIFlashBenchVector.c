@@ -0,0 +1,241 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashBenchVector.c
+ * \author          Andrea Vivani
+ * \brief           Simulator benchmark and fuzz test of scatter-gather reads and writes
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+
+/*
+ * Build and run on the host, from the repository root:
+ *     cc -O2 -I. -DSPIFLASH_PLATFORM=SPIFLASH_PLATFORM_SIM -DSPIFLASH_DEBUG=0 -o SPIFlashBenchVector \
+ *         tools/SPIFlashBenchVector.c SPIFlash*.c -lpthread
+ *     ./SPIFlashBenchVector [iterations]
+ * Add -DSPIFLASH_CACHE_LINES=8 and -DSPIFLASH_WRITE_COMBINE=1 to run it through the read cache and write-combining.
+ * Compares SPIFlashReadv() and SPIFlashWritev() with one SPIFlashReadAddress() or SPIFlashWriteAddress() per segment
+ * for a few record layouts, printing time, bus transactions and page programs. Then runs random segment lists, with
+ * gaps, empty segments and page crossings, through SPIFlashWritev() and SPIFlashReadv() against a RAM model of the
+ * flash (300 iterations by default). Times are simulated W25Q128JV times. The exit status is non-zero if the flash,
+ * the model and the read back data disagree, or the simulator flags a protocol violation.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "SPIFlash.h"
+#include "SPIFlashSim.h"
+
+/* Macros ---------------------------------------------------------------------*/
+
+#define BENCH_CAPACITY 0x18 /* JEDEC capacity code of the simulated chip, 16 MiB */
+#define BENCH_SIZE     (1UL << 24)
+#define BENCH_FUZZ     0x300000 /* fuzz area, 64 KiB */
+#define BENCH_SEGMENTS 16
+#define BENCH_LENGTH   300 /* longest fuzz segment */
+
+/* Private variables ---------------------------------------------------------*/
+
+static uint8_t memory[BENCH_SIZE], model[BENCH_SIZE];
+static SPIFlashSim_t sim;
+static SPIFlash_t flash;
+static uint64_t startNs;
+static uint32_t startTransactions, startPrograms;
+static uint32_t seed = 1;
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint32_t BenchRandom(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void BenchStart(void) {
+    startNs = SPIFlashSimGetTimeNs();
+    startTransactions = sim.stats.transactions;
+    startPrograms = sim.stats.programs;
+}
+
+static void BenchStop(const char* name) {
+    printf("  %-38s %8.1f us %4u transactions %2u programs\n", name, (double)(SPIFlashSimGetTimeNs() - startNs) / 1e3,
+           sim.stats.transactions - startTransactions, sim.stats.programs - startPrograms);
+}
+
+/* Flash content must match the model, after any combined write is programmed */
+static int BenchFlash(uint32_t address, uint32_t length) {
+    SPIFlashFlush(&flash);
+    return memcmp(&memory[address], &model[address], length) != 0;
+}
+
+static int BenchReads(void) {
+    static uint8_t single[4096], vector[4096];
+    SPIFlashSegment_t segments[8];
+    int fail;
+
+    printf("16 B header + 240 B body, contiguous:\n");
+    BenchStart();
+    SPIFlashReadAddress(&flash, 5000, single, 16);
+    SPIFlashReadAddress(&flash, 5016, &single[16], 240);
+    BenchStop("2 x SPIFlashReadAddress()");
+    segments[0] = (SPIFlashSegment_t){5000, vector, 16};
+    segments[1] = (SPIFlashSegment_t){5016, &vector[16], 240};
+    BenchStart();
+    fail = (SPIFlashReadv(&flash, segments, 2) != SPIFLASH_SUCCESS);
+    BenchStop("SPIFlashReadv()");
+    fail |= memcmp(single, &model[5000], 256) || memcmp(vector, &model[5000], 256);
+
+    printf("8 scattered 8 B fields:\n");
+    BenchStart();
+    for (uint32_t i = 0; i < 8; i++) {
+        SPIFlashReadAddress(&flash, i * 70000 + 11, &single[8 * i], 8);
+    }
+    BenchStop("8 x SPIFlashReadAddress()");
+    for (uint32_t i = 0; i < 8; i++) {
+        segments[i] = (SPIFlashSegment_t){i * 70000 + 11, &vector[8 * i], 8};
+    }
+    BenchStart();
+    fail |= (SPIFlashReadv(&flash, segments, 8) != SPIFLASH_SUCCESS);
+    BenchStop("SPIFlashReadv()");
+    for (uint32_t i = 0; i < 8; i++) {
+        fail |= memcmp(&vector[8 * i], &model[i * 70000 + 11], 8) != 0;
+    }
+    fail |= memcmp(single, vector, 64) != 0;
+    return fail;
+}
+
+static int BenchWrites(void) {
+    uint8_t field[8][4];
+    SPIFlashSegment_t segments[8];
+    SPIFlashStatus_t status;
+    int fail = 0;
+
+    for (uint32_t i = 0; i < 8; i++) {
+        memset(field[i], 0x10 + i, sizeof(field[i]));
+    }
+    printf("8 x 4 B fields in one page, 28 B apart:\n");
+    BenchStart();
+    for (uint32_t i = 0; i < 8; i++) {
+        fail |= (SPIFlashWriteAddress(&flash, 0x200000 + i * 32, field[i], 4) != SPIFLASH_SUCCESS);
+        memcpy(&model[0x200000 + i * 32], field[i], 4);
+    }
+    SPIFlashFlush(&flash);
+    BenchStop("8 x SPIFlashWriteAddress()");
+    for (uint32_t i = 0; i < 8; i++) {
+        segments[i] = (SPIFlashSegment_t){0x201000 + i * 32, field[i], 4};
+        memcpy(&model[0x201000 + i * 32], field[i], 4);
+    }
+    BenchStart();
+    fail |= (SPIFlashWritev(&flash, segments, 8) != SPIFLASH_SUCCESS);
+    BenchStop("SPIFlashWritev()");
+
+    /* The gaps now hold data: with VERIFY they are read first so the compare sees it */
+    SPIFlashSetOptions(&flash, SPIFLASH_OPT_VERIFY);
+    for (uint32_t i = 0; i < 8; i++) {
+        segments[i] = (SPIFlashSegment_t){0x200004 + i * 32, field[7 - i], 4};
+        memcpy(&model[0x200004 + i * 32], field[7 - i], 4);
+    }
+    BenchStart();
+    status = SPIFlashWritev(&flash, segments, 8);
+    BenchStop("SPIFlashWritev(), VERIFY, data in gaps");
+    SPIFlashSetOptions(&flash, 0);
+    fail |= (status != SPIFLASH_SUCCESS) || BenchFlash(0x200000, 0x2000);
+    return fail;
+}
+
+/* Random segment lists in increasing order, written to erased model bytes only and read back two ways */
+static uint32_t BenchFuzz(uint32_t iterations) {
+    static uint8_t source[BENCH_SEGMENTS][BENCH_LENGTH], readback[BENCH_SEGMENTS][BENCH_LENGTH];
+    SPIFlashSegment_t segments[BENCH_SEGMENTS], reads[BENCH_SEGMENTS];
+    uint32_t bad = 0, erases = 0, segmentsTotal = 0;
+
+    SPIFlashEraseRange(&flash, BENCH_FUZZ, 0x10000);
+    memset(&model[BENCH_FUZZ], 0xFF, 0x10000);
+    for (uint32_t it = 0; it < iterations; it++) {
+        uint32_t count = 0, limit = 1 + BenchRandom() % 12, erased = 1;
+        uint32_t address = BENCH_FUZZ + (BenchRandom() % 200) * 256 + BenchRandom() % 64;
+
+        while ((count < limit) && (address + BENCH_LENGTH < BENCH_FUZZ + 0x10000)) {
+            uint32_t length = (BenchRandom() % 5 == 0) ? 0 : BenchRandom() % BENCH_LENGTH;
+            for (uint32_t k = 0; k < length; k++) {
+                source[count][k] = (uint8_t)BenchRandom();
+                erased &= (model[address + k] == 0xFF);
+            }
+            segments[count] = (SPIFlashSegment_t){address, source[count], length};
+            count++;
+            address += length + BenchRandom() % 40;
+        }
+        if (!erased) {
+            SPIFlashEraseRange(&flash, BENCH_FUZZ, 0x10000);
+            memset(&model[BENCH_FUZZ], 0xFF, 0x10000);
+            erases++;
+        }
+        for (uint32_t k = 0; k < count; k++) {
+            memcpy(&model[segments[k].address], segments[k].data, segments[k].length);
+            reads[k] = (SPIFlashSegment_t){segments[k].address, readback[k], segments[k].length};
+        }
+        SPIFlashSetOptions(&flash, (BenchRandom() % 4 == 0) ? SPIFLASH_OPT_VERIFY : 0);
+        bad += (SPIFlashWritev(&flash, segments, count) != SPIFLASH_SUCCESS);
+        bad += (SPIFlashReadv(&flash, reads, count) != SPIFLASH_SUCCESS);
+        for (uint32_t k = 0; k < count; k++) {
+            bad += (memcmp(readback[k], segments[k].data, segments[k].length) != 0);
+        }
+        bad += BenchFlash(BENCH_FUZZ, 0x10000);
+        segmentsTotal += count;
+    }
+    SPIFlashSetOptions(&flash, 0);
+    printf("fuzz: %u iterations, %u segments, %u erases, %u failures %s\n", iterations, segmentsTotal, erases, bad,
+           bad ? "FAIL" : "ok");
+    return bad;
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(int argc, char* argv[]) {
+    SPIFlashSimConfig_t config;
+    uint32_t iterations = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : 300;
+    int fail;
+
+    SPIFlashSimDefaultConfig(&config);
+    config.capacity = BENCH_CAPACITY;
+    fail = (SPIFlashSimInit(&sim, &config, memory) != SPIFLASH_SUCCESS)
+           || (SPIFlashInit(&flash, &sim, &sim, 0) != SPIFLASH_SUCCESS);
+    memset(model, 0xFF, sizeof(model));
+    for (uint32_t i = 0; i < (1UL << 20); i++) {
+        model[i] = (uint8_t)(i * 7 + 3);
+    }
+    fail |= (SPIFlashWriteAddress(&flash, 0, model, 1UL << 20) != SPIFLASH_SUCCESS);
+
+    fail |= BenchReads();
+    fail |= BenchWrites();
+    fail |= (BenchFuzz(iterations) != 0);
+    fail |= BenchFlash(0, BENCH_SIZE);
+    printf("flash and model %s, simulator timing violations: %u\n", fail ? "FAIL" : "ok", sim.stats.violations);
+    return fail || (sim.stats.violations != 0);
+}
@@ -0,0 +1,262 @@
+/* BEGIN Header */
+/**
+ ******************************************************************************
+ * \file            SPIFlashTrace.c
+ * \author          Andrea Vivani
+ * \brief           Host-side decoder of SPI flash trace dumps (see SPIFLASH_TRACE)
+ ******************************************************************************
+ * \copyright
+ *
+ * Copyright 2023 Andrea Vivani
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the “Software”), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ *
+ ******************************************************************************
+ */
+/* END Header */
+
+/*
+ * Dump the SPIFlashTrace_t object from the target, e.g. with gdb:
+ *     dump binary value trace.bin trace
+ * then build and run on the host:
+ *     cc -O2 -o SPIFlashTrace tools/SPIFlashTrace.c
+ *     ./SPIFlashTrace trace.bin        timeline and summary
+ *     ./SPIFlashTrace -s trace.bin     summary only
+ * The dump is decoded field by field as little-endian, so the host needs neither the target compiler nor its
+ * SPIFLASH_TRACE setting.
+ */
+
+/* Includes ------------------------------------------------------------------*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Macros ---------------------------------------------------------------------*/
+
+/* Must match SPIFlash.h */
+#define TRACE_MAGIC      0x52544653
+#define TRACE_ASYNC      0x80
+#define TRACE_HEADER     12
+#define TRACE_ENTRY_SIZE 20
+#define TRACE_SUSPEND    4
+#define TRACE_EVENTS     5
+#define TRACE_STATUSES   4
+
+/* Typedefs ------------------------------------------------------------------*/
+
+typedef struct {
+    uint32_t start, end, address, length;
+    uint8_t event, opcode, status, id;
+} TraceEntry_t;
+
+typedef struct {
+    uint8_t event, opcode;
+    uint32_t count, failed, max;
+    uint64_t bytes, total;
+} TraceSummary_t;
+
+/* Private variables ---------------------------------------------------------*/
+
+static const char* eventName[TRACE_EVENTS] = {"READ", "PROGRAM", "ERASE", "WRSTATUS", "SUSPEND"};
+static const char* statusName[TRACE_STATUSES] = {"ok", "ERROR", "TIMEOUT", "BUSY"};
+
+/* Private functions ---------------------------------------------------------*/
+
+static uint32_t TraceGet32(const uint8_t* data) {
+    return (uint32_t)data[0] | ((uint32_t)data[1] << 8) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24);
+}
+
+static uint16_t TraceGet16(const uint8_t* data) { return (uint16_t)(data[0] | (data[1] << 8)); }
+
+static const char* TraceOpcodeName(uint8_t opcode) {
+    switch (opcode) {
+        case 0x03: return "READ";
+        case 0x13: return "READ4";
+        case 0x0B: return "FASTREAD";
+        case 0x0C: return "FASTREAD4";
+        case 0x3B: return "DUALOUT";
+        case 0x3C: return "DUALOUT4";
+        case 0xBB: return "DUALIO";
+        case 0xBC: return "DUALIO4";
+        case 0x6B: return "QUADOUT";
+        case 0x6C: return "QUADOUT4";
+        case 0xEB: return "QUADIO";
+        case 0xEC: return "QUADIO4";
+        case 0x02: return "PP";
+        case 0x12: return "PP4";
+        case 0x32: return "QPP";
+        case 0x34: return "QPP4";
+        case 0x20: return "SE4K";
+        case 0x21: return "SE4K4";
+        case 0x52: return "BE32K";
+        case 0x5C: return "BE32K4";
+        case 0xD8: return "BE64K";
+        case 0xDC: return "BE64K4";
+        case 0x60:
+        case 0xC7: return "CE";
+        case 0x01: return "WRSR1";
+        case 0x31: return "WRSR2";
+        case 0x11: return "WRSR3";
+        case 0x75:
+        case 0xB0: return "SUSPEND";
+        default: return "?";
+    }
+}
+
+static void TracePrintEntry(uint32_t index, const TraceEntry_t* entry, uint32_t origin, uint32_t gap) {
+    uint8_t event = entry->event & ~TRACE_ASYNC;
+    printf("%8u %3u %12.3f %10u %10u  %-9s%c %-9s 0x%02X  0x%08X %9u  %s\n", index, entry->id,
+           (entry->start - origin) / 1000.0, entry->end - entry->start, gap,
+           (event < TRACE_EVENTS) ? eventName[event] : "?", (entry->event & TRACE_ASYNC) ? '*' : ' ',
+           TraceOpcodeName(entry->opcode), entry->opcode, entry->address, entry->length,
+           (entry->status < TRACE_STATUSES) ? statusName[entry->status] : "?");
+}
+
+static void TraceSummaryAdd(TraceSummary_t* summary, uint32_t* count, const TraceEntry_t* entry) {
+    uint32_t i, duration = entry->end - entry->start;
+    for (i = 0; i < *count; i++) {
+        if ((summary[i].event == entry->event) && (summary[i].opcode == entry->opcode)) {
+            break;
+        }
+    }
+    if (i == *count) {
+        memset(&summary[i], 0, sizeof(TraceSummary_t));
+        summary[i].event = entry->event;
+        summary[i].opcode = entry->opcode;
+        (*count)++;
+    }
+    summary[i].count++;
+    summary[i].failed += (entry->status != 0);
+    if ((entry->event & ~TRACE_ASYNC) != TRACE_SUSPEND) {
+        summary[i].bytes += entry->length;
+    }
+    summary[i].total += duration;
+    if (duration > summary[i].max) {
+        summary[i].max = duration;
+    }
+}
+
+/* Public functions ----------------------------------------------------------*/
+
+int main(int argc, char** argv) {
+    uint8_t* dump;
+    const char* path = NULL;
+    int timeline = 1;
+    long size;
+    FILE* file;
+    uint32_t entrySize, entries, head, first, valid, origin = 0, previous = 0, busy = 0;
+    TraceEntry_t entry;
+    TraceSummary_t summary[256];
+    uint32_t summaryCount = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0) {
+            timeline = 0;
+        } else {
+            path = argv[i];
+        }
+    }
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [-s] trace.bin\n", argv[0]);
+        return 1;
+    }
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    dump = malloc((size > 0) ? size : 1);
+    if ((dump == NULL) || (fread(dump, 1, size, file) != (size_t)size) || (size < TRACE_HEADER)) {
+        fprintf(stderr, "%s: cannot read trace\n", path);
+        return 1;
+    }
+    fclose(file);
+
+    entrySize = TraceGet16(&dump[4]);
+    entries = TraceGet16(&dump[6]);
+    head = TraceGet32(&dump[8]);
+    if ((TraceGet32(dump) != TRACE_MAGIC) || (entrySize < TRACE_ENTRY_SIZE) || (entries == 0)
+        || ((long)(TRACE_HEADER + entries * entrySize) > size)) {
+        fprintf(stderr, "%s: not a SPI flash trace\n", path);
+        return 1;
+    }
+    valid = (head < entries) ? head : entries;
+    first = head - valid;
+    printf("%u events recorded, %u in buffer%s\n\n", head, valid, (head > entries) ? " (oldest overwritten)" : "");
+
+    if (timeline) {
+        printf("%8s %3s %12s %10s %10s  %-10s %-9s %-4s  %-10s %9s  %s\n", "#", "id", "start ms", "us", "idle us",
+               "event", "command", "", "address", "bytes", "status");
+    }
+    for (uint32_t i = first; i != head; i++) {
+        const uint8_t* raw = &dump[TRACE_HEADER + (i % entries) * entrySize];
+        entry.start = TraceGet32(&raw[0]);
+        entry.end = TraceGet32(&raw[4]);
+        entry.address = TraceGet32(&raw[8]);
+        entry.length = TraceGet32(&raw[12]);
+        entry.event = raw[16];
+        entry.opcode = raw[17];
+        entry.status = raw[18];
+        entry.id = raw[19];
+        if (i == first) {
+            origin = entry.start;
+            previous = entry.start;
+        }
+        /* Suspensions happen inside other operations: they are not bus activity of their own */
+        if ((entry.event & ~TRACE_ASYNC) != TRACE_SUSPEND) {
+            busy += entry.end - entry.start;
+        }
+        if (timeline) {
+            TracePrintEntry(i, &entry, origin,
+                            ((int32_t)(entry.start - previous) > 0) ? entry.start - previous : 0);
+        }
+        if ((int32_t)(entry.end - previous) > 0) {
+            previous = entry.end;
+        }
+        if (summaryCount < 256) {
+            TraceSummaryAdd(summary, &summaryCount, &entry);
+        }
+    }
+
+    if (valid == 0) {
+        return 0;
+    }
+    printf("\n%-10s %-9s %8s %8s %12s %12s %10s %10s %10s\n", "event", "command", "count", "failed", "bytes",
+           "total ms", "avg us", "max us", "KiB/s");
+    for (uint32_t i = 0; i < summaryCount; i++) {
+        uint8_t event = summary[i].event & ~TRACE_ASYNC;
+        char name[16];
+        snprintf(name, sizeof(name), "%s%s", (event < TRACE_EVENTS) ? eventName[event] : "?",
+                 (summary[i].event & TRACE_ASYNC) ? "*" : "");
+        printf("%-10s %-9s %8u %8u %12llu %12.3f %10.1f %10u %10.1f\n", name, TraceOpcodeName(summary[i].opcode),
+               summary[i].count, summary[i].failed, (unsigned long long)summary[i].bytes, summary[i].total / 1000.0,
+               (double)summary[i].total / summary[i].count, summary[i].max,
+               summary[i].total ? (summary[i].bytes * 1e6 / 1024.0) / summary[i].total : 0.0);
+    }
+    /* Reads served while an asynchronous operation is in progress overlap it, so this can exceed 100% */
+    printf("\nspan %.3f ms, operations %.1f%% of it (* asynchronous)\n", (previous - origin) / 1000.0,
+           (previous != origin) ? 100.0 * busy / (previous - origin) : 0.0);
+    free(dump);
+    return 0;
+}